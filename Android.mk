@@ -14,13 +14,13 @@ LOCAL_CFLAGS += -fno-short-enums
 LOCAL_CFLAGS += -Wno-unused-parameter -Wno-missing-field-initializers
 LOCAL_CFLAGS += -pthread
 
-LOCAL_CFLAGS += -DV4L2DEVICE_FPS_LIMIT=60
+LOCAL_CFLAGS += -DV4L2DEVICE_MAX_BUF_COUNT=8
+LOCAL_CFLAGS += -DV4L2DEVICE_BUF_MARGIN=2
+# Memory budget for V4L2 buffers in MiB
+LOCAL_CFLAGS += -DV4L2DEVICE_MEM_BUDGET=64
 
-LOCAL_CFLAGS += -DV4L2DEVICE_BUF_COUNT=4
-
-# Camera color format
-LOCAL_CFLAGS += -DV4L2DEVICE_PIXEL_FORMAT=V4L2_PIX_FMT_UYVY
-#LOCAL_CFLAGS += -DV4L2DEVICE_PIXEL_FORMAT=V4L2_PIX_FMT_YUYV
+# Capture requests processed at the same time
+LOCAL_CFLAGS += -DCAMERA_PIPELINE_DEPTH=3
 
 # Configure and open device once on HAL start
 LOCAL_CFLAGS += -DV4L2DEVICE_OPEN_ONCE
@@ -32,9 +32,6 @@ LOCAL_CFLAGS += -DV4L2DEVICE_USE_POLL
 #LOCAL_CFLAGS += -UNDEBUG -DDEBUG
 
 
-LOCAL_STATIC_LIBRARIES := \
-    libyuv_static
-
 LOCAL_SHARED_LIBRARIES := \
     liblog \
     libutils \
@@ -48,7 +45,6 @@ LOCAL_SHARED_LIBRARIES := \
 
 LOCAL_C_INCLUDES += \
     external/jpeg \
-    external/libyuv/files/include \
     frameworks/native/include/media/hardware \
     $(call include-path-for, camera)
 
@@ -62,6 +58,10 @@ LOCAL_SRC_FILES += \
     Camera.cpp \
     V4l2Device.cpp \
     ImageConverter.cpp \
+    Exif.cpp \
+    JpegCompressorPool.cpp \
+    ConverterKernels.cpp \
+    PartitionTuner.cpp \
     Workers.cpp \
     Yuv422UyvyToJpegEncoder.cpp
 
@@ -25,7 +25,11 @@
 #include <ui/Rect.h>
 #include <ui/GraphicBufferMapper.h>
 #include <ui/Fence.h>
+#include <cutils/properties.h>
 #include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
 
 #include "DbgUtils.h"
 #include "Camera.h"
@@ -46,7 +50,11 @@ namespace android {
 Camera::Camera()
     : mStaticCharacteristics(NULL)
     , mCallbackOps(NULL)
-    , mJpegBufferSize(0) {
+    , mJpegBufferSize(0)
+    , mInFlight(0)
+    , mPipelineDepth(CAMERA_PIPELINE_DEPTH)
+    , mPipelineExit(false)
+    , mJpegExit(false) {
     DBGUTILS_AUTOLOGCALL(__func__);
     for(size_t i = 0; i < NELEM(mDefaultRequestSettings); i++) {
         mDefaultRequestSettings[i] = NULL;
@@ -59,6 +67,8 @@ Camera::Camera()
     ops             = &sOps;
     priv            = NULL;
 
+    mFpsRange[0] = mFpsRange[1] = 0;
+
     mValid = true;
     mDev = new V4l2Device("/dev/video0");
     if(!mDev) {
@@ -68,6 +78,7 @@ Camera::Camera()
 
 Camera::~Camera() {
     DBGUTILS_AUTOLOGCALL(__func__);
+    stopPipeline();
     gWorkers.stop();
     mDev->disconnect();
     delete mDev;
@@ -91,6 +102,7 @@ int Camera::openDevice(hw_device_t **device) {
     *device = &common;
 
     gWorkers.start();
+    startPipeline();
 
     return NO_ERROR;
 }
@@ -99,6 +111,8 @@ int Camera::closeDevice() {
     DBGUTILS_AUTOLOGCALL(__func__);
     Mutex::Autolock lock(mMutex);
 
+    waitForPipelineIdle();
+    stopPipeline();
     gWorkers.stop();
     mDev->disconnect();
 
@@ -111,8 +125,10 @@ camera_metadata_t *Camera::staticCharacteristics() {
 
     CameraMetadata cm;
 
-    auto &resolutions = mDev->availableResolutions();
-    auto &previewResolutions = resolutions;
+    Vector<V4l2Device::Resolution> resolutions;
+    Vector<V4l2Device::Resolution> previewResolutions;
+    outputResolutions(HAL_PIXEL_FORMAT_BLOB, &resolutions);
+    outputResolutions(HAL_PIXEL_FORMAT_RGBA_8888, &previewResolutions);
     auto sensorRes = mDev->sensorResolution();
 
     /***********************************\
@@ -147,6 +163,9 @@ camera_metadata_t *Camera::staticCharacteristics() {
     static const int32_t scalerAvailableFormats[] = {
         HAL_PIXEL_FORMAT_RGBA_8888,
         HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED,
+        HAL_PIXEL_FORMAT_YCbCr_420_888,
+        HAL_PIXEL_FORMAT_YCrCb_420_SP,
+        HAL_PIXEL_FORMAT_YV12,
         /* Non-preview one, must be last - see following code */
         HAL_PIXEL_FORMAT_BLOB
     };
@@ -171,6 +190,8 @@ camera_metadata_t *Camera::staticCharacteristics() {
     size_t i1 = 0;
     /* Main stream configurations */
     for(size_t resId = 0; resId < resolutions.size(); ++resId) {
+        const int64_t minDuration = minFrameDuration(HAL_PIXEL_FORMAT_BLOB, resolutions[resId]);
+
         scalerAvailableStreamConfigurations[i4 + 0] = HAL_PIXEL_FORMAT_BLOB;
         scalerAvailableStreamConfigurations[i4 + 1] = (int32_t)resolutions[resId].width;
         scalerAvailableStreamConfigurations[i4 + 2] = (int32_t)resolutions[resId].height;
@@ -179,12 +200,12 @@ camera_metadata_t *Camera::staticCharacteristics() {
         scalerAvailableMinFrameDurations[i4 + 0] = HAL_PIXEL_FORMAT_BLOB;
         scalerAvailableMinFrameDurations[i4 + 1] = (int32_t)resolutions[resId].width;
         scalerAvailableMinFrameDurations[i4 + 2] = (int32_t)resolutions[resId].height;
-        scalerAvailableMinFrameDurations[i4 + 3] = 1000000000 / 60; /* TODO: read from the device */
+        scalerAvailableMinFrameDurations[i4 + 3] = minDuration;
 
         scalerAvailableJpegSizes[i2 + 0] = (int32_t)resolutions[resId].width;
         scalerAvailableJpegSizes[i2 + 1] = (int32_t)resolutions[resId].height;
 
-        scalerAvailableJpegMinDurations[i1] = 1000000000 / 60; /* TODO: read from the device */
+        scalerAvailableJpegMinDurations[i1] = minDuration;
 
         i4 += 4;
         i2 += 2;
@@ -194,6 +215,9 @@ camera_metadata_t *Camera::staticCharacteristics() {
     i1 = 0;
     /* Preview stream configurations */
     for(size_t resId = 0; resId < previewResolutions.size(); ++resId) {
+        /* IMPLEMENTATION_DEFINED and YUV formats come from the same capture formats as RGBA */
+        const int64_t minDuration = minFrameDuration(HAL_PIXEL_FORMAT_RGBA_8888, previewResolutions[resId]);
+
         for(size_t fmtId = 0; fmtId < NELEM(scalerAvailableFormats) - 1; ++fmtId) {
             scalerAvailableStreamConfigurations[i4 + 0] = scalerAvailableFormats[fmtId];
             scalerAvailableStreamConfigurations[i4 + 1] = (int32_t)previewResolutions[resId].width;
@@ -203,14 +227,14 @@ camera_metadata_t *Camera::staticCharacteristics() {
             scalerAvailableMinFrameDurations[i4 + 0] = scalerAvailableFormats[fmtId];
             scalerAvailableMinFrameDurations[i4 + 1] = (int32_t)previewResolutions[resId].width;
             scalerAvailableMinFrameDurations[i4 + 2] = (int32_t)previewResolutions[resId].height;
-            scalerAvailableMinFrameDurations[i4 + 3] = 1000000000 / 60; /* TODO: read from the device */
+            scalerAvailableMinFrameDurations[i4 + 3] = minDuration;
 
             i4 += 4;
         }
         scalerAvailableProcessedSizes[i2 + 0] = (int32_t)previewResolutions[resId].width;
         scalerAvailableProcessedSizes[i2 + 1] = (int32_t)previewResolutions[resId].height;
 
-        scalerAvailableProcessedMinDurations[i1] = 1000000000 / 60; /* TODO: read from the device */
+        scalerAvailableProcessedMinDurations[i1] = minDuration;
 
         i2 += 2;
         i1 += 1;
@@ -226,7 +250,9 @@ camera_metadata_t *Camera::staticCharacteristics() {
 
     /* ~8.25 bit/px (https://en.wikipedia.org/wiki/JPEG#Sample_photographs) */
     /* Use 9 bit/px, add buffer info struct size, round up to page size */
-    mJpegBufferSize = sensorRes.width * sensorRes.height * 9 + sizeof(camera3_jpeg_blob);
+    mJpegBufferSize = (size_t)sensorRes.width * sensorRes.height * 9 / 8 + sizeof(camera3_jpeg_blob);
+    /* EXIF data with thumbnail */
+    mJpegBufferSize += Exif::MAX_SIZE;
     mJpegBufferSize = (mJpegBufferSize + PAGE_SIZE - 1u) & ~(PAGE_SIZE - 1u);
     const int32_t jpegMaxSize = (int32_t)mJpegBufferSize;
     cm.update(ANDROID_JPEG_MAX_SIZE, &jpegMaxSize, 1);
@@ -282,10 +308,19 @@ camera_metadata_t *Camera::staticCharacteristics() {
     int32_t controlAeCompensationRange[] = {-9, 9};
     cm.update(ANDROID_CONTROL_AE_COMPENSATION_RANGE, controlAeCompensationRange, NELEM(controlAeCompensationRange));
 
-    static const int32_t controlAeAvailableTargetFpsRanges[] = {
-        60, 60
-    };
-    cm.update(ANDROID_CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES, controlAeAvailableTargetFpsRanges, NELEM(controlAeAvailableTargetFpsRanges));
+    /* Fixed ranges for every supported frame rate and one variable range */
+    Vector<int32_t> fps;
+    supportedFps(&fps);
+    Vector<int32_t> controlAeAvailableTargetFpsRanges;
+    for(size_t i = 0; i < fps.size(); ++i) {
+        controlAeAvailableTargetFpsRanges.add(fps[i]);
+        controlAeAvailableTargetFpsRanges.add(fps[i]);
+    }
+    if(fps.size() > 1) {
+        controlAeAvailableTargetFpsRanges.add(fps[0]);
+        controlAeAvailableTargetFpsRanges.add(fps.top());
+    }
+    cm.update(ANDROID_CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES, controlAeAvailableTargetFpsRanges.array(), controlAeAvailableTargetFpsRanges.size());
 
     static const uint8_t controlAeAvailableAntibandingModes[] = {
             ANDROID_CONTROL_AE_ANTIBANDING_MODE_OFF
@@ -422,8 +457,10 @@ const camera_metadata_t * Camera::constructDefaultRequestSettings(int type) {
     static const int32_t controlAeExposureCompensation = 0;
     cm.update(ANDROID_CONTROL_AE_EXPOSURE_COMPENSATION, &controlAeExposureCompensation, 1);
 
-    static const int32_t controlAeTargetFpsRange[] = {
-        10, 60
+    Vector<int32_t> fps;
+    supportedFps(&fps);
+    const int32_t controlAeTargetFpsRange[] = {
+        fps[0], fps.top()
     };
     cm.update(ANDROID_CONTROL_AE_TARGET_FPS_RANGE, controlAeTargetFpsRange, NELEM(controlAeTargetFpsRange));
 
@@ -465,6 +502,9 @@ int Camera::configureStreams(camera3_stream_configuration_t *streamList) {
 
     /* TODO: sanity checks */
 
+    /* Device reconfiguration must not race with requests still in flight */
+    waitForPipelineIdle();
+
     ALOGV("+-------------------------------------------------------------------------------");
     ALOGV("| STREAMS FROM FRAMEWORK");
     ALOGV("+-------------------------------------------------------------------------------");
@@ -500,8 +540,12 @@ int Camera::configureStreams(camera3_stream_configuration_t *streamList) {
 
         /* TODO: validate format */
 
+        /* Video encoders take YUV directly, everything else gets RGBA */
         if(newStream->format == HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED) {
-            newStream->format = HAL_PIXEL_FORMAT_RGBA_8888;
+            if(newStream->usage & GRALLOC_USAGE_HW_VIDEO_ENCODER)
+                newStream->format = HAL_PIXEL_FORMAT_YCbCr_420_888;
+            else
+                newStream->format = HAL_PIXEL_FORMAT_RGBA_8888;
         }
 
         /* TODO: support ZSL */
@@ -517,8 +561,6 @@ int Camera::configureStreams(camera3_stream_configuration_t *streamList) {
             case CAMERA3_STREAM_INPUT:          newStream->usage = GRALLOC_USAGE_SW_READ_OFTEN;                                 break;
             case CAMERA3_STREAM_BIDIRECTIONAL:  newStream->usage = GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_SW_READ_OFTEN;  break;
         }
-        newStream->max_buffers = 1; /* TODO: support larger queue */
-
         if(newStream->width * newStream->height > width * height) {
             width = newStream->width;
             height = newStream->height;
@@ -527,15 +569,32 @@ int Camera::configureStreams(camera3_stream_configuration_t *streamList) {
         /* TODO: store stream pointers somewhere and configure only new ones */
     }
 
+    const uint32_t pixFmt = chooseCaptureFormat(streamList, width, height);
+    if(!pixFmt) {
+        ALOGE("No capture format can provide all streams at %ux%u", width, height);
+        return BAD_VALUE;
+    }
+
     if(!mDev->setStreaming(false)) {
         ALOGE("Could not stop streaming");
         return NO_INIT;
     }
-    if(!mDev->setResolution(width, height)) {
-        ALOGE("Could not set resolution");
+    mDev->setMaxLockedBuffers(CAMERA_PIPELINE_DEPTH);
+    if(!mDev->setFormat(pixFmt, width, height)) {
+        ALOGE("Could not set format");
         return NO_INIT;
     }
 
+    /* Every request in flight holds one buffer; the kernel and the ring need
+     * at least one each. Large frames might get less buffers than we asked */
+    const unsigned bufCount = mDev->bufferCount();
+    mPipelineDepth = CAMERA_PIPELINE_DEPTH;
+    if(bufCount < mPipelineDepth + 2)
+        mPipelineDepth = bufCount > 3 ? bufCount - 2 : 1;
+    for(size_t i = 0; i < streamList->num_streams; ++i) {
+        streamList->streams[i]->max_buffers = mPipelineDepth;
+    }
+
     ALOGV("+-------------------------------------------------------------------------------");
     ALOGV("| STREAMS AFTER CHANGES");
     ALOGV("+-------------------------------------------------------------------------------");
@@ -574,21 +633,17 @@ int Camera::registerStreamBuffers(const camera3_stream_buffer_set_t *bufferSet)
     return OK;
 }
 
+/**
+ * Validates the request and queues it for processing in the pipeline threads.
+ *
+ * Blocks only when mPipelineDepth requests are already in flight.
+ */
 int Camera::processCaptureRequest(camera3_capture_request_t *request) {
     assert(request != NULL);
     Mutex::Autolock lock(mMutex);
 
-    BENCHMARK_HERE(120);
     FPSCOUNTER_HERE(120);
 
-    CameraMetadata cm;
-    const V4l2Device::VBuffer *frame = NULL;
-    auto res = mDev->resolution();
-    status_t e;
-    Vector<camera3_stream_buffer> buffers;
-
-    auto timestamp = systemTime();
-
     ALOGV("--- capture request --- f=%-5u in_buf=%p  out_bufs=%p[%u] --- fps %4.1f (avg %4.1f)",
           request->frame_number,
           request->input_buffer,
@@ -607,87 +662,354 @@ int Camera::processCaptureRequest(camera3_capture_request_t *request) {
         request->input_buffer->release_fence = -1;
     }
 
-    if(!request->settings) {
-        cm.acquire(mLastRequestSettings);
+    Request *req = new Request;
+    req->frameNumber = request->frame_number;
+    req->frame = NULL;
+    req->timestamp = 0;
+    req->jpegBuffer = -1;
+    req->resultSent = false;
+
+    if(request->settings) {
+        req->settings = request->settings;
+        // Cache the settings for next time
+        mLastRequestSettings = req->settings;
     } else {
-        cm = request->settings;
+        req->settings = mLastRequestSettings;
     }
 
-    notifyShutter(request->frame_number, (uint64_t)timestamp);
+    if(req->settings.exists(ANDROID_CONTROL_AE_TARGET_FPS_RANGE)) {
+        const int32_t *fpsRange = req->settings.find(ANDROID_CONTROL_AE_TARGET_FPS_RANGE).data.i32;
+        if(fpsRange[0] != mFpsRange[0] || fpsRange[1] != mFpsRange[1]) {
+            /* Sensor frame rate can be changed only with streaming stopped */
+            waitForPipelineIdle();
+            ALOGD("New FPS range: %d-%d", fpsRange[0], fpsRange[1]);
+            if(!mDev->setFrameRate((unsigned)fpsRange[0], (unsigned)fpsRange[1])) {
+                ALOGW("Could not set sensor frame rate, frames will be dropped");
+            }
+            mFpsRange[0] = fpsRange[0];
+            mFpsRange[1] = fpsRange[1];
+        }
+    }
 
-    BENCHMARK_SECTION("Lock/Read") {
-        frame = mDev->readLock();
+    req->buffers.setCapacity(request->num_output_buffers);
+    for(size_t i = 0; i < request->num_output_buffers; ++i) {
+        req->buffers.push_back(request->output_buffers[i]);
     }
 
-    if(!frame) {
-        return NOT_ENOUGH_DATA;
+    Mutex::Autolock pipelineLock(mPipelineMutex);
+    while(mInFlight >= mPipelineDepth) {
+        mPipelineCond.wait(mPipelineMutex);
     }
+    ++mInFlight;
+    mCaptureQueue.push_back(req);
+    mPipelineCond.broadcast();
 
-    buffers.setCapacity(request->num_output_buffers);
+    return NO_ERROR;
+}
 
-    uint8_t *rgbaBuffer = NULL;
-    for(size_t i = 0; i < request->num_output_buffers; ++i) {
-        const camera3_stream_buffer &srcBuf = request->output_buffers[i];
+/******************************************************************************\
+                                    PIPELINE
+\******************************************************************************/
+
+/*
+ * Requests go through two stages, each running in its own thread:
+ *
+ * capture: dequeues V4L2 frame and sends shutter notification
+ * result:  converts the frame into output buffers and sends capture result
+ *
+ * Both stages process requests in FIFO order, so results are always returned
+ * in frame number order, while capture of the next frame overlaps with
+ * conversion of the current one.
+ *
+ * Requests with a BLOB buffer also go through the JPEG stage, which encodes
+ * the image meanwhile and returns the buffer in a later result of the frame.
+ * The result stage does not wait for it, so still capture does not hold up
+ * preview. The request stays in flight, with its frame, until then.
+ */
+
+void Camera::startPipeline() {
+    if(mCaptureThread != NULL)
+        return;
+
+    /* Real time scheduling keeps other processes from delaying frames, when
+     * the HAL is allowed to use it */
+    int rtPriority = property_get_int32("ro.camera.v4l2device.rt_priority", 0);
+    if(rtPriority < 0)
+        rtPriority = 0;
+    if(rtPriority > 99)
+        rtPriority = 99;
+
+    mPipelineExit = false;
+    mJpegExit = false;
+    mCaptureThread = new PipelineThread(this, &Camera::captureStage, rtPriority);
+    mResultThread = new PipelineThread(this, &Camera::resultStage, rtPriority);
+    /* JPEG encoding is background work, like the worker tasks it queues */
+    mJpegThread = new PipelineThread(this, &Camera::jpegStage, 0);
+    mCaptureThread->run("Cam-Capture", PRIORITY_URGENT_DISPLAY);
+    mResultThread->run("Cam-Result", PRIORITY_URGENT_DISPLAY);
+    mJpegThread->run("Cam-Jpeg", PRIORITY_DEFAULT);
+}
+
+/**
+ * Switches the pipeline thread to SCHED_FIFO, if requested. Without the
+ * permission it keeps running with normal priority.
+ */
+status_t Camera::PipelineThread::readyToRun() {
+    if(mRtPriority <= 0)
+        return NO_ERROR;
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = mRtPriority;
+    if(sched_setscheduler(0, SCHED_FIFO, &param) != 0)
+        ALOGW("Could not set SCHED_FIFO priority %d: %s", mRtPriority, strerror(errno));
+    return NO_ERROR;
+}
+
+/**
+ * Stops pipeline threads. Requests which were not processed yet are returned
+ * to the framework with an error; JPEG images already being made are
+ * finished first.
+ */
+void Camera::stopPipeline() {
+    if(mCaptureThread == NULL)
+        return;
+
+    {
+        Mutex::Autolock lock(mPipelineMutex);
+        mPipelineExit = true;
+        mCaptureThread->requestExit();
+        mResultThread->requestExit();
+        mPipelineCond.broadcast();
+    }
+    mCaptureThread->join();
+    mResultThread->join();
+
+    /* No more requests come from the result stage */
+    {
+        Mutex::Autolock lock(mPipelineMutex);
+        mJpegExit = true;
+        mJpegThread->requestExit();
+        mPipelineCond.broadcast();
+    }
+    mJpegThread->join();
+    mCaptureThread.clear();
+    mResultThread.clear();
+    mJpegThread.clear();
+
+    List<Request *> pending;
+    {
+        Mutex::Autolock lock(mPipelineMutex);
+        for(auto it = mResultQueue.begin(); it != mResultQueue.end(); ++it)
+            pending.push_back(*it);
+        for(auto it = mCaptureQueue.begin(); it != mCaptureQueue.end(); ++it)
+            pending.push_back(*it);
+        mResultQueue.clear();
+        mCaptureQueue.clear();
+    }
+    for(auto it = pending.begin(); it != pending.end(); ++it) {
+        if((*it)->frame)
+            mDev->unlock((*it)->frame);
+        failRequest(*it);
+        finishRequest(*it);
+    }
+}
+
+/**
+ * Waits until all queued requests are processed.
+ */
+void Camera::waitForPipelineIdle() {
+    Mutex::Autolock lock(mPipelineMutex);
+    while(mInFlight > 0 && mCaptureThread != NULL) {
+        mPipelineCond.wait(mPipelineMutex);
+    }
+}
+
+bool Camera::captureStage() {
+    Request *req;
+    {
+        Mutex::Autolock lock(mPipelineMutex);
+        while(mCaptureQueue.empty() && !mPipelineExit)
+            mPipelineCond.wait(mPipelineMutex);
+
+        if(mPipelineExit)
+            return false;
+
+        req = *mCaptureQueue.begin();
+        mCaptureQueue.erase(mCaptureQueue.begin());
+    }
+
+    req->frame = mDev->readLock();
+
+    /* Failed requests go through result stage too to keep results in order */
+    if(req->frame) {
+        req->timestamp = req->frame->timestamp;
+        notifyShutter(req->frameNumber, (uint64_t)req->timestamp);
+    }
+
+    {
+        Mutex::Autolock lock(mPipelineMutex);
+        mResultQueue.push_back(req);
+        mPipelineCond.broadcast();
+    }
+
+    return true;
+}
+
+bool Camera::resultStage() {
+    Request *req;
+    {
+        Mutex::Autolock lock(mPipelineMutex);
+        while(mResultQueue.empty() && !mPipelineExit)
+            mPipelineCond.wait(mPipelineMutex);
+
+        if(mPipelineExit)
+            return false;
+
+        req = *mResultQueue.begin();
+        mResultQueue.erase(mResultQueue.begin());
+    }
+
+    if(req->frame) {
+        processRequest(req);
+    } else {
+        ALOGE("Could not read frame for request %u", req->frameNumber);
+        failRequest(req);
+    }
+
+    if(req->jpegBuffer >= 0) {
+        /* The JPEG stage finishes it, req may be gone after this */
+        Mutex::Autolock lock(mPipelineMutex);
+        req->resultSent = true;
+        mPipelineCond.broadcast();
+    } else {
+        finishRequest(req);
+    }
+
+    return true;
+}
+
+bool Camera::jpegStage() {
+    Request *req;
+    {
+        Mutex::Autolock lock(mPipelineMutex);
+        while(mJpegQueue.empty() && !mJpegExit)
+            mPipelineCond.wait(mPipelineMutex);
+
+        if(mJpegQueue.empty())
+            return false;
+
+        req = *mJpegQueue.begin();
+        mJpegQueue.erase(mJpegQueue.begin());
+    }
+
+    BENCHMARK_HERE(120);
+    BENCHMARK_SECTION("->JPEG") {
+        encodeJpeg(&req->jpeg);
+    }
+
+    /* The BLOB buffer follows the result with metadata */
+    {
+        Mutex::Autolock lock(mPipelineMutex);
+        while(!req->resultSent)
+            mPipelineCond.wait(mPipelineMutex);
+    }
+
+    req->frame->endCpuAccess();
+    mDev->unlock(req->frame);
+
+    camera3_stream_buffer &jpegBuf = req->buffers.editItemAt(req->jpegBuffer);
+    GraphicBufferMapper::get().unlock(*jpegBuf.buffer);
+    jpegBuf.acquire_fence = -1;
+    jpegBuf.release_fence = -1;
+    jpegBuf.status = CAMERA3_BUFFER_STATUS_OK;
+
+    Vector<camera3_stream_buffer> buffers;
+    buffers.push_back(jpegBuf);
+    processCaptureResult(req->frameNumber, NULL, buffers);
+    finishRequest(req);
+
+    char bmOut[1024];
+    BENCHMARK_STRING(bmOut, sizeof(bmOut), 6);
+    ALOGV("    JPEG time (avg):  %s", bmOut);
+
+    return true;
+}
+
+/**
+ * Fills request's output buffers with the captured frame and sends the result.
+ * The first BLOB buffer is left to the JPEG stage, with the frame.
+ */
+void Camera::processRequest(Request *req) {
+    BENCHMARK_HERE(120);
+
+    CameraMetadata &cm = req->settings;
+    const V4l2Device::VBuffer *frame = req->frame;
+    auto res = mDev->resolution();
+    status_t e;
+
+    frame->beginCpuAccess();
+
+    /* RGBA and YUV buffers are filled together after the loop, JPEG image
+     * meanwhile by the JPEG stage */
+    ImageConverter::Output outputs[IMAGECONVERTER_MAX_OUTPUTS];
+    size_t outputsNum = 0;
+    ssize_t jpegBuffer = -1;
+    for(size_t i = 0; i < req->buffers.size(); ++i) {
+        camera3_stream_buffer &srcBuf = req->buffers.editItemAt(i);
         uint8_t *buf = NULL;
+        android_ycbcr ycbcr = android_ycbcr();
 
         sp<Fence> acquireFence = new Fence(srcBuf.acquire_fence);
+        srcBuf.acquire_fence = -1;
         e = acquireFence->wait(1000); /* FIXME: magic number */
         if(e == TIMED_OUT) {
-            ALOGE("buffer %p  frame %-4u  Wait on acquire fence timed out", srcBuf.buffer, request->frame_number);
+            ALOGE("buffer %p  frame %-4u  Wait on acquire fence timed out", srcBuf.buffer, req->frameNumber);
         }
         if(e == NO_ERROR) {
             const Rect rect((int)srcBuf.stream->width, (int)srcBuf.stream->height);
-            e = GraphicBufferMapper::get().lock(*srcBuf.buffer, GRALLOC_USAGE_SW_WRITE_OFTEN, rect, (void **)&buf);
+            if(ImageConverter::isYCbCr420(srcBuf.stream->format))
+                e = lockYCbCr(srcBuf, rect, &ycbcr);
+            else
+                e = GraphicBufferMapper::get().lock(*srcBuf.buffer, GRALLOC_USAGE_SW_WRITE_OFTEN, rect, (void **)&buf);
             if(e != NO_ERROR) {
-                ALOGE("buffer %p  frame %-4u  lock failed", srcBuf.buffer, request->frame_number);
+                ALOGE("buffer %p  frame %-4u  lock failed", srcBuf.buffer, req->frameNumber);
             }
         }
         if(e != NO_ERROR) {
-            do GraphicBufferMapper::get().unlock(*request->output_buffers[i].buffer); while(i--);
-            return NO_INIT;
+            while(i--) GraphicBufferMapper::get().unlock(*req->buffers[i].buffer);
+            frame->endCpuAccess();
+            mDev->unlock(frame);
+            failRequest(req);
+            return;
         }
 
         switch(srcBuf.stream->format) {
-            case HAL_PIXEL_FORMAT_RGBA_8888: {
-                if(!rgbaBuffer) {
-                    BENCHMARK_SECTION("YUV->RGBA") {
-                        /* FIXME: better format detection */
-                        if(frame->pixFmt == V4L2_PIX_FMT_UYVY)
-                            mConverter.UYVYToRGBA(frame->buf, buf, res.width, res.height);
-                        else
-                            mConverter.YUY2ToRGBA(frame->buf, buf, res.width, res.height);
-                        rgbaBuffer = buf;
-                    }
-                } else {
-                    BENCHMARK_SECTION("Buf Copy") {
-                        memcpy(buf, rgbaBuffer, srcBuf.stream->width * srcBuf.stream->height * 4);
-                    }
+            case HAL_PIXEL_FORMAT_RGBA_8888:
+            case HAL_PIXEL_FORMAT_YCbCr_420_888:
+            case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+            case HAL_PIXEL_FORMAT_YV12: {
+                if(outputsNum == IMAGECONVERTER_MAX_OUTPUTS) {
+                    ALOGE("Too many output streams, buffer %p not filled", srcBuf.buffer);
+                    break;
                 }
+                ImageConverter::Output &out = outputs[outputsNum++];
+                out.halFormat   = srcBuf.stream->format;
+                out.width       = srcBuf.stream->width;
+                out.height      = srcBuf.stream->height;
+                out.rgba        = buf;
+                out.ycbcr       = ycbcr;
                 break;
             }
             case HAL_PIXEL_FORMAT_BLOB: {
-                BENCHMARK_SECTION("YUV->JPEG") {
-                    const size_t maxImageSize = mJpegBufferSize - sizeof(camera3_jpeg_blob);
-                    uint8_t jpegQuality = 95;
-                    if(cm.exists(ANDROID_JPEG_QUALITY)) {
-                        jpegQuality = *cm.find(ANDROID_JPEG_QUALITY).data.u8;
-                    }
-                    ALOGD("JPEG quality = %u", jpegQuality);
-
-                    /* FIXME: better format detection */
-                    uint8_t *bufEnd = NULL;
-                    if(frame->pixFmt == V4L2_PIX_FMT_UYVY)
-                        bufEnd = mConverter.UYVYToJPEG(frame->buf, buf, res.width, res.height, maxImageSize, jpegQuality);
-                    else
-                        bufEnd = mConverter.YUY2ToJPEG(frame->buf, buf, res.width, res.height, maxImageSize, jpegQuality);
-
-                    if(bufEnd != buf) {
-                        camera3_jpeg_blob *jpegBlob = reinterpret_cast<camera3_jpeg_blob*>(buf + maxImageSize);
-                        jpegBlob->jpeg_blob_id  = CAMERA3_JPEG_BLOB_ID;
-                        jpegBlob->jpeg_size     = (uint32_t)(bufEnd - buf);
-                    } else {
-                        ALOGE("%s: JPEG image too big!", __FUNCTION__);
-                    }
+                if(jpegBuffer < 0) {
+                    initJpegJob(&req->jpeg, &mJpegConverter, cm, frame, buf, srcBuf.stream->width, srcBuf.stream->height);
+                    jpegBuffer = (ssize_t)i;
+                } else {
+                    /* mConverter is free until the loop ends */
+                    JpegJob extra;
+                    initJpegJob(&extra, &mConverter, cm, frame, buf, srcBuf.stream->width, srcBuf.stream->height);
+                    encodeJpeg(&extra);
                 }
                 break;
             }
@@ -696,42 +1018,350 @@ int Camera::processCaptureRequest(camera3_capture_request_t *request) {
         }
     }
 
-    /* Unlocking all buffers in separate loop allows to copy data from already processed buffer to not yet processed one */
-    for(size_t i = 0; i < request->num_output_buffers; ++i) {
-        const camera3_stream_buffer &srcBuf = request->output_buffers[i];
+    if(jpegBuffer >= 0) {
+        Mutex::Autolock lock(mPipelineMutex);
+        req->jpegBuffer = jpegBuffer;
+        mJpegQueue.push_back(req);
+        mPipelineCond.broadcast();
+    }
 
-        GraphicBufferMapper::get().unlock(*srcBuf.buffer);
-        buffers.push_back(srcBuf);
-        buffers.editTop().acquire_fence = -1;
-        buffers.editTop().release_fence = -1;
-        buffers.editTop().status = CAMERA3_BUFFER_STATUS_OK;
+    if(outputsNum > 0) {
+        BENCHMARK_SECTION("->RGBA/YUV420") {
+            mConverter.convertStreams(frame->pixFmt, frame->buf, res.width, res.height, outputs, outputsNum,
+                                      Workers::LATENCY_CRITICAL);
+        }
+    }
+
+    /* Frame is not needed anymore, let it go back to the kernel */
+    if(jpegBuffer < 0) {
+        BENCHMARK_SECTION("Unlock") {
+            frame->endCpuAccess();
+            mDev->unlock(frame);
+        }
     }
 
-    BENCHMARK_SECTION("Unlock") {
-        mDev->unlock(frame);
+    /* Buffers stay locked until all outputs are written */
+    Vector<camera3_stream_buffer> buffers;
+    buffers.setCapacity(req->buffers.size());
+    for(size_t i = 0; i < req->buffers.size(); ++i) {
+        if((ssize_t)i == jpegBuffer)
+            continue;
+        camera3_stream_buffer &srcBuf = req->buffers.editItemAt(i);
+
+        GraphicBufferMapper::get().unlock(*srcBuf.buffer);
+        srcBuf.acquire_fence = -1;
+        srcBuf.release_fence = -1;
+        srcBuf.status = CAMERA3_BUFFER_STATUS_OK;
+        buffers.push_back(srcBuf);
     }
 
-    int64_t sensorTimestamp = timestamp;
-    int64_t syncFrameNumber = request->frame_number;
+    int64_t sensorTimestamp = req->timestamp;
+    int64_t syncFrameNumber = req->frameNumber;
 
     cm.update(ANDROID_SENSOR_TIMESTAMP, &sensorTimestamp, 1);
     cm.update(ANDROID_SYNC_FRAME_NUMBER, &syncFrameNumber, 1);
 
     auto result = cm.getAndLock();
-    processCaptureResult(request->frame_number, result, buffers);
+    processCaptureResult(req->frameNumber, result, buffers);
     cm.unlock(result);
 
-    // Cache the settings for next time
-    mLastRequestSettings.acquire(cm);
-
     /* Print stats */
     char bmOut[1024];
     BENCHMARK_STRING(bmOut, sizeof(bmOut), 6);
     ALOGV("    time (avg):  %s", bmOut);
+    ALOGV("    frames lost: %llu dropped by driver, %llu stale",
+          (unsigned long long)mDev->droppedFrames(), (unsigned long long)mDev->staleFrames());
+    Workers::IdleStats idle;
+    gWorkers.idleStats(&idle);
+    ALOGV("    workers idle: %lld ms spinning (%llu/%llu found work), %lld ms parked",
+          (long long)ns2ms(idle.spinTime), (unsigned long long)idle.spinHits, (unsigned long long)idle.spins,
+          (long long)ns2ms(idle.parkTime));
+}
+
+/**
+ * Prepares encoding of frame into width x height image in BLOB buffer buf,
+ * with quality, thumbnail and EXIF data from request settings.
+ */
+void Camera::initJpegJob(JpegJob *job, ImageConverter *converter, const CameraMetadata &settings, const V4l2Device::VBuffer *frame,
+                         uint8_t *buf, unsigned width, unsigned height) {
+    const V4l2Device::Resolution res = mDev->resolution();
+    job->converter      = converter;
+    job->frame          = frame;
+    job->buf            = buf;
+    job->srcWidth       = res.width;
+    job->srcHeight      = res.height;
+    job->width          = width;
+    job->height         = height;
+    job->maxImageSize   = mJpegBufferSize - sizeof(camera3_jpeg_blob);
+
+    uint8_t jpegQuality = 95;
+    if(settings.exists(ANDROID_JPEG_QUALITY)) {
+        jpegQuality = *settings.find(ANDROID_JPEG_QUALITY).data.u8;
+    }
+    ALOGD("JPEG quality = %u", jpegQuality);
+
+    const ImageConverter::JpegOptions options = { jpegQuality, 0, 0, 50, NULL };
+    job->options = options;
+    if(settings.exists(ANDROID_JPEG_THUMBNAIL_SIZE)) {
+        const int32_t *size = settings.find(ANDROID_JPEG_THUMBNAIL_SIZE).data.i32;
+        job->options.thumbnailWidth  = (unsigned)size[0];
+        job->options.thumbnailHeight = (unsigned)size[1];
+    }
+    if(settings.exists(ANDROID_JPEG_THUMBNAIL_QUALITY)) {
+        job->options.thumbnailQuality = *settings.find(ANDROID_JPEG_THUMBNAIL_QUALITY).data.u8;
+    }
+
+    fillExif(&job->exif, settings, width, height);
+    job->options.exif = &job->exif;
+}
+
+/**
+ * Encodes JPEG image of a JpegJob and appends camera3_jpeg_blob at the end of
+ * the buffer. Worker threads help as BACKGROUND work, so that preview is not
+ * delayed.
+ */
+void Camera::encodeJpeg(JpegJob *job) {
+    const V4l2Device::VBuffer *frame = job->frame;
+
+    uint8_t *bufEnd = job->converter->convertJpeg(frame->pixFmt, frame->buf, frame->bytesUsed, job->srcWidth, job->srcHeight,
+                                                  job->buf, job->width, job->height, job->maxImageSize, job->options,
+                                                  Workers::BACKGROUND);
+
+    if(bufEnd != job->buf) {
+        camera3_jpeg_blob *jpegBlob = reinterpret_cast<camera3_jpeg_blob*>(job->buf + job->maxImageSize);
+        jpegBlob->jpeg_blob_id  = CAMERA3_JPEG_BLOB_ID;
+        jpegBlob->jpeg_size     = (uint32_t)(bufEnd - job->buf);
+    } else {
+        ALOGE("%s: JPEG image too big!", __FUNCTION__);
+    }
+}
+
+/**
+ * Fills EXIF data of JPEG image from request settings.
+ */
+void Camera::fillExif(Exif *exif, const CameraMetadata &settings, unsigned width, unsigned height) {
+    char make[PROPERTY_VALUE_MAX];
+    char model[PROPERTY_VALUE_MAX];
+    property_get("ro.product.manufacturer", make, "");
+    property_get("ro.product.model", model, "");
+    exif->setMakeModel(make, model);
+    exif->setDateTime(time(NULL));
+    exif->setImageSize(width, height);
+
+    if(settings.exists(ANDROID_JPEG_ORIENTATION))
+        exif->setOrientation(*settings.find(ANDROID_JPEG_ORIENTATION).data.i32);
+
+    camera_metadata_ro_entry_t focalLength;
+    if(settings.exists(ANDROID_LENS_FOCAL_LENGTH)) {
+        exif->setFocalLength(*settings.find(ANDROID_LENS_FOCAL_LENGTH).data.f);
+    } else if(find_camera_metadata_ro_entry(staticCharacteristics(), ANDROID_LENS_INFO_AVAILABLE_FOCAL_LENGTHS, &focalLength) == 0 &&
+              focalLength.count > 0) {
+        exif->setFocalLength(focalLength.data.f[0]);
+    }
+
+    /* Default settings carry zero timestamp - no location then */
+    if(settings.exists(ANDROID_JPEG_GPS_COORDINATES) && settings.exists(ANDROID_JPEG_GPS_TIMESTAMP)) {
+        const camera_metadata_ro_entry_t coords = settings.find(ANDROID_JPEG_GPS_COORDINATES);
+        const int64_t timestamp = *settings.find(ANDROID_JPEG_GPS_TIMESTAMP).data.i64;
+        if(coords.count >= 2 && timestamp > 0) {
+            const double coordinates[3] = {
+                coords.data.d[0],
+                coords.data.d[1],
+                coords.count >= 3 ? coords.data.d[2] : 0.0
+            };
+            char method[33] = "";
+            if(settings.exists(ANDROID_JPEG_GPS_PROCESSING_METHOD)) {
+                const camera_metadata_ro_entry_t e = settings.find(ANDROID_JPEG_GPS_PROCESSING_METHOD);
+                const size_t len = e.count < sizeof(method) - 1 ? e.count : sizeof(method) - 1;
+                memcpy(method, e.data.u8, len);
+                method[len] = '\0';
+            }
+            exif->setGps(coordinates, timestamp, method);
+        }
+    }
+}
 
+/**
+ * Locks YUV 4:2:0 buffer for writing and gets its planes. When gralloc can not
+ * describe them, layouts of NV21 and YV12 defined in system/graphics.h are
+ * assumed.
+ */
+status_t Camera::lockYCbCr(const camera3_stream_buffer &buf, const Rect &rect, android_ycbcr *ycbcr) {
+    GraphicBufferMapper &mapper = GraphicBufferMapper::get();
+    status_t e = mapper.lockYCbCr(*buf.buffer, GRALLOC_USAGE_SW_WRITE_OFTEN, rect, ycbcr);
+    if(e == NO_ERROR || buf.stream->format == HAL_PIXEL_FORMAT_YCbCr_420_888)
+        return e;
+
+    uint8_t *y = NULL;
+    e = mapper.lock(*buf.buffer, GRALLOC_USAGE_SW_WRITE_OFTEN, rect, (void **)&y);
+    if(e != NO_ERROR)
+        return e;
+
+    const size_t width = buf.stream->width;
+    const size_t height = buf.stream->height;
+    memset(ycbcr, 0, sizeof(*ycbcr));
+    ycbcr->y = y;
+    if(buf.stream->format == HAL_PIXEL_FORMAT_YV12) {
+        /* Y, Cr, Cb planes; strides aligned to 16 */
+        ycbcr->ystride      = (width + 15) & ~(size_t)15;
+        ycbcr->cstride      = (ycbcr->ystride / 2 + 15) & ~(size_t)15;
+        ycbcr->chroma_step  = 1;
+        ycbcr->cr           = y + ycbcr->ystride * height;
+        ycbcr->cb           = (uint8_t *)ycbcr->cr + ycbcr->cstride * (height / 2);
+    } else {
+        /* Y plane followed by interleaved Cr and Cb */
+        ycbcr->ystride      = width;
+        ycbcr->cstride      = width;
+        ycbcr->chroma_step  = 2;
+        ycbcr->cr           = y + width * height;
+        ycbcr->cb           = (uint8_t *)ycbcr->cr + 1;
+    }
     return NO_ERROR;
 }
 
+/**
+ * Collects resolutions (without duplicates) of all capture formats which can
+ * be converted to specified HAL pixel format.
+ */
+void Camera::outputResolutions(int halFormat, Vector<V4l2Device::Resolution> *resolutions) {
+    const Vector<V4l2Device::Format> &formats = mDev->availableFormats();
+    for(size_t i = 0; i < formats.size(); ++i) {
+        if(ImageConverter::conversionCost(formats[i].pixFmt, halFormat) == ImageConverter::UNSUPPORTED)
+            continue;
+
+        const Vector<V4l2Device::Resolution> &fmtResolutions = formats[i].resolutions;
+        for(size_t j = 0; j < fmtResolutions.size(); ++j) {
+            size_t k = 0;
+            while(k < resolutions->size() &&
+                  ((*resolutions)[k].width != fmtResolutions[j].width || (*resolutions)[k].height != fmtResolutions[j].height))
+                ++k;
+            if(k == resolutions->size())
+                resolutions->add(fmtResolutions[j]);
+        }
+    }
+}
+
+/**
+ * Returns the shortest frame duration of all capture formats which can
+ * provide specified HAL pixel format in specified resolution.
+ */
+nsecs_t Camera::minFrameDuration(int halFormat, const V4l2Device::Resolution &resolution) {
+    /* Used when the driver does not report frame intervals */
+    static const nsecs_t defaultDuration = 1000000000LL / 30;
+
+    const Vector<V4l2Device::Format> &formats = mDev->availableFormats();
+    nsecs_t minDuration = 0;
+    for(size_t i = 0; i < formats.size(); ++i) {
+        if(ImageConverter::conversionCost(formats[i].pixFmt, halFormat) == ImageConverter::UNSUPPORTED)
+            continue;
+
+        auto durations = mDev->frameDurations(formats[i].pixFmt, resolution.width, resolution.height);
+        if(!durations.isEmpty() && (minDuration == 0 || durations[0] < minDuration))
+            minDuration = durations[0];
+    }
+
+    return minDuration ? minDuration : defaultDuration;
+}
+
+/**
+ * Collects frame rates (rounded, ascending, without duplicates) supported in
+ * any format and resolution.
+ */
+void Camera::supportedFps(Vector<int32_t> *fps) {
+    const Vector<V4l2Device::Format> &formats = mDev->availableFormats();
+    for(size_t i = 0; i < formats.size(); ++i) {
+        const Vector<V4l2Device::Resolution> &resolutions = formats[i].resolutions;
+        for(size_t j = 0; j < resolutions.size(); ++j) {
+            auto durations = mDev->frameDurations(formats[i].pixFmt, resolutions[j].width, resolutions[j].height);
+            for(size_t k = 0; k < durations.size(); ++k) {
+                const int32_t rate = (int32_t)((1000000000LL + durations[k] / 2) / durations[k]);
+                size_t pos = 0;
+                while(pos < fps->size() && (*fps)[pos] < rate)
+                    ++pos;
+                if(pos == fps->size() || (*fps)[pos] != rate)
+                    fps->insertAt(rate, pos);
+            }
+        }
+    }
+
+    if(fps->isEmpty())
+        fps->add(30);
+}
+
+/**
+ * Picks V4L2 capture format with the lowest total cost of converting a frame
+ * into all the streams. E.g. native YUV is used when preview is present and
+ * MJPEG when only JPEG images are requested.
+ *
+ * Returns 0 if none of the formats can provide all streams at width x height.
+ */
+uint32_t Camera::chooseCaptureFormat(const camera3_stream_configuration_t *streamList, unsigned width, unsigned height) {
+    const Vector<V4l2Device::Format> &formats = mDev->availableFormats();
+    uint32_t bestFmt = 0;
+    uint64_t bestCost = UINT64_MAX;
+
+    for(size_t i = 0; i < formats.size(); ++i) {
+        const Vector<V4l2Device::Resolution> &resolutions = formats[i].resolutions;
+        size_t resId = 0;
+        while(resId < resolutions.size() && (resolutions[resId].width != width || resolutions[resId].height != height))
+            ++resId;
+        if(resId == resolutions.size())
+            continue;
+
+        uint64_t cost = 0;
+        for(size_t j = 0; j < streamList->num_streams && cost != UINT64_MAX; ++j) {
+            const camera3_stream_t *stream = streamList->streams[j];
+            const unsigned pxCost = ImageConverter::conversionCost(formats[i].pixFmt, stream->format);
+            /* Compressed frames are copied, they can not be scaled */
+            const bool scaled = stream->width != width || stream->height != height;
+            if(pxCost == ImageConverter::UNSUPPORTED || (formats[i].compressed && scaled))
+                cost = UINT64_MAX;
+            else
+                cost += (uint64_t)pxCost * stream->width * stream->height;
+        }
+
+        ALOGV("Capture format %.4s: cost %llu", (const char *)&formats[i].pixFmt, (unsigned long long)cost);
+        /* On equal cost keep the earlier one - drivers list preferred formats first */
+        if(cost < bestCost) {
+            bestCost = cost;
+            bestFmt = formats[i].pixFmt;
+        }
+    }
+
+    return bestFmt;
+}
+
+/**
+ * Notifies framework about failed request and returns its buffers.
+ */
+void Camera::failRequest(Request *req) {
+    camera3_notify_msg_t msg;
+    msg.type = CAMERA3_MSG_ERROR;
+    msg.message.error.frame_number = req->frameNumber;
+    msg.message.error.error_stream = NULL;
+    msg.message.error.error_code = CAMERA3_MSG_ERROR_REQUEST;
+    mCallbackOps->notify(mCallbackOps, &msg);
+
+    for(size_t i = 0; i < req->buffers.size(); ++i) {
+        camera3_stream_buffer &buf = req->buffers.editItemAt(i);
+        buf.release_fence = buf.acquire_fence;
+        buf.acquire_fence = -1;
+        buf.status = CAMERA3_BUFFER_STATUS_ERROR;
+    }
+    processCaptureResult(req->frameNumber, NULL, req->buffers);
+}
+
+/**
+ * Releases request's pipeline slot.
+ */
+void Camera::finishRequest(Request *req) {
+    delete req;
+
+    Mutex::Autolock lock(mPipelineMutex);
+    --mInFlight;
+    mPipelineCond.broadcast();
+}
+
 inline void Camera::notifyShutter(uint32_t frameNumber, uint64_t timestamp) {
     camera3_notify_msg_t msg;
     msg.type = CAMERA3_MSG_SHUTTER;
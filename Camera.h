@@ -7,11 +7,20 @@
 #include <hardware/camera3.h>
 #include <camera/CameraMetadata.h>
 #include <utils/Mutex.h>
+#include <utils/Condition.h>
+#include <utils/Thread.h>
+#include <utils/List.h>
+#include <ui/Rect.h>
 
 #include "Workers.h"
 #include "ImageConverter.h"
 #include "DbgUtils.h"
 
+/* Maximum number of capture requests processed at the same time */
+#ifndef CAMERA_PIPELINE_DEPTH
+# define CAMERA_PIPELINE_DEPTH 3
+#endif
+
 namespace android {
 
 class Camera: public camera3_device {
@@ -35,8 +44,60 @@ protected:
     virtual int registerStreamBuffers(const camera3_stream_buffer_set_t *bufferSet);
     virtual int processCaptureRequest(camera3_capture_request_t *request);
 
+    /* PIPELINE */
+
+    /**
+     * JPEG image encoded by the JPEG stage while the other streams of the
+     * request are converted.
+     */
+    struct JpegJob {
+        ImageConverter                 *converter;
+        const V4l2Device::VBuffer      *frame;
+        uint8_t                        *buf;
+        /* Frame size and image (stream) size */
+        unsigned                        srcWidth;
+        unsigned                        srcHeight;
+        unsigned                        width;
+        unsigned                        height;
+        size_t                          maxImageSize;
+        ImageConverter::JpegOptions     options;
+        Exif                            exif;
+    };
+
+    struct Request {
+        uint32_t                        frameNumber;
+        CameraMetadata                  settings;
+        Vector<camera3_stream_buffer>   buffers;
+        const V4l2Device::VBuffer      *frame;
+        nsecs_t                         timestamp;
+        /* BLOB buffer left to the JPEG stage, or -1 */
+        ssize_t                         jpegBuffer;
+        JpegJob                         jpeg;
+        /* Result of the other buffers sent, the JPEG stage can finish it */
+        bool                            resultSent;
+    };
+
+    void startPipeline();
+    void stopPipeline();
+    void waitForPipelineIdle();
+    bool captureStage();
+    bool resultStage();
+    bool jpegStage();
+    void processRequest(Request *req);
+    void initJpegJob(JpegJob *job, ImageConverter *converter, const CameraMetadata &settings, const V4l2Device::VBuffer *frame,
+                     uint8_t *buf, unsigned width, unsigned height);
+    static void encodeJpeg(JpegJob *job);
+    void failRequest(Request *req);
+    void finishRequest(Request *req);
+
     /* HELPERS/SUBPROCEDURES */
 
+    void outputResolutions(int halFormat, Vector<V4l2Device::Resolution> *resolutions);
+    nsecs_t minFrameDuration(int halFormat, const V4l2Device::Resolution &resolution);
+    void supportedFps(Vector<int32_t> *fps);
+    uint32_t chooseCaptureFormat(const camera3_stream_configuration_t *streamList, unsigned width, unsigned height);
+    status_t lockYCbCr(const camera3_stream_buffer &buf, const Rect &rect, android_ycbcr *ycbcr);
+    void fillExif(Exif *exif, const CameraMetadata &settings, unsigned width, unsigned height);
     void notifyShutter(uint32_t frameNumber, uint64_t timestamp);
     void processCaptureResult(uint32_t frameNumber, const camera_metadata_t *result, const Vector<camera3_stream_buffer> &buffers);
 
@@ -49,11 +110,47 @@ protected:
     const camera3_callback_ops_t *mCallbackOps;
 
     size_t mJpegBufferSize;
+    /* AE target FPS range currently set in the device */
+    int32_t mFpsRange[2];
 
 private:
+    class PipelineThread: public Thread {
+    public:
+        typedef bool (Camera::*Stage)();
+
+        PipelineThread(Camera *parent, Stage stage, int rtPriority):
+            Thread(false), mParent(parent), mStage(stage), mRtPriority(rtPriority) {}
+
+    private:
+        virtual status_t readyToRun();
+        virtual bool threadLoop() { return (mParent->*mStage)(); }
+
+        Camera *mParent;
+        Stage   mStage;
+        /* SCHED_FIFO priority, 0 to keep normal scheduling */
+        int     mRtPriority;
+    };
+
     ImageConverter mConverter;
+    /* JPEG images are encoded with it by the JPEG stage, at the same time as
+     * mConverter converts other streams */
+    ImageConverter mJpegConverter;
     Mutex mMutex;
 
+    Mutex               mPipelineMutex;
+    Condition           mPipelineCond;
+    List<Request *>     mCaptureQueue;
+    List<Request *>     mResultQueue;
+    List<Request *>     mJpegQueue;
+    unsigned            mInFlight;
+    unsigned            mPipelineDepth;
+    bool                mPipelineExit;
+    /* Set after the result stage stopped; the JPEG stage finishes its queue */
+    bool                mJpegExit;
+    sp<PipelineThread>  mCaptureThread;
+    sp<PipelineThread>  mResultThread;
+    sp<PipelineThread>  mJpegThread;
+
     /* STATIC WRAPPERS */
 
     static int sClose(hw_device_t *device);
@@ -0,0 +1,695 @@
+/*
+ * Copyright (C) 2015-2016 Antmicro
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <cutils/properties.h>
+#include <utils/misc.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+# define CONVERTERKERNELS_X86
+# include <immintrin.h>
+# define TARGET_SSE41 __attribute__((target("sse4.1")))
+# define TARGET_AVX2  __attribute__((target("avx2")))
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON) || defined(__aarch64__)
+# define CONVERTERKERNELS_NEON
+# include <arm_neon.h>
+# if !defined(__aarch64__)
+#  include <sys/auxv.h>
+#  ifndef HWCAP_NEON
+#   define HWCAP_NEON (1 << 12)
+#  endif
+# endif
+#endif
+
+#include "ConverterKernels.h"
+#include "DbgUtils.h"
+
+namespace android {
+namespace ConverterKernels {
+
+/******************************************************************************\
+                                     Scalar
+\******************************************************************************/
+
+/*
+ * BT.601 limited range YUV to RGB in 6-bit fixed point:
+ *
+ *   R = (74 * (Y - 16)                  + 102 * (V - 128) + 32) >> 6
+ *   G = (74 * (Y - 16) -  25 * (U - 128) -  52 * (V - 128) + 32) >> 6
+ *   B = (74 * (Y - 16) + 129 * (U - 128)                   + 32) >> 6
+ *
+ * clamped to 0..255. This is the reference for all SIMD kernels. Products and
+ * chroma sums fit in int16; only the final sum may not, in which case SIMD
+ * kernels saturate it - the result is clamped to 255 either way.
+ */
+static const int kYMul  = 74;
+static const int kRVMul = 102;
+static const int kGUMul = -25;
+static const int kGVMul = -52;
+static const int kBUMul = 129;
+static const int kRound = 32;
+static const int kShift = 6;
+
+static inline uint8_t clamp8(int v) {
+    return v < 0 ? 0 : (v > 255 ? 255 : (uint8_t)v);
+}
+
+/* Byte offsets of Y0, U and V within a 4 byte macropixel */
+template<int Y0, int U0, int V0>
+static void packedToRgbaRowScalar(const uint8_t *src, uint8_t *dst, size_t width) {
+    for(size_t x = 0; x + 2 <= width; x += 2) {
+        const int u = src[U0] - 128;
+        const int v = src[V0] - 128;
+        const int cr = kRVMul * v + kRound;
+        const int cg = kGUMul * u + kGVMul * v + kRound;
+        const int cb = kBUMul * u + kRound;
+
+        for(int i = 0; i < 2; ++i) {
+            const int y = kYMul * (src[Y0 + i * 2] - 16);
+            dst[0] = clamp8((y + cr) >> kShift);
+            dst[1] = clamp8((y + cg) >> kShift);
+            dst[2] = clamp8((y + cb) >> kShift);
+            dst[3] = 255;
+            dst += 4;
+        }
+        src += 4;
+    }
+}
+
+/*
+ * 4:2:0 kernels take Y offset within a macropixel; chroma is at the other
+ * parity, U before V. Chroma of two rows is averaged, rounding up.
+ */
+template<int Y0>
+static void packedToPlanarRowsScalar(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                     uint8_t *u, uint8_t *v, size_t width) {
+    const int U0 = 1 - Y0;
+    const int V0 = 3 - Y0;
+    for(size_t x = 0; x + 2 <= width; x += 2) {
+        y0[x]       = src0[Y0];
+        y0[x + 1]   = src0[Y0 + 2];
+        y1[x]       = src1[Y0];
+        y1[x + 1]   = src1[Y0 + 2];
+        u[x / 2]    = (uint8_t)((src0[U0] + src1[U0] + 1) >> 1);
+        v[x / 2]    = (uint8_t)((src0[V0] + src1[V0] + 1) >> 1);
+        src0 += 4;
+        src1 += 4;
+    }
+}
+
+template<int Y0, bool VU>
+static void packedToSemiPlanarRowsScalar(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                         uint8_t *uv, size_t width) {
+    const int C0 = VU ? 3 - Y0 : 1 - Y0;
+    const int C1 = VU ? 1 - Y0 : 3 - Y0;
+    for(size_t x = 0; x + 2 <= width; x += 2) {
+        y0[x]       = src0[Y0];
+        y0[x + 1]   = src0[Y0 + 2];
+        y1[x]       = src1[Y0];
+        y1[x + 1]   = src1[Y0 + 2];
+        uv[x]       = (uint8_t)((src0[C0] + src1[C0] + 1) >> 1);
+        uv[x + 1]   = (uint8_t)((src0[C1] + src1[C1] + 1) >> 1);
+        src0 += 4;
+        src1 += 4;
+    }
+}
+
+template<int Y0>
+static void packedToPlanar422RowScalar(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, size_t width) {
+    for(size_t x = 0; x + 2 <= width; x += 2) {
+        y[x]        = src[Y0];
+        y[x + 1]    = src[Y0 + 2];
+        u[x / 2]    = src[1 - Y0];
+        v[x / 2]    = src[3 - Y0];
+        src += 4;
+    }
+}
+
+static void accumulateRowScalar(const uint8_t *src, uint16_t *acc, size_t len) {
+    for(size_t i = 0; i < len; ++i)
+        acc[i] = (uint16_t)(acc[i] + src[i]);
+}
+
+static const Kernels sScalar = {
+    "scalar",
+    packedToRgbaRowScalar<0, 1, 3>,
+    packedToRgbaRowScalar<1, 0, 2>,
+    packedToPlanarRowsScalar<0>,
+    packedToSemiPlanarRowsScalar<0, false>,
+    packedToSemiPlanarRowsScalar<0, true>,
+    packedToPlanarRowsScalar<1>,
+    packedToSemiPlanarRowsScalar<1, false>,
+    packedToSemiPlanarRowsScalar<1, true>,
+    packedToPlanar422RowScalar<0>,
+    packedToPlanar422RowScalar<1>,
+    accumulateRowScalar,
+};
+
+/******************************************************************************\
+                                      x86
+\******************************************************************************/
+
+#ifdef CONVERTERKERNELS_X86
+
+/* 8 pixels per iteration */
+template<int Y0, int U0, int V0>
+TARGET_SSE41 static void packedToRgbaRowSse41(const uint8_t *src, uint8_t *dst, size_t width) {
+    /* Gather Y, U and V into int16 lanes, chroma duplicated for pixel pairs */
+    const __m128i yMask = _mm_setr_epi8(Y0,      -1, Y0 + 2,  -1, Y0 + 4,  -1, Y0 + 6,  -1,
+                                        Y0 + 8,  -1, Y0 + 10, -1, Y0 + 12, -1, Y0 + 14, -1);
+    const __m128i uMask = _mm_setr_epi8(U0,      -1, U0,      -1, U0 + 4,  -1, U0 + 4,  -1,
+                                        U0 + 8,  -1, U0 + 8,  -1, U0 + 12, -1, U0 + 12, -1);
+    const __m128i vMask = _mm_setr_epi8(V0,      -1, V0,      -1, V0 + 4,  -1, V0 + 4,  -1,
+                                        V0 + 8,  -1, V0 + 8,  -1, V0 + 12, -1, V0 + 12, -1);
+    const __m128i k16   = _mm_set1_epi16(16);
+    const __m128i k128  = _mm_set1_epi16(128);
+    const __m128i yMul  = _mm_set1_epi16(kYMul);
+    const __m128i rvMul = _mm_set1_epi16(kRVMul);
+    const __m128i guMul = _mm_set1_epi16(kGUMul);
+    const __m128i gvMul = _mm_set1_epi16(kGVMul);
+    const __m128i buMul = _mm_set1_epi16(kBUMul);
+    const __m128i round = _mm_set1_epi16(kRound);
+    const __m128i alpha = _mm_set1_epi16(255);
+
+    size_t x = 0;
+    for(; x + 8 <= width; x += 8) {
+        const __m128i p = _mm_loadu_si128((const __m128i *)(src + x * 2));
+        const __m128i y = _mm_mullo_epi16(_mm_sub_epi16(_mm_shuffle_epi8(p, yMask), k16), yMul);
+        const __m128i u = _mm_sub_epi16(_mm_shuffle_epi8(p, uMask), k128);
+        const __m128i v = _mm_sub_epi16(_mm_shuffle_epi8(p, vMask), k128);
+
+        const __m128i cr = _mm_add_epi16(_mm_mullo_epi16(v, rvMul), round);
+        const __m128i cg = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(u, guMul),
+                                                       _mm_mullo_epi16(v, gvMul)), round);
+        const __m128i cb = _mm_add_epi16(_mm_mullo_epi16(u, buMul), round);
+
+        const __m128i r = _mm_srai_epi16(_mm_adds_epi16(y, cr), kShift);
+        const __m128i g = _mm_srai_epi16(_mm_adds_epi16(y, cg), kShift);
+        const __m128i b = _mm_srai_epi16(_mm_adds_epi16(y, cb), kShift);
+
+        /* R0..7 B0..7, G0..7 A0..7 -> R0 G0 B0 A0 ... */
+        const __m128i rb = _mm_packus_epi16(r, b);
+        const __m128i ga = _mm_packus_epi16(g, alpha);
+        const __m128i rg = _mm_unpacklo_epi8(rb, ga);
+        const __m128i ba = _mm_unpackhi_epi8(rb, ga);
+        _mm_storeu_si128((__m128i *)(dst + x * 4),      _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i *)(dst + x * 4 + 16), _mm_unpackhi_epi16(rg, ba));
+    }
+    packedToRgbaRowScalar<Y0, U0, V0>(src + x * 2, dst + x * 4, width - x);
+}
+
+/* 16 pixels per iteration; in-lane operations work on 8 pixel halves */
+template<int Y0, int U0, int V0>
+TARGET_AVX2 static void packedToRgbaRowAvx2(const uint8_t *src, uint8_t *dst, size_t width) {
+    const __m256i yMask = _mm256_setr_epi8(Y0,      -1, Y0 + 2,  -1, Y0 + 4,  -1, Y0 + 6,  -1,
+                                           Y0 + 8,  -1, Y0 + 10, -1, Y0 + 12, -1, Y0 + 14, -1,
+                                           Y0,      -1, Y0 + 2,  -1, Y0 + 4,  -1, Y0 + 6,  -1,
+                                           Y0 + 8,  -1, Y0 + 10, -1, Y0 + 12, -1, Y0 + 14, -1);
+    const __m256i uMask = _mm256_setr_epi8(U0,      -1, U0,      -1, U0 + 4,  -1, U0 + 4,  -1,
+                                           U0 + 8,  -1, U0 + 8,  -1, U0 + 12, -1, U0 + 12, -1,
+                                           U0,      -1, U0,      -1, U0 + 4,  -1, U0 + 4,  -1,
+                                           U0 + 8,  -1, U0 + 8,  -1, U0 + 12, -1, U0 + 12, -1);
+    const __m256i vMask = _mm256_setr_epi8(V0,      -1, V0,      -1, V0 + 4,  -1, V0 + 4,  -1,
+                                           V0 + 8,  -1, V0 + 8,  -1, V0 + 12, -1, V0 + 12, -1,
+                                           V0,      -1, V0,      -1, V0 + 4,  -1, V0 + 4,  -1,
+                                           V0 + 8,  -1, V0 + 8,  -1, V0 + 12, -1, V0 + 12, -1);
+    const __m256i k16   = _mm256_set1_epi16(16);
+    const __m256i k128  = _mm256_set1_epi16(128);
+    const __m256i yMul  = _mm256_set1_epi16(kYMul);
+    const __m256i rvMul = _mm256_set1_epi16(kRVMul);
+    const __m256i guMul = _mm256_set1_epi16(kGUMul);
+    const __m256i gvMul = _mm256_set1_epi16(kGVMul);
+    const __m256i buMul = _mm256_set1_epi16(kBUMul);
+    const __m256i round = _mm256_set1_epi16(kRound);
+    const __m256i alpha = _mm256_set1_epi16(255);
+
+    size_t x = 0;
+    for(; x + 16 <= width; x += 16) {
+        const __m256i p = _mm256_loadu_si256((const __m256i *)(src + x * 2));
+        const __m256i y = _mm256_mullo_epi16(_mm256_sub_epi16(_mm256_shuffle_epi8(p, yMask), k16), yMul);
+        const __m256i u = _mm256_sub_epi16(_mm256_shuffle_epi8(p, uMask), k128);
+        const __m256i v = _mm256_sub_epi16(_mm256_shuffle_epi8(p, vMask), k128);
+
+        const __m256i cr = _mm256_add_epi16(_mm256_mullo_epi16(v, rvMul), round);
+        const __m256i cg = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(u, guMul),
+                                                             _mm256_mullo_epi16(v, gvMul)), round);
+        const __m256i cb = _mm256_add_epi16(_mm256_mullo_epi16(u, buMul), round);
+
+        const __m256i r = _mm256_srai_epi16(_mm256_adds_epi16(y, cr), kShift);
+        const __m256i g = _mm256_srai_epi16(_mm256_adds_epi16(y, cg), kShift);
+        const __m256i b = _mm256_srai_epi16(_mm256_adds_epi16(y, cb), kShift);
+
+        const __m256i rb = _mm256_packus_epi16(r, b);
+        const __m256i ga = _mm256_packus_epi16(g, alpha);
+        const __m256i rg = _mm256_unpacklo_epi8(rb, ga);
+        const __m256i ba = _mm256_unpackhi_epi8(rb, ga);
+        /* Pixels 0..3 8..11 and 4..7 12..15 */
+        const __m256i lo = _mm256_unpacklo_epi16(rg, ba);
+        const __m256i hi = _mm256_unpackhi_epi16(rg, ba);
+        _mm256_storeu_si256((__m256i *)(dst + x * 4),      _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + x * 4 + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    packedToRgbaRowScalar<Y0, U0, V0>(src + x * 2, dst + x * 4, width - x);
+}
+
+/* Y (Y0 = 0) or chroma (Y0 = 1) bytes of YUYV in int16 lanes and vice versa */
+template<int Y0>
+TARGET_SSE41 static inline __m128i lumaSse41(__m128i p) {
+    return Y0 ? _mm_srli_epi16(p, 8) : _mm_and_si128(p, _mm_set1_epi16(0xff));
+}
+
+template<int Y0>
+TARGET_SSE41 static inline __m128i chromaSse41(__m128i p) {
+    return Y0 ? _mm_and_si128(p, _mm_set1_epi16(0xff)) : _mm_srli_epi16(p, 8);
+}
+
+/*
+ * 16 pixels per iteration. Writes Y rows and returns interleaved U0 V0 U1 V1
+ * ... averaged over both rows.
+ */
+template<int Y0>
+TARGET_SSE41 static inline __m128i packedTo420Sse41(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1) {
+    const __m128i a0 = _mm_loadu_si128((const __m128i *)src0);
+    const __m128i b0 = _mm_loadu_si128((const __m128i *)(src0 + 16));
+    const __m128i a1 = _mm_loadu_si128((const __m128i *)src1);
+    const __m128i b1 = _mm_loadu_si128((const __m128i *)(src1 + 16));
+
+    _mm_storeu_si128((__m128i *)y0, _mm_packus_epi16(lumaSse41<Y0>(a0), lumaSse41<Y0>(b0)));
+    _mm_storeu_si128((__m128i *)y1, _mm_packus_epi16(lumaSse41<Y0>(a1), lumaSse41<Y0>(b1)));
+
+    return _mm_packus_epi16(chromaSse41<Y0>(_mm_avg_epu8(a0, a1)), chromaSse41<Y0>(_mm_avg_epu8(b0, b1)));
+}
+
+template<int Y0>
+TARGET_SSE41 static void packedToPlanarRowsSse41(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                                 uint8_t *u, uint8_t *v, size_t width) {
+    const __m128i lo = _mm_set1_epi16(0xff);
+    size_t x = 0;
+    for(; x + 16 <= width; x += 16) {
+        const __m128i c = packedTo420Sse41<Y0>(src0 + x * 2, src1 + x * 2, y0 + x, y1 + x);
+        const __m128i uv = _mm_packus_epi16(_mm_and_si128(c, lo), _mm_srli_epi16(c, 8));
+        _mm_storel_epi64((__m128i *)(u + x / 2), uv);
+        _mm_storel_epi64((__m128i *)(v + x / 2), _mm_srli_si128(uv, 8));
+    }
+    packedToPlanarRowsScalar<Y0>(src0 + x * 2, src1 + x * 2, y0 + x, y1 + x, u + x / 2, v + x / 2, width - x);
+}
+
+template<int Y0, bool VU>
+TARGET_SSE41 static void packedToSemiPlanarRowsSse41(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                                     uint8_t *uv, size_t width) {
+    size_t x = 0;
+    for(; x + 16 <= width; x += 16) {
+        __m128i c = packedTo420Sse41<Y0>(src0 + x * 2, src1 + x * 2, y0 + x, y1 + x);
+        if(VU)
+            c = _mm_or_si128(_mm_slli_epi16(c, 8), _mm_srli_epi16(c, 8));
+        _mm_storeu_si128((__m128i *)(uv + x), c);
+    }
+    packedToSemiPlanarRowsScalar<Y0, VU>(src0 + x * 2, src1 + x * 2, y0 + x, y1 + x, uv + x, width - x);
+}
+
+/* 16 pixels per iteration */
+template<int Y0>
+TARGET_SSE41 static void packedToPlanar422RowSse41(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, size_t width) {
+    const __m128i lo = _mm_set1_epi16(0xff);
+    size_t x = 0;
+    for(; x + 16 <= width; x += 16) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)(src + x * 2));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(src + x * 2 + 16));
+        _mm_storeu_si128((__m128i *)(y + x), _mm_packus_epi16(lumaSse41<Y0>(a), lumaSse41<Y0>(b)));
+
+        const __m128i c = _mm_packus_epi16(chromaSse41<Y0>(a), chromaSse41<Y0>(b));
+        const __m128i uv = _mm_packus_epi16(_mm_and_si128(c, lo), _mm_srli_epi16(c, 8));
+        _mm_storel_epi64((__m128i *)(u + x / 2), uv);
+        _mm_storel_epi64((__m128i *)(v + x / 2), _mm_srli_si128(uv, 8));
+    }
+    packedToPlanar422RowScalar<Y0>(src + x * 2, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+template<int Y0>
+TARGET_AVX2 static inline __m256i lumaAvx2(__m256i p) {
+    return Y0 ? _mm256_srli_epi16(p, 8) : _mm256_and_si256(p, _mm256_set1_epi16(0xff));
+}
+
+template<int Y0>
+TARGET_AVX2 static inline __m256i chromaAvx2(__m256i p) {
+    return Y0 ? _mm256_and_si256(p, _mm256_set1_epi16(0xff)) : _mm256_srli_epi16(p, 8);
+}
+
+/* In-lane pack of two registers, with 64-bit quarters put back in order */
+TARGET_AVX2 static inline __m256i packusOrderedAvx2(__m256i a, __m256i b) {
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+}
+
+/* 32 pixels per iteration */
+template<int Y0>
+TARGET_AVX2 static inline __m256i packedTo420Avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1) {
+    const __m256i a0 = _mm256_loadu_si256((const __m256i *)src0);
+    const __m256i b0 = _mm256_loadu_si256((const __m256i *)(src0 + 32));
+    const __m256i a1 = _mm256_loadu_si256((const __m256i *)src1);
+    const __m256i b1 = _mm256_loadu_si256((const __m256i *)(src1 + 32));
+
+    _mm256_storeu_si256((__m256i *)y0, packusOrderedAvx2(lumaAvx2<Y0>(a0), lumaAvx2<Y0>(b0)));
+    _mm256_storeu_si256((__m256i *)y1, packusOrderedAvx2(lumaAvx2<Y0>(a1), lumaAvx2<Y0>(b1)));
+
+    return packusOrderedAvx2(chromaAvx2<Y0>(_mm256_avg_epu8(a0, a1)), chromaAvx2<Y0>(_mm256_avg_epu8(b0, b1)));
+}
+
+template<int Y0>
+TARGET_AVX2 static void packedToPlanarRowsAvx2(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                               uint8_t *u, uint8_t *v, size_t width) {
+    const __m256i lo = _mm256_set1_epi16(0xff);
+    size_t x = 0;
+    for(; x + 32 <= width; x += 32) {
+        const __m256i c = packedTo420Avx2<Y0>(src0 + x * 2, src1 + x * 2, y0 + x, y1 + x);
+        const __m256i uv = packusOrderedAvx2(_mm256_and_si256(c, lo), _mm256_srli_epi16(c, 8));
+        _mm_storeu_si128((__m128i *)(u + x / 2), _mm256_castsi256_si128(uv));
+        _mm_storeu_si128((__m128i *)(v + x / 2), _mm256_extracti128_si256(uv, 1));
+    }
+    packedToPlanarRowsScalar<Y0>(src0 + x * 2, src1 + x * 2, y0 + x, y1 + x, u + x / 2, v + x / 2, width - x);
+}
+
+template<int Y0, bool VU>
+TARGET_AVX2 static void packedToSemiPlanarRowsAvx2(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                                   uint8_t *uv, size_t width) {
+    size_t x = 0;
+    for(; x + 32 <= width; x += 32) {
+        __m256i c = packedTo420Avx2<Y0>(src0 + x * 2, src1 + x * 2, y0 + x, y1 + x);
+        if(VU)
+            c = _mm256_or_si256(_mm256_slli_epi16(c, 8), _mm256_srli_epi16(c, 8));
+        _mm256_storeu_si256((__m256i *)(uv + x), c);
+    }
+    packedToSemiPlanarRowsScalar<Y0, VU>(src0 + x * 2, src1 + x * 2, y0 + x, y1 + x, uv + x, width - x);
+}
+
+/* 32 pixels per iteration */
+template<int Y0>
+TARGET_AVX2 static void packedToPlanar422RowAvx2(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, size_t width) {
+    const __m256i lo = _mm256_set1_epi16(0xff);
+    size_t x = 0;
+    for(; x + 32 <= width; x += 32) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *)(src + x * 2));
+        const __m256i b = _mm256_loadu_si256((const __m256i *)(src + x * 2 + 32));
+        _mm256_storeu_si256((__m256i *)(y + x), packusOrderedAvx2(lumaAvx2<Y0>(a), lumaAvx2<Y0>(b)));
+
+        const __m256i c = packusOrderedAvx2(chromaAvx2<Y0>(a), chromaAvx2<Y0>(b));
+        const __m256i uv = packusOrderedAvx2(_mm256_and_si256(c, lo), _mm256_srli_epi16(c, 8));
+        _mm_storeu_si128((__m128i *)(u + x / 2), _mm256_castsi256_si128(uv));
+        _mm_storeu_si128((__m128i *)(v + x / 2), _mm256_extracti128_si256(uv, 1));
+    }
+    packedToPlanar422RowScalar<Y0>(src + x * 2, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+/* 16 bytes per iteration */
+TARGET_SSE41 static void accumulateRowSse41(const uint8_t *src, uint16_t *acc, size_t len) {
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+        const __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i *a = (__m128i *)(acc + i);
+        _mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), _mm_cvtepu8_epi16(s)));
+        _mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1), _mm_cvtepu8_epi16(_mm_srli_si128(s, 8))));
+    }
+    accumulateRowScalar(src + i, acc + i, len - i);
+}
+
+/* 32 bytes per iteration */
+TARGET_AVX2 static void accumulateRowAvx2(const uint8_t *src, uint16_t *acc, size_t len) {
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32) {
+        const __m128i s0 = _mm_loadu_si128((const __m128i *)(src + i));
+        const __m128i s1 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        __m256i *a = (__m256i *)(acc + i);
+        _mm256_storeu_si256(a, _mm256_add_epi16(_mm256_loadu_si256(a), _mm256_cvtepu8_epi16(s0)));
+        _mm256_storeu_si256(a + 1, _mm256_add_epi16(_mm256_loadu_si256(a + 1), _mm256_cvtepu8_epi16(s1)));
+    }
+    accumulateRowScalar(src + i, acc + i, len - i);
+}
+
+static const Kernels sSse41 = {
+    "sse4.1",
+    packedToRgbaRowSse41<0, 1, 3>,
+    packedToRgbaRowSse41<1, 0, 2>,
+    packedToPlanarRowsSse41<0>,
+    packedToSemiPlanarRowsSse41<0, false>,
+    packedToSemiPlanarRowsSse41<0, true>,
+    packedToPlanarRowsSse41<1>,
+    packedToSemiPlanarRowsSse41<1, false>,
+    packedToSemiPlanarRowsSse41<1, true>,
+    packedToPlanar422RowSse41<0>,
+    packedToPlanar422RowSse41<1>,
+    accumulateRowSse41,
+};
+
+static const Kernels sAvx2 = {
+    "avx2",
+    packedToRgbaRowAvx2<0, 1, 3>,
+    packedToRgbaRowAvx2<1, 0, 2>,
+    packedToPlanarRowsAvx2<0>,
+    packedToSemiPlanarRowsAvx2<0, false>,
+    packedToSemiPlanarRowsAvx2<0, true>,
+    packedToPlanarRowsAvx2<1>,
+    packedToSemiPlanarRowsAvx2<1, false>,
+    packedToSemiPlanarRowsAvx2<1, true>,
+    packedToPlanar422RowAvx2<0>,
+    packedToPlanar422RowAvx2<1>,
+    accumulateRowAvx2,
+};
+
+#endif /* CONVERTERKERNELS_X86 */
+
+/******************************************************************************\
+                                      NEON
+\******************************************************************************/
+
+#ifdef CONVERTERKERNELS_NEON
+
+/*
+ * 16 pixels per iteration. Indices of even Y, U, odd Y and V planes after
+ * vld4 deinterleaving of macropixels.
+ */
+template<int YE, int U, int YO, int V>
+static void packedToRgbaRowNeon(const uint8_t *src, uint8_t *dst, size_t width) {
+    const int16x8_t k16   = vdupq_n_s16(16);
+    const int16x8_t k128  = vdupq_n_s16(128);
+    const int16x8_t yMul  = vdupq_n_s16(kYMul);
+    const int16x8_t rvMul = vdupq_n_s16(kRVMul);
+    const int16x8_t guMul = vdupq_n_s16(kGUMul);
+    const int16x8_t gvMul = vdupq_n_s16(kGVMul);
+    const int16x8_t buMul = vdupq_n_s16(kBUMul);
+    const int16x8_t round = vdupq_n_s16(kRound);
+
+    uint8x16x4_t out;
+    out.val[3] = vdupq_n_u8(255);
+
+    size_t x = 0;
+    for(; x + 16 <= width; x += 16) {
+        const uint8x8x4_t p = vld4_u8(src + x * 2);
+        const int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(p.val[U])), k128);
+        const int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(p.val[V])), k128);
+        const int16x8_t ye = vmulq_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(p.val[YE])), k16), yMul);
+        const int16x8_t yo = vmulq_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(p.val[YO])), k16), yMul);
+
+        const int16x8_t cr = vaddq_s16(vmulq_s16(v, rvMul), round);
+        const int16x8_t cg = vaddq_s16(vaddq_s16(vmulq_s16(u, guMul), vmulq_s16(v, gvMul)), round);
+        const int16x8_t cb = vaddq_s16(vmulq_s16(u, buMul), round);
+
+        const uint8x8x2_t r = vzip_u8(vqmovun_s16(vshrq_n_s16(vqaddq_s16(ye, cr), kShift)),
+                                      vqmovun_s16(vshrq_n_s16(vqaddq_s16(yo, cr), kShift)));
+        const uint8x8x2_t g = vzip_u8(vqmovun_s16(vshrq_n_s16(vqaddq_s16(ye, cg), kShift)),
+                                      vqmovun_s16(vshrq_n_s16(vqaddq_s16(yo, cg), kShift)));
+        const uint8x8x2_t b = vzip_u8(vqmovun_s16(vshrq_n_s16(vqaddq_s16(ye, cb), kShift)),
+                                      vqmovun_s16(vshrq_n_s16(vqaddq_s16(yo, cb), kShift)));
+
+        out.val[0] = vcombine_u8(r.val[0], r.val[1]);
+        out.val[1] = vcombine_u8(g.val[0], g.val[1]);
+        out.val[2] = vcombine_u8(b.val[0], b.val[1]);
+        vst4q_u8(dst + x * 4, out);
+    }
+    if(YE == 0)
+        packedToRgbaRowScalar<0, 1, 3>(src + x * 2, dst + x * 4, width - x);
+    else
+        packedToRgbaRowScalar<1, 0, 2>(src + x * 2, dst + x * 4, width - x);
+}
+
+/* 16 pixels per iteration. Writes Y rows and returns averaged U and V */
+template<int Y0>
+static inline uint8x8x2_t packedTo420Neon(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1) {
+    const int YE = Y0;
+    const int U  = 1 - Y0;
+    const int YO = 2 + Y0;
+    const int V  = 3 - Y0;
+    const uint8x8x4_t p0 = vld4_u8(src0);
+    const uint8x8x4_t p1 = vld4_u8(src1);
+
+    uint8x8x2_t y;
+    y.val[0] = p0.val[YE];
+    y.val[1] = p0.val[YO];
+    vst2_u8(y0, y);
+    y.val[0] = p1.val[YE];
+    y.val[1] = p1.val[YO];
+    vst2_u8(y1, y);
+
+    uint8x8x2_t uv;
+    uv.val[0] = vrhadd_u8(p0.val[U], p1.val[U]);
+    uv.val[1] = vrhadd_u8(p0.val[V], p1.val[V]);
+    return uv;
+}
+
+template<int Y0>
+static void packedToPlanarRowsNeon(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                   uint8_t *u, uint8_t *v, size_t width) {
+    size_t x = 0;
+    for(; x + 16 <= width; x += 16) {
+        const uint8x8x2_t uv = packedTo420Neon<Y0>(src0 + x * 2, src1 + x * 2, y0 + x, y1 + x);
+        vst1_u8(u + x / 2, uv.val[0]);
+        vst1_u8(v + x / 2, uv.val[1]);
+    }
+    packedToPlanarRowsScalar<Y0>(src0 + x * 2, src1 + x * 2, y0 + x, y1 + x, u + x / 2, v + x / 2, width - x);
+}
+
+template<int Y0, bool VU>
+static void packedToSemiPlanarRowsNeon(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                       uint8_t *uv, size_t width) {
+    size_t x = 0;
+    for(; x + 16 <= width; x += 16) {
+        uint8x8x2_t c = packedTo420Neon<Y0>(src0 + x * 2, src1 + x * 2, y0 + x, y1 + x);
+        if(VU) {
+            const uint8x8_t u = c.val[0];
+            c.val[0] = c.val[1];
+            c.val[1] = u;
+        }
+        vst2_u8(uv + x, c);
+    }
+    packedToSemiPlanarRowsScalar<Y0, VU>(src0 + x * 2, src1 + x * 2, y0 + x, y1 + x, uv + x, width - x);
+}
+
+/* 16 pixels per iteration */
+template<int Y0>
+static void packedToPlanar422RowNeon(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, size_t width) {
+    size_t x = 0;
+    for(; x + 16 <= width; x += 16) {
+        const uint8x8x4_t p = vld4_u8(src + x * 2);
+        uint8x8x2_t l;
+        l.val[0] = p.val[Y0];
+        l.val[1] = p.val[2 + Y0];
+        vst2_u8(y + x, l);
+        vst1_u8(u + x / 2, p.val[1 - Y0]);
+        vst1_u8(v + x / 2, p.val[3 - Y0]);
+    }
+    packedToPlanar422RowScalar<Y0>(src + x * 2, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+/* 16 bytes per iteration */
+static void accumulateRowNeon(const uint8_t *src, uint16_t *acc, size_t len) {
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+        const uint8x16_t s = vld1q_u8(src + i);
+        vst1q_u16(acc + i, vaddw_u8(vld1q_u16(acc + i), vget_low_u8(s)));
+        vst1q_u16(acc + i + 8, vaddw_u8(vld1q_u16(acc + i + 8), vget_high_u8(s)));
+    }
+    accumulateRowScalar(src + i, acc + i, len - i);
+}
+
+static const Kernels sNeon = {
+    "neon",
+    packedToRgbaRowNeon<0, 1, 2, 3>,
+    packedToRgbaRowNeon<1, 0, 3, 2>,
+    packedToPlanarRowsNeon<0>,
+    packedToSemiPlanarRowsNeon<0, false>,
+    packedToSemiPlanarRowsNeon<0, true>,
+    packedToPlanarRowsNeon<1>,
+    packedToSemiPlanarRowsNeon<1, false>,
+    packedToSemiPlanarRowsNeon<1, true>,
+    packedToPlanar422RowNeon<0>,
+    packedToPlanar422RowNeon<1>,
+    accumulateRowNeon,
+};
+
+#endif /* CONVERTERKERNELS_NEON */
+
+/******************************************************************************\
+                                    Dispatch
+\******************************************************************************/
+
+/**
+ * Returns kernel set with given name, or NULL when it is not built for this
+ * architecture or the CPU does not support it.
+ */
+const Kernels * byName(const char *name) {
+    if(!strcmp(name, sScalar.name))
+        return &sScalar;
+#ifdef CONVERTERKERNELS_X86
+    __builtin_cpu_init();
+    if(!strcmp(name, sAvx2.name))
+        return __builtin_cpu_supports("avx2") ? &sAvx2 : NULL;
+    if(!strcmp(name, sSse41.name))
+        return __builtin_cpu_supports("sse4.1") ? &sSse41 : NULL;
+#endif
+#ifdef CONVERTERKERNELS_NEON
+    if(!strcmp(name, sNeon.name)) {
+# if !defined(__aarch64__)
+        if(!(getauxval(AT_HWCAP) & HWCAP_NEON))
+            return NULL;
+# endif
+        return &sNeon;
+    }
+#endif
+    return NULL;
+}
+
+static const Kernels & select() {
+    char name[PROPERTY_VALUE_MAX];
+    if(property_get("ro.camera.v4l2device.kernels", name, "") > 0) {
+        const Kernels *k = byName(name);
+        if(k) {
+            ALOGI("Using %s converter kernels", k->name);
+            return *k;
+        }
+        ALOGW("Converter kernels \"%s\" not supported", name);
+    }
+
+    /* From the fastest */
+    static const char * const names[] = { "avx2", "sse4.1", "neon" };
+    for(size_t i = 0; i < NELEM(names); ++i) {
+        const Kernels *k = byName(names[i]);
+        if(k) {
+            ALOGI("Using %s converter kernels", k->name);
+            return *k;
+        }
+    }
+    ALOGI("Using %s converter kernels", sScalar.name);
+    return sScalar;
+}
+
+/**
+ * Returns the fastest kernel set supported by the CPU, or the one selected
+ * with "ro.camera.v4l2device.kernels" property. Chosen on the first call.
+ */
+const Kernels & kernels() {
+    static const Kernels &selected = select();
+    return selected;
+}
+
+/**
+ * Returns the reference kernel set.
+ */
+const Kernels & scalar() {
+    return sScalar;
+}
+
+}; /* namespace ConverterKernels */
+}; /* namespace android */
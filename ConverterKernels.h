@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2015-2016 Antmicro
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CONVERTERKERNELS_H
+#define CONVERTERKERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+namespace ConverterKernels {
+
+/**
+ * Converts one row of packed YUV 4:2:2 into RGBA. width must be even.
+ */
+typedef void (*PackedToRgbaRow)(const uint8_t *src, uint8_t *dst, size_t width);
+
+/**
+ * Converts two rows of packed YUV 4:2:2 into two Y rows and one row of each
+ * chroma plane, averaging chroma vertically. width must be even.
+ */
+typedef void (*PackedToPlanarRows)(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                   uint8_t *u, uint8_t *v, size_t width);
+
+/**
+ * Same as PackedToPlanarRows, but chroma goes into one interleaved row.
+ */
+typedef void (*PackedToSemiPlanarRows)(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                       uint8_t *uv, size_t width);
+
+/**
+ * Splits one row of packed YUV 4:2:2 into Y, U and V rows. width must be even.
+ */
+typedef void (*PackedToPlanar422Row)(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, size_t width);
+
+/**
+ * Adds len bytes of src to 16 bit sums in acc (wrapping on overflow).
+ */
+typedef void (*AccumulateRow)(const uint8_t *src, uint16_t *acc, size_t len);
+
+/**
+ * Set of row kernels built for one instruction set. All sets produce exactly
+ * the same output as the scalar one.
+ */
+struct Kernels {
+    const char         *name;
+    PackedToRgbaRow     yuyvToRgbaRow;
+    PackedToRgbaRow     uyvyToRgbaRow;
+
+    PackedToPlanarRows      yuyvToI420Rows;
+    PackedToSemiPlanarRows  yuyvToNv12Rows;
+    PackedToSemiPlanarRows  yuyvToNv21Rows;
+    PackedToPlanarRows      uyvyToI420Rows;
+    PackedToSemiPlanarRows  uyvyToNv12Rows;
+    PackedToSemiPlanarRows  uyvyToNv21Rows;
+
+    PackedToPlanar422Row    yuyvToI422Row;
+    PackedToPlanar422Row    uyvyToI422Row;
+
+    AccumulateRow           accumulateRow;
+};
+
+const Kernels & kernels();
+const Kernels * byName(const char *name);
+const Kernels & scalar();
+
+}; /* namespace ConverterKernels */
+}; /* namespace android */
+
+#endif // CONVERTERKERNELS_H
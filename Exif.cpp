@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2015-2016 Antmicro
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <utils/misc.h>
+
+#include "Exif.h"
+#include "DbgUtils.h"
+
+/* TIFF field types */
+#define TYPE_BYTE       1
+#define TYPE_ASCII      2
+#define TYPE_SHORT      3
+#define TYPE_LONG       4
+#define TYPE_RATIONAL   5
+#define TYPE_UNDEFINED  7
+
+/* "Exif\0\0" after the segment header */
+#define APP1_HEADER_SIZE (4 + 6)
+#define TIFF_HEADER_SIZE 8
+
+namespace android {
+
+/******************************************************************************\
+                                  TIFF structure
+\******************************************************************************/
+
+/*
+ * Field of an IFD. Values longer than 4 bytes are given in data (already in
+ * little endian) and stored after the IFD; shorter ones go in value.
+ */
+struct IfdEntry {
+    uint16_t        tag;
+    uint16_t        type;
+    uint32_t        count;
+    const void     *data;
+    uint32_t        value;
+};
+
+static size_t typeSize(uint16_t type) {
+    switch(type) {
+        case TYPE_SHORT:    return 2;
+        case TYPE_LONG:     return 4;
+        case TYPE_RATIONAL: return 8;
+        default:            return 1;
+    }
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, (uint16_t)v);
+    put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void putRational(uint8_t *p, uint32_t num, uint32_t den) {
+    put32(p, num);
+    put32(p + 4, den);
+}
+
+/**
+ * Returns size of IFD with its out of line values.
+ */
+static size_t ifdSize(const IfdEntry *entries, size_t n) {
+    size_t size = 2 + n * 12 + 4;
+    for(size_t i = 0; i < n; ++i) {
+        const size_t len = entries[i].count * typeSize(entries[i].type);
+        if(len > 4)
+            size += (len + 1) & ~(size_t)1;
+    }
+    return size;
+}
+
+/**
+ * Writes IFD at offset of TIFF data. Entries must be sorted by tag.
+ */
+static void writeIfd(uint8_t *tiff, size_t offset, const IfdEntry *entries, size_t n, uint32_t nextIfd) {
+    uint8_t *p = tiff + offset;
+    size_t dataOffset = offset + 2 + n * 12 + 4;
+
+    put16(p, (uint16_t)n);
+    p += 2;
+    for(size_t i = 0; i < n; ++i) {
+        const IfdEntry &e = entries[i];
+        const size_t len = e.count * typeSize(e.type);
+        put16(p, e.tag);
+        put16(p + 2, e.type);
+        put32(p + 4, e.count);
+        if(len > 4) {
+            put32(p + 8, (uint32_t)dataOffset);
+            memcpy(tiff + dataOffset, e.data, len);
+            if(len & 1)
+                tiff[dataOffset + len] = 0;
+            dataOffset += (len + 1) & ~(size_t)1;
+        } else if(e.data) {
+            memset(p + 8, 0, 4);
+            memcpy(p + 8, e.data, len);
+        } else if(e.type == TYPE_SHORT) {
+            put16(p + 8, (uint16_t)e.value);
+            put16(p + 10, 0);
+        } else {
+            put32(p + 8, e.value);
+        }
+        p += 12;
+    }
+    put32(p, nextIfd);
+}
+
+/**
+ * Converts degrees into degrees, minutes and seconds (in 1/1000).
+ */
+static void putDms(uint8_t *p, double v) {
+    v = fabs(v);
+    const uint32_t deg = (uint32_t)v;
+    v = (v - deg) * 60;
+    const uint32_t min = (uint32_t)v;
+    const uint32_t sec = (uint32_t)((v - min) * 60 * 1000 + 0.5);
+    putRational(p, deg, 1);
+    putRational(p + 8, min, 1);
+    putRational(p + 16, sec, 1000);
+}
+
+/******************************************************************************\
+                                      Exif
+\******************************************************************************/
+
+Exif::Exif()
+    : mOrientation(1)
+    , mWidth(0)
+    , mHeight(0)
+    , mFocalLength(0)
+    , mHasGps(false)
+    , mLatitude(0)
+    , mLongitude(0)
+    , mAltitude(0) {
+    mMake[0] = '\0';
+    mModel[0] = '\0';
+    setDateTime(time(NULL));
+    memset(&mGpsTime, 0, sizeof(mGpsTime));
+    mGpsProcessingMethod[0] = '\0';
+}
+
+void Exif::setMakeModel(const char *make, const char *model) {
+    snprintf(mMake, sizeof(mMake), "%s", make);
+    snprintf(mModel, sizeof(mModel), "%s", model);
+}
+
+void Exif::setDateTime(time_t time) {
+    struct tm t;
+    localtime_r(&time, &t);
+    strftime(mDateTime, sizeof(mDateTime), "%Y:%m:%d %H:%M:%S", &t);
+}
+
+/**
+ * Sets clockwise rotation (0, 90, 180 or 270 degrees) which makes the image
+ * upright.
+ */
+void Exif::setOrientation(int degrees) {
+    switch(((degrees % 360) + 360) % 360) {
+        case 90:    mOrientation = 6; break;
+        case 180:   mOrientation = 3; break;
+        case 270:   mOrientation = 8; break;
+        default:    mOrientation = 1; break;
+    }
+}
+
+void Exif::setImageSize(unsigned width, unsigned height) {
+    mWidth = width;
+    mHeight = height;
+}
+
+void Exif::setFocalLength(float focalLength) {
+    mFocalLength = (uint32_t)(focalLength * 1000 + 0.5f);
+}
+
+/**
+ * Sets GPS position (latitude, longitude, altitude) and UTC time of the fix
+ * in seconds since epoch, as given in ANDROID_JPEG_GPS_* settings.
+ */
+void Exif::setGps(const double coordinates[3], int64_t timestamp, const char *processingMethod) {
+    mHasGps = true;
+    mLatitude = coordinates[0];
+    mLongitude = coordinates[1];
+    mAltitude = coordinates[2];
+    const time_t t = (time_t)timestamp;
+    gmtime_r(&t, &mGpsTime);
+    snprintf(mGpsProcessingMethod, sizeof(mGpsProcessingMethod), "%s", processingMethod);
+}
+
+/**
+ * Returns size of APP1 segment with thumbnail of given length.
+ */
+size_t Exif::size(size_t thumbnailLen) const {
+    return write(NULL, 0, NULL, thumbnailLen);
+}
+
+/**
+ * Writes APP1 segment (with marker) with IFD0, Exif and GPS IFDs, and IFD1
+ * describing the JPEG thumbnail if there is one. With dst == NULL only
+ * computes the size.
+ *
+ * Returns number of written bytes or 0 if dst is too small.
+ */
+size_t Exif::write(uint8_t *dst, size_t dstLen, const uint8_t *thumbnail, size_t thumbnailLen) const {
+    static const uint8_t exifVersion[] = { '0', '2', '2', '0' };
+    static const uint8_t flashpixVersion[] = { '0', '1', '0', '0' };
+    static const uint8_t componentsConfiguration[] = { 1, 2, 3, 0 };
+    static const uint8_t gpsVersion[] = { 2, 2, 0, 0 };
+    uint8_t resolution[8];
+    uint8_t focalLength[8];
+    uint8_t latitude[24];
+    uint8_t longitude[24];
+    uint8_t altitude[8];
+    uint8_t gpsTime[24];
+    uint8_t gpsMethod[8 + sizeof(mGpsProcessingMethod)];
+    char gpsDate[11];
+
+    putRational(resolution, 72, 1);
+    putRational(focalLength, mFocalLength, 1000);
+
+    /* Offsets of IFDs are known once all sizes are; filled in below */
+    IfdEntry ifd0[] = {
+        { 0x010F, TYPE_ASCII,       (uint32_t)strlen(mMake) + 1,    mMake,      0 },
+        { 0x0110, TYPE_ASCII,       (uint32_t)strlen(mModel) + 1,   mModel,     0 },
+        { 0x0112, TYPE_SHORT,       1,  NULL,       mOrientation },
+        { 0x011A, TYPE_RATIONAL,    1,  resolution, 0 },
+        { 0x011B, TYPE_RATIONAL,    1,  resolution, 0 },
+        { 0x0128, TYPE_SHORT,       1,  NULL,       2 },        /* inches */
+        { 0x0132, TYPE_ASCII,       20, mDateTime,  0 },
+        { 0x0213, TYPE_SHORT,       1,  NULL,       1 },        /* centered */
+        { 0x8769, TYPE_LONG,        1,  NULL,       0 },        /* Exif IFD */
+        { 0x8825, TYPE_LONG,        1,  NULL,       0 },        /* GPS IFD */
+    };
+    const size_t ifd0Num = NELEM(ifd0) - (mHasGps ? 0 : 1);
+
+    const IfdEntry exifIfd[] = {
+        { 0x9000, TYPE_UNDEFINED,   4,  exifVersion,                0 },
+        { 0x9003, TYPE_ASCII,       20, mDateTime,                  0 },
+        { 0x9004, TYPE_ASCII,       20, mDateTime,                  0 },
+        { 0x9101, TYPE_UNDEFINED,   4,  componentsConfiguration,    0 },
+        { 0x920A, TYPE_RATIONAL,    1,  focalLength,                0 },
+        { 0xA000, TYPE_UNDEFINED,   4,  flashpixVersion,            0 },
+        { 0xA001, TYPE_SHORT,       1,  NULL,                       1 },    /* sRGB */
+        { 0xA002, TYPE_LONG,        1,  NULL,                       mWidth },
+        { 0xA003, TYPE_LONG,        1,  NULL,                       mHeight },
+    };
+
+    putDms(latitude, mLatitude);
+    putDms(longitude, mLongitude);
+    putRational(altitude, (uint32_t)(fabs(mAltitude) * 100 + 0.5), 100);
+    putRational(gpsTime, (uint32_t)mGpsTime.tm_hour, 1);
+    putRational(gpsTime + 8, (uint32_t)mGpsTime.tm_min, 1);
+    putRational(gpsTime + 16, (uint32_t)mGpsTime.tm_sec, 1);
+    /* Character code, then text without terminating NUL */
+    const size_t gpsMethodLen = strlen(mGpsProcessingMethod);
+    memcpy(gpsMethod, "ASCII\0\0\0", 8);
+    memcpy(gpsMethod + 8, mGpsProcessingMethod, gpsMethodLen);
+    strftime(gpsDate, sizeof(gpsDate), "%Y:%m:%d", &mGpsTime);
+
+    const IfdEntry gpsIfd[] = {
+        { 0x0000, TYPE_BYTE,        4,  gpsVersion, 0 },
+        { 0x0001, TYPE_ASCII,       2,  mLatitude < 0 ? "S" : "N",  0 },
+        { 0x0002, TYPE_RATIONAL,    3,  latitude,   0 },
+        { 0x0003, TYPE_ASCII,       2,  mLongitude < 0 ? "W" : "E", 0 },
+        { 0x0004, TYPE_RATIONAL,    3,  longitude,  0 },
+        { 0x0005, TYPE_BYTE,        1,  NULL,       mAltitude < 0 ? 1u : 0u },
+        { 0x0006, TYPE_RATIONAL,    1,  altitude,   0 },
+        { 0x0007, TYPE_RATIONAL,    3,  gpsTime,    0 },
+        { 0x001B, TYPE_UNDEFINED,   (uint32_t)(8 + gpsMethodLen),   gpsMethod,  0 },
+        { 0x001D, TYPE_ASCII,       11, gpsDate,    0 },
+    };
+
+    IfdEntry ifd1[] = {
+        { 0x0103, TYPE_SHORT,       1,  NULL,       6 },        /* JPEG */
+        { 0x011A, TYPE_RATIONAL,    1,  resolution, 0 },
+        { 0x011B, TYPE_RATIONAL,    1,  resolution, 0 },
+        { 0x0128, TYPE_SHORT,       1,  NULL,       2 },
+        { 0x0201, TYPE_LONG,        1,  NULL,       0 },        /* thumbnail offset */
+        { 0x0202, TYPE_LONG,        1,  NULL,       (uint32_t)thumbnailLen },
+    };
+    const bool hasThumbnail = thumbnailLen > 0;
+
+    /* TIFF header, IFD0, Exif IFD, GPS IFD, IFD1, thumbnail */
+    const size_t ifd0Offset = TIFF_HEADER_SIZE;
+    const size_t exifOffset = ifd0Offset + ifdSize(ifd0, ifd0Num);
+    const size_t gpsOffset = exifOffset + ifdSize(exifIfd, NELEM(exifIfd));
+    const size_t ifd1Offset = gpsOffset + (mHasGps ? ifdSize(gpsIfd, NELEM(gpsIfd)) : 0);
+    const size_t thumbnailOffset = ifd1Offset + (hasThumbnail ? ifdSize(ifd1, NELEM(ifd1)) : 0);
+    const size_t tiffSize = thumbnailOffset + thumbnailLen;
+    const size_t size = APP1_HEADER_SIZE + tiffSize;
+
+    if(size > MAX_SIZE)
+        return 0;
+    if(!dst)
+        return size;
+    if(size > dstLen)
+        return 0;
+
+    ifd0[8].value = (uint32_t)exifOffset;
+    ifd0[9].value = (uint32_t)gpsOffset;
+    ifd1[4].value = (uint32_t)thumbnailOffset;
+
+    dst[0] = 0xFF;
+    dst[1] = 0xE1;
+    dst[2] = (uint8_t)((size - 2) >> 8);
+    dst[3] = (uint8_t)(size - 2);
+    memcpy(dst + 4, "Exif\0\0", 6);
+
+    uint8_t *tiff = dst + APP1_HEADER_SIZE;
+    memcpy(tiff, "II\x2A\x00", 4);
+    put32(tiff + 4, (uint32_t)ifd0Offset);
+    writeIfd(tiff, ifd0Offset, ifd0, ifd0Num, hasThumbnail ? (uint32_t)ifd1Offset : 0);
+    writeIfd(tiff, exifOffset, exifIfd, NELEM(exifIfd), 0);
+    if(mHasGps)
+        writeIfd(tiff, gpsOffset, gpsIfd, NELEM(gpsIfd), 0);
+    if(hasThumbnail) {
+        writeIfd(tiff, ifd1Offset, ifd1, NELEM(ifd1), 0);
+        memcpy(tiff + thumbnailOffset, thumbnail, thumbnailLen);
+    }
+
+    return size;
+}
+
+}; /* namespace android */
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2015-2016 Antmicro
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EXIF_H
+#define EXIF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+namespace android {
+
+/**
+ * EXIF metadata of a JPEG image, written as APP1 segment.
+ */
+class Exif
+{
+public:
+    /* Largest APP1 segment, with marker */
+    static const size_t MAX_SIZE = 2 + 0xFFFF;
+
+    Exif();
+
+    void setMakeModel(const char *make, const char *model);
+    void setDateTime(time_t time);
+    void setOrientation(int degrees);
+    void setImageSize(unsigned width, unsigned height);
+    void setFocalLength(float focalLength);
+    void setGps(const double coordinates[3], int64_t timestamp, const char *processingMethod);
+
+    size_t size(size_t thumbnailLen) const;
+    size_t write(uint8_t *dst, size_t dstLen, const uint8_t *thumbnail, size_t thumbnailLen) const;
+
+private:
+    char        mMake[32];
+    char        mModel[32];
+    /* "YYYY:MM:DD HH:MM:SS" */
+    char        mDateTime[20];
+    uint16_t    mOrientation;
+    uint32_t    mWidth;
+    uint32_t    mHeight;
+    /* In 1/1000 mm */
+    uint32_t    mFocalLength;
+
+    bool        mHasGps;
+    double      mLatitude;
+    double      mLongitude;
+    double      mAltitude;
+    /* UTC time of the fix */
+    struct tm   mGpsTime;
+    char        mGpsProcessingMethod[33];
+};
+
+}; /* namespace android */
+
+#endif // EXIF_H
@@ -15,152 +15,1030 @@
  */
 
 #include <YuvToJpegEncoder.h>
-#include <SkStream.h>
-#include <libyuv/row.h>
+#include <linux/videodev2.h>
+#include <system/graphics.h>
+#include <utils/misc.h>
+#include <stdlib.h>
 
 #include "Yuv422UyvyToJpegEncoder.h"
 #include "ImageConverter.h"
+#include "ConverterKernels.h"
 #include "DbgUtils.h"
 
-#define WORKERS_TASKS_NUM 30
+#define SCRATCH_ALIGN 64
+/* Upper limit of JPEG slices encoded in parallel */
+#define JPEG_MAX_SLICES 16
+/* Lines in MCU row of the JPEG images written here */
+#define JPEG_MCU_LINES 16
+/* Quality is lowered in such steps when the image does not fit in the buffer */
+#define JPEG_QUALITY_STEP 10
+#define JPEG_MIN_QUALITY 40
+/* Source lines summed into one thumbnail line at most; keeps sums in 16 bits */
+#define THUMBNAIL_MAX_BOX_LINES 256
 
 namespace android {
 
-ImageConverter::ImageConverter() {
+/* Standard Huffman tables (ITU-T T.81, Annex K.3) in a single DHT segment */
+static const uint8_t kStandardDht[] = {
+    0xff, 0xc4, 0x01, 0xa2,
+    /* DC luminance */
+    0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+    /* AC luminance */
+    0x10, 0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01,
+    0x7d, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61,
+    0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1,
+    0xf0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27,
+    0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88,
+    0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6,
+    0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4,
+    0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+    0xf8, 0xf9, 0xfa,
+    /* DC chrominance */
+    0x01, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+    /* AC chrominance */
+    0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00, 0x01, 0x02,
+    0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61,
+    0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52,
+    0xf0, 0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a,
+    0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47,
+    0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67,
+    0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86,
+    0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4,
+    0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2,
+    0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9,
+    0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+    0xf8, 0xf9, 0xfa
+};
+
+/**
+ * Supported conversions. Costs are relative per-pixel estimates used to pick
+ * the cheapest V4L2 capture format for the configured streams.
+ */
+const ImageConverter::Conversion ImageConverter::sConversions[] = {
+    { V4L2_PIX_FMT_UYVY,   HAL_PIXEL_FORMAT_RGBA_8888,      2 },
+    { V4L2_PIX_FMT_UYVY,   HAL_PIXEL_FORMAT_BLOB,           8 },
+    { V4L2_PIX_FMT_UYVY,   HAL_PIXEL_FORMAT_YCbCr_420_888,  1 },
+    { V4L2_PIX_FMT_UYVY,   HAL_PIXEL_FORMAT_YCrCb_420_SP,   1 },
+    { V4L2_PIX_FMT_UYVY,   HAL_PIXEL_FORMAT_YV12,           1 },
+    { V4L2_PIX_FMT_YUYV,   HAL_PIXEL_FORMAT_RGBA_8888,      2 },
+    { V4L2_PIX_FMT_YUYV,   HAL_PIXEL_FORMAT_BLOB,           8 },
+    { V4L2_PIX_FMT_YUYV,   HAL_PIXEL_FORMAT_YCbCr_420_888,  1 },
+    { V4L2_PIX_FMT_YUYV,   HAL_PIXEL_FORMAT_YCrCb_420_SP,   1 },
+    { V4L2_PIX_FMT_YUYV,   HAL_PIXEL_FORMAT_YV12,           1 },
+    { V4L2_PIX_FMT_MJPEG,  HAL_PIXEL_FORMAT_BLOB,           1 },
+    { V4L2_PIX_FMT_JPEG,   HAL_PIXEL_FORMAT_BLOB,           1 },
+};
+
+ImageConverter::ImageConverter()
+    : mScratch(NULL)
+    , mScratchSize(0)
+    , mJpegSource(NULL)
+    , mJpegSourceSize(0) {
 }
 
 ImageConverter::~ImageConverter() {
+    free(mScratch);
+    free(mJpegSource);
 }
 
-uint8_t *ImageConverter::YUY2ToRGBA(const uint8_t *src, uint8_t *dst, unsigned width, unsigned height) {
-    assert(gWorkers.isRunning());
-    assert(src != NULL);
-    assert(dst != NULL);
-    assert(width > 0);
-    assert(height > 0);
+const ImageConverter::Conversion * ImageConverter::findConversion(uint32_t v4l2Format, int halFormat) {
+    for(size_t i = 0; i < NELEM(sConversions); ++i) {
+        if(sConversions[i].v4l2Format == v4l2Format && sConversions[i].halFormat == halFormat)
+            return &sConversions[i];
+    }
+    return NULL;
+}
+
+/**
+ * Returns relative per-pixel cost of conversion or UNSUPPORTED.
+ */
+unsigned ImageConverter::conversionCost(uint32_t v4l2Format, int halFormat) {
+    const Conversion *conv = findConversion(v4l2Format, halFormat);
+    return conv ? conv->cost : UNSUPPORTED;
+}
+
+/**
+ * Returns offset of the first segment with given marker in JPEG headers
+ * (before entropy coded data), or 0 if there is none.
+ */
+static size_t findJpegSegment(const uint8_t *jpeg, size_t len, uint8_t marker) {
+    size_t pos = 2;
+    while(pos + 4 <= len && jpeg[pos] == 0xFF) {
+        if(jpeg[pos + 1] == marker)
+            return pos;
+        if(jpeg[pos + 1] == 0xDA)
+            break;
+        pos += 2 + ((jpeg[pos + 2] << 8) | jpeg[pos + 3]);
+    }
+    return 0;
+}
 
-    Workers::Task::Function taskFn = [](void *data) {
-        ConvertTask::Data *d = static_cast<ConvertTask::Data *>(data);
+/**
+ * Writes width x height JPEG image of srcWidth x srcHeight source, with EXIF
+ * data (if options.exif is set) and a thumbnail. Packed YUV 4:2:2 sources are
+ * downscaled if needed (see downscaleJpegSource()) and encoded, by worker
+ * threads with given priority; JPEG ones are copied, without a thumbnail, and
+ * can not be scaled.
+ *
+ * Returns pointer to the end of written data or dst on failure.
+ */
+uint8_t * ImageConverter::convertJpeg(uint32_t v4l2Format, const uint8_t *src, size_t srcLen, unsigned srcWidth, unsigned srcHeight,
+                                      uint8_t *dst, unsigned width, unsigned height, size_t dstLen, const JpegOptions &options,
+                                      Workers::Priority priority) {
+    const bool scaled = width != srcWidth || height != srcHeight;
+    switch(v4l2Format) {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+            if(scaled && !(src = downscaleJpegSource(v4l2Format, src, srcWidth, srcHeight, width, height)))
+                return dst;
+            return encodeJpeg(v4l2Format, src, dst, width, height, dstLen, options, priority);
 
-        SIMD_ALIGNED(uint8 rowy[kMaxStride]);
-        SIMD_ALIGNED(uint8 rowu[kMaxStride]);
-        SIMD_ALIGNED(uint8 rowv[kMaxStride]);
+        case V4L2_PIX_FMT_MJPEG:
+        case V4L2_PIX_FMT_JPEG: {
+            if(scaled) {
+                ALOGE("%s: Can not scale %.4s image from %ux%u to %ux%u", __FUNCTION__, (const char *)&v4l2Format, srcWidth, srcHeight, width, height);
+                return dst;
+            }
+            if(!options.exif)
+                return MJPEGToJPEG(src, srcLen, dst, dstLen);
 
-        for(size_t i = 0; i < d->linesNum; ++i) {
-            libyuv::YUY2ToUV422Row_NEON(d->src, rowu, rowv, d->width);
-            libyuv::YUY2ToYRow_NEON(d->src, rowy, d->width);
-            /* Somehow destination format is swapped (*ABGR converts to RGBA) */
-            libyuv::I422ToABGRRow_NEON(rowy, rowu, rowv, d->dst, d->width);
-            d->src += d->width * 2;
-            d->dst += d->width * 4;
+            const size_t exifLen = options.exif->size(0);
+            if(exifLen == 0 || exifLen >= dstLen)
+                return dst;
+            uint8_t *end = MJPEGToJPEG(src, srcLen, dst + exifLen, dstLen - exifLen);
+            if(end == dst + exifLen)
+                return dst;
+            /* APP1 ends exactly where the copy's SOI was */
+            dst[0] = 0xFF;
+            dst[1] = 0xD8;
+            options.exif->write(dst + 2, exifLen, NULL, 0);
+            return end;
         }
-    };
 
-    return splitRunWait(src, dst, width, height, taskFn);
+        default:
+            ALOGE("Conversion from %.4s to JPEG not supported", (const char *)&v4l2Format);
+            return dst;
+    }
 }
 
-uint8_t *ImageConverter::YUY2ToJPEG(const uint8_t *src, uint8_t *dst, unsigned width, unsigned height, size_t dstLen, uint8_t quality) {
+/**
+ * Encodes packed YUV 4:2:2 image into baseline JPEG. When the whole image
+ * does not fit in dst, quality is lowered until it does (or JPEG_MIN_QUALITY
+ * is hit).
+ *
+ * Returns pointer to the end of written data or dst on failure.
+ */
+uint8_t * ImageConverter::encodeJpeg(uint32_t v4l2Format, const uint8_t *src, uint8_t *dst, unsigned width, unsigned height, size_t dstLen, const JpegOptions &options,
+                                     Workers::Priority priority) {
     assert(src != NULL);
     assert(dst != NULL);
     assert(width > 0);
     assert(height > 0);
     assert(dstLen > 0);
-    assert(quality <= 100);
+    assert(options.quality <= 100);
+
+    JpegOptions opts = options;
+    for(;;) {
+        bool overflow = false;
+        uint8_t *end = encodeJpegSlices(v4l2Format, src, dst, width, height, dstLen, opts, priority, &overflow);
+        if(end != dst || !overflow)
+            return end;
+        if(opts.quality <= JPEG_MIN_QUALITY) {
+            ALOGE("%s: %ux%u image does not fit in %zu B even with quality %u", __FUNCTION__, width, height, dstLen, opts.quality);
+            return dst;
+        }
+        opts.quality = opts.quality > JPEG_MIN_QUALITY + JPEG_QUALITY_STEP ? opts.quality - JPEG_QUALITY_STEP : JPEG_MIN_QUALITY;
+        ALOGW("%s: %ux%u image does not fit in %zu B, retrying with quality %u", __FUNCTION__, width, height, dstLen, opts.quality);
+    }
+}
+
+/**
+ * Encodes the image in slices of whole MCU rows, each one as a separate JPEG
+ * by a worker thread or the calling one, straight into its part of dst (sized
+ * proportionally to its height). A slice which does not fit is encoded again
+ * into the space the others left, see compactSlices(). Slices are then moved
+ * together into one image with restart markers between them: the restart
+ * interval is set to the slice size, so at every boundary the decoder resets
+ * DC prediction, just like every slice's encoder did. Headers of the first
+ * slice, with the image height fixed, are used for the whole image.
+ * Compressors come from mJpegPool, so after the first image of a width and
+ * quality there is no setup left to do.
+ *
+ * With EXIF data, space for the largest APP1 segment is left at the beginning
+ * of dst, and the thumbnail is made by another task at the same time as the
+ * slices. APP1 then replaces JFIF APP0 of the first slice.
+ *
+ * Returns pointer to the end of written data or dst on failure; *overflow is
+ * set when the slices did not fit in dst.
+ */
+uint8_t * ImageConverter::encodeJpegSlices(uint32_t v4l2Format, const uint8_t *src, uint8_t *dst, unsigned width, unsigned height, size_t dstLen, const JpegOptions &options,
+                                           Workers::Priority priority, bool *overflow) {
+    assert(gWorkers.isRunning());
+
+    /* Two slices per thread even out the load when other conversions run too */
+    const unsigned mcusPerRow = (width + JPEG_MCU_LINES - 1) / JPEG_MCU_LINES;
+    const unsigned mcuRows = (height + JPEG_MCU_LINES - 1) / JPEG_MCU_LINES;
+    unsigned slicesNum = gWorkers.threadsNum() * 2;
+    if(slicesNum > JPEG_MAX_SLICES)
+        slicesNum = JPEG_MAX_SLICES;
+    if(slicesNum > mcuRows)
+        slicesNum = mcuRows;
+    if(slicesNum < 1)
+        slicesNum = 1;
+    unsigned sliceMcuRows = (mcuRows + slicesNum - 1) / slicesNum;
+    /* Restart interval is 16 bit */
+    if(sliceMcuRows * mcusPerRow > 0xFFFF) {
+        sliceMcuRows = mcuRows;
+    }
+    slicesNum = (mcuRows + sliceMcuRows - 1) / sliceMcuRows;
+    const unsigned restartInterval = slicesNum > 1 ? sliceMcuRows * mcusPerRow : 0;
+
+    /* Thumbnail of even width, in the space left in APP1 (and reasonably
+     * small compared to the whole image) */
+    const Exif *exif = options.exif;
+    const unsigned thumbWidth = exif ? options.thumbnailWidth & ~1u : 0;
+    const unsigned thumbHeight = exif ? options.thumbnailHeight : 0;
+    const bool hasThumbnail = thumbWidth > 0 && thumbHeight > 0;
+    size_t thumbCapacity = 0;
+    size_t exifReserve = 0;
+    if(exif) {
+        if(hasThumbnail) {
+            /* size() counts IFD1 only with a thumbnail */
+            thumbCapacity = Exif::MAX_SIZE - (exif->size(1) - 1);
+            if(thumbCapacity > dstLen / 8)
+                thumbCapacity = dstLen / 8;
+        }
+        exifReserve = exif->size(thumbCapacity);
+        if(exifReserve == 0 || exifReserve >= dstLen) {
+            ALOGE("%s: No space for EXIF data", __FUNCTION__);
+            return dst;
+        }
+    }
+
+    Workers::RangeFunction sliceFn = [](void *data, size_t begin, size_t end) {
+        for(size_t i = begin; i < end; ++i)
+            encodeSlice(static_cast<JpegSlice *>(data) + i);
+    };
+
+    Workers::Task::Function thumbnailFn = [](void *data) {
+        ThumbnailTask::Data *d = static_cast<ThumbnailTask::Data *>(data);
+        const unsigned yOffset = d->v4l2Format == V4L2_PIX_FMT_UYVY ? 1 : 0;
+        int strides[] = { (int)d->width * 2 };
+        const size_t rowsSize = Yuv422UyvyToJpegEncoder::rowsSize((int)d->width);
+
+        downscaleBox(yOffset, d->src, d->srcWidth, d->srcHeight, d->image, d->width, d->height, d->acc);
 
-    /* TODO: do it parallel with libjpeg */
+        /* Smaller thumbnail is better than none */
+        unsigned quality = d->quality;
+        for(;;) {
+            JpegCompressorPool::Context *context = d->pool->acquire((int)d->width, (int)quality, rowsSize);
+            if(!context)
+                return;
+            bool overflow = false;
+            if(yOffset == 0) {
+                Yuv422YuyvToJpegEncoder encoder(strides);
+                d->ok = encoder.encode(context, d->out, d->outLen, d->image, (int)d->height, 0, &d->written, &overflow);
+            } else {
+                Yuv422UyvyToJpegEncoder encoder(strides);
+                d->ok = encoder.encode(context, d->out, d->outLen, d->image, (int)d->height, 0, &d->written, &overflow);
+            }
+            d->pool->release(context);
+            if(d->ok || !overflow || quality <= JPEG_MIN_QUALITY)
+                return;
+            quality = quality > JPEG_MIN_QUALITY + JPEG_QUALITY_STEP ? quality - JPEG_QUALITY_STEP : JPEG_MIN_QUALITY;
+        }
+    };
 
-    int strides[] = { (int)width * 2 };
-    int offsets[] = { 0 };
-    Yuv422IToJpegEncoder encoder(strides);
-    SkDynamicMemoryWStream stream;
+    /* Compressors of the slices */
+    const size_t rowsSize = Yuv422UyvyToJpegEncoder::rowsSize((int)width);
+    JpegSlice slices[JPEG_MAX_SLICES];
+    for(unsigned i = 0; i < slicesNum; ++i) {
+        slices[i].context = mJpegPool.acquire((int)width, options.quality, rowsSize);
+        if(!slices[i].context) {
+            ALOGE("%s: Could not create JPEG compressor", __FUNCTION__);
+            while(i--)
+                mJpegPool.release(slices[i].context);
+            return dst;
+        }
+    }
 
-    encoder.encode(&stream, (void *)src, (int)width, (int)height, offsets, quality);
+    /* Thumbnail's buffers */
+    uint8_t *mem = NULL;
+    size_t thumbImageSize = 0;
+    size_t thumbAccSize = 0;
+    if(hasThumbnail) {
+        thumbImageSize = ((size_t)thumbWidth * thumbHeight * 2 + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+        thumbAccSize = ((size_t)width * 2 * sizeof(uint16_t) + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+        mem = scratch(thumbImageSize + thumbAccSize + thumbCapacity);
+        if(!mem) {
+            ALOGE("%s: Could not allocate thumbnail buffers", __FUNCTION__);
+            for(unsigned i = 0; i < slicesNum; ++i)
+                mJpegPool.release(slices[i].context);
+            return dst;
+        }
+    }
 
-    if(stream.getOffset() > dstLen)
+    ThumbnailTask thumbnail;
+    if(hasThumbnail) {
+        ThumbnailTask::Data &d = thumbnail.data;
+        d.v4l2Format    = v4l2Format;
+        d.src           = src;
+        d.srcWidth      = width;
+        d.srcHeight     = height;
+        d.width         = thumbWidth;
+        d.height        = thumbHeight;
+        d.quality       = options.thumbnailQuality;
+        d.pool          = &mJpegPool;
+        d.image         = mem;
+        d.acc           = reinterpret_cast<uint16_t *>(mem + thumbImageSize);
+        d.out           = mem + thumbImageSize + thumbAccSize;
+        d.outLen        = thumbCapacity;
+        d.written       = 0;
+        d.ok            = false;
+
+        /* Queued first: it is small and must not end up waiting for the slices */
+        thumbnail.task = Workers::Task(thumbnailFn, (void *)&d);
+        gWorkers.queueTask(&thumbnail.task, priority);
+    }
+
+    const size_t slicesLen = dstLen - exifReserve;
+    for(unsigned i = 0; i < slicesNum; ++i) {
+        const unsigned firstLine = i * sliceMcuRows * JPEG_MCU_LINES;
+        const unsigned endLine = (i + 1) * sliceMcuRows * JPEG_MCU_LINES < height ? (i + 1) * sliceMcuRows * JPEG_MCU_LINES : height;
+        const size_t outBegin = exifReserve + (size_t)((uint64_t)slicesLen * firstLine / height);
+        const size_t outEnd = exifReserve + (size_t)((uint64_t)slicesLen * endLine / height);
+
+        JpegSlice &d = slices[i];
+        d.v4l2Format        = v4l2Format;
+        d.src               = src + (size_t)firstLine * width * 2;
+        d.width             = width;
+        d.height            = endLine - firstLine;
+        d.restartInterval   = restartInterval;
+        d.out               = dst + outBegin;
+        d.outLen            = outEnd - outBegin;
+        d.written           = 0;
+        d.ok                = false;
+        d.overflow          = false;
+    }
+    gWorkers.parallelFor(slicesNum, 1, sliceFn, slices, priority);
+
+    const bool ok = compactSlices(slices, slicesNum, dst + exifReserve, dst + dstLen, overflow);
+    for(unsigned i = 0; i < slicesNum; ++i)
+        mJpegPool.release(slices[i].context);
+    if(hasThumbnail)
+        thumbnail.task.waitForCompletion();
+    if(!ok) {
+        if(!*overflow)
+            ALOGE("%s: JPEG encoding failed", __FUNCTION__);
+        return dst;
+    }
+
+    /* First slice becomes the beginning of the image */
+    size_t imageLen = slices[0].written;
+    if(exif) {
+        const uint8_t *first = slices[0].out;
+        const uint8_t *thumb = NULL;
+        size_t thumbLen = 0;
+        if(hasThumbnail && thumbnail.data.ok) {
+            thumb = thumbnail.data.out;
+            thumbLen = thumbnail.data.written;
+        } else if(hasThumbnail) {
+            ALOGW("%s: %ux%u thumbnail could not be encoded, skipping", __FUNCTION__, thumbWidth, thumbHeight);
+        }
+
+        /* SOI, APP1, then the first slice without SOI and APP0. APP1 ends
+         * before the first slice's data, so it can be written first. */
+        size_t skip = 2;
+        if(imageLen >= 6 && first[2] == 0xFF && first[3] == 0xE0)
+            skip += 2 + ((first[4] << 8) | first[5]);
+        dst[0] = 0xFF;
+        dst[1] = 0xD8;
+        const size_t exifLen = exif->write(dst + 2, exifReserve, thumb, thumbLen);
+        memmove(dst + 2 + exifLen, first + skip, imageLen - skip);
+        imageLen = 2 + exifLen + imageLen - skip;
+    }
+
+    if(slicesNum == 1)
+        return dst + imageLen;
+
+    /* Fix height and drop EOI */
+    const size_t sof = findJpegSegment(dst, imageLen, 0xC0);
+    if(!sof) {
+        ALOGE("%s: Unexpected JPEG slice structure", __FUNCTION__);
         return dst;
+    }
+    dst[sof + 5] = (uint8_t)(height >> 8);
+    dst[sof + 6] = (uint8_t)(height);
+    uint8_t *out = dst + imageLen - 2;
+
+    /* Entropy coded data of the other slices follows, after RSTn. Slices are
+     * already one after another, so each of them only moves backwards. */
+    for(unsigned i = 1; i < slicesNum; ++i) {
+        const JpegSlice &d = slices[i];
+        size_t dataPos = findJpegSegment(d.out, d.written, 0xDA);
+        if(!dataPos) {
+            ALOGE("%s: Unexpected JPEG slice structure", __FUNCTION__);
+            return dst;
+        }
+        dataPos += 2 + ((d.out[dataPos + 2] << 8) | d.out[dataPos + 3]);
+        const size_t dataLen = d.written - 2 - dataPos;
+
+        *out++ = 0xFF;
+        *out++ = (uint8_t)(0xD0 + ((i - 1) & 7));
+        memmove(out, d.out + dataPos, dataLen);
+        out += dataLen;
+    }
+    *out++ = 0xFF;
+    *out++ = 0xD9;
 
-    stream.copyTo(dst);
-    return dst + stream.getOffset();
+    return out;
 }
 
-uint8_t *ImageConverter::UYVYToRGBA(const uint8_t *src, uint8_t *dst, unsigned width, unsigned height) {
-    assert(gWorkers.isRunning());
-    assert(src != NULL);
-    assert(dst != NULL);
-    assert(width > 0);
-    assert(height > 0);
+/**
+ * Encodes slice into its part of the destination buffer.
+ */
+void ImageConverter::encodeSlice(JpegSlice *d) {
+    int strides[] = { (int)d->width * 2 };
 
-    Workers::Task::Function taskFn = [](void *data) {
-        ConvertTask::Data *d = static_cast<ConvertTask::Data *>(data);
+    d->written = 0;
+    d->overflow = false;
+    if(d->v4l2Format == V4L2_PIX_FMT_YUYV) {
+        Yuv422YuyvToJpegEncoder encoder(strides);
+        d->ok = encoder.encode(d->context, d->out, d->outLen, d->src, (int)d->height,
+                               d->restartInterval, &d->written, &d->overflow);
+    } else {
+        Yuv422UyvyToJpegEncoder encoder(strides);
+        d->ok = encoder.encode(d->context, d->out, d->outLen, d->src, (int)d->height,
+                               d->restartInterval, &d->written, &d->overflow);
+    }
+}
 
-        SIMD_ALIGNED(uint8 rowy[kMaxStride]);
-        SIMD_ALIGNED(uint8 rowu[kMaxStride]);
-        SIMD_ALIGNED(uint8 rowv[kMaxStride]);
+/**
+ * Moves encoded slices together, in order, starting at begin. A slice which
+ * did not fit in its part of the buffer is encoded again, in the calling
+ * thread, into all the space left: slices after it are moved to the end of
+ * the buffer first. So quality has to be lowered only when the whole image
+ * does not fit.
+ *
+ * Returns false when a slice could not be encoded; *overflow is set if it
+ * did not fit even then.
+ */
+bool ImageConverter::compactSlices(JpegSlice *slices, unsigned count, uint8_t *begin, uint8_t *end, bool *overflow) {
+    uint8_t *pos = begin;
+    bool packed = false;
+    for(unsigned i = 0; i < count; ++i) {
+        JpegSlice &d = slices[i];
+        if(d.ok) {
+            memmove(pos, d.out, d.written);
+            d.out = pos;
+            pos += d.written;
+            continue;
+        }
+        if(!d.overflow)
+            return false;
 
-        for(size_t i = 0; i < d->linesNum; ++i) {
-            libyuv::UYVYToUV422Row_NEON(d->src, rowu, rowv, d->width);
-            libyuv::UYVYToYRow_NEON(d->src, rowy, d->width);
-            /* Somehow destination format is swapped (*ABGR converts to RGBA) */
-            libyuv::I422ToABGRRow_NEON(rowy, rowu, rowv, d->dst, d->width);
-            d->src += d->width * 2;
-            d->dst += d->width * 4;
+        /* Every slice ends before the part of the next one begins, so moving
+         * them from the last one never overwrites data not moved yet */
+        if(!packed) {
+            uint8_t *top = end;
+            for(unsigned j = count; j-- > i + 1;) {
+                if(!slices[j].ok)
+                    continue;
+                top -= slices[j].written;
+                memmove(top, slices[j].out, slices[j].written);
+                slices[j].out = top;
+            }
+            packed = true;
+        }
+        uint8_t *limit = end;
+        for(unsigned j = i + 1; j < count; ++j) {
+            if(slices[j].ok) {
+                limit = slices[j].out;
+                break;
+            }
         }
-    };
 
-    return splitRunWait(src, dst, width, height, taskFn);
+        ALOGD("%s: JPEG slice %u does not fit in %zu B, encoding it again in %zu B", __FUNCTION__, i, d.outLen, (size_t)(limit - pos));
+        d.out = pos;
+        d.outLen = (size_t)(limit - pos);
+        encodeSlice(&d);
+        if(!d.ok) {
+            *overflow = d.overflow;
+            return false;
+        }
+        pos += d.written;
+    }
+    return true;
 }
 
-uint8_t *ImageConverter::UYVYToJPEG(const uint8_t *src, uint8_t *dst, unsigned width, unsigned height, size_t dstLen, uint8_t quality) {
+/**
+ * Downscales packed YUV 4:2:2 image, cropped to the output aspect ratio, by
+ * averaging boxes of source pixels. Rows of a box are summed by SIMD kernel
+ * into acc (2 * srcWidth entries), then columns of the sums are added up.
+ */
+void ImageConverter::downscaleBox(unsigned yOffset, const uint8_t *src, unsigned srcWidth, unsigned srcHeight,
+                                  uint8_t *dst, unsigned width, unsigned height, uint16_t *acc) {
+    const ConverterKernels::Kernels &k = ConverterKernels::kernels();
+
+    /* Same crop as initScaler() */
+    unsigned cropWidth = srcWidth;
+    unsigned cropHeight = srcHeight;
+    if((uint64_t)srcWidth * height > (uint64_t)width * srcHeight)
+        cropWidth = (unsigned)((uint64_t)srcHeight * width / height) & ~1u;
+    else
+        cropHeight = (unsigned)((uint64_t)srcWidth * height / width);
+    if(cropWidth < 2)
+        cropWidth = 2;
+    if(cropHeight < 1)
+        cropHeight = 1;
+    const unsigned cropX = ((srcWidth - cropWidth) / 2) & ~1u;
+    const unsigned cropY = (srcHeight - cropHeight) / 2;
+    const size_t srcStride = (size_t)srcWidth * 2;
+    const size_t rowLen = (size_t)cropWidth * 2;
+
+    for(unsigned line = 0; line < height; ++line) {
+        unsigned y0 = cropY + (unsigned)((uint64_t)line * cropHeight / height);
+        unsigned y1 = cropY + (unsigned)((uint64_t)(line + 1) * cropHeight / height);
+        if(y1 <= y0)
+            y1 = y0 + 1;
+        if(y1 - y0 > THUMBNAIL_MAX_BOX_LINES)
+            y1 = y0 + THUMBNAIL_MAX_BOX_LINES;
+        const unsigned lines = y1 - y0;
+
+        memset(acc, 0, rowLen * sizeof(uint16_t));
+        for(unsigned y = y0; y < y1; ++y)
+            k.accumulateRow(src + y * srcStride + cropX * 2, acc, rowLen);
+
+        uint8_t *out = dst + (size_t)line * width * 2;
+        for(unsigned x = 0; x < width; ++x) {
+            unsigned x0 = (unsigned)((uint64_t)x * cropWidth / width);
+            unsigned x1 = (unsigned)((uint64_t)(x + 1) * cropWidth / width);
+            if(x1 <= x0)
+                x1 = x0 + 1;
+            uint32_t sum = 0;
+            for(unsigned i = x0; i < x1; ++i)
+                sum += acc[i * 2 + yOffset];
+            const uint32_t n = (x1 - x0) * lines;
+            out[x * 2 + yOffset] = (uint8_t)((sum + n / 2) / n);
+        }
+
+        /* U, then V two bytes further; one of each per macropixel */
+        const unsigned pairs = width / 2;
+        const unsigned cropPairs = cropWidth / 2;
+        for(unsigned x = 0; x < pairs; ++x) {
+            unsigned m0 = (unsigned)((uint64_t)x * cropPairs / pairs);
+            unsigned m1 = (unsigned)((uint64_t)(x + 1) * cropPairs / pairs);
+            if(m1 <= m0)
+                m1 = m0 + 1;
+            const uint32_t n = (m1 - m0) * lines;
+            for(unsigned c = 0; c < 2; ++c) {
+                const unsigned o = 1 - yOffset + c * 2;
+                uint32_t sum = 0;
+                for(unsigned i = m0; i < m1; ++i)
+                    sum += acc[i * 4 + o];
+                out[x * 4 + o] = (uint8_t)((sum + n / 2) / n);
+            }
+        }
+    }
+}
+
+/**
+ * Downscales packed YUV 4:2:2 source of a JPEG image into mJpegSource, with
+ * the same crop as other streams get. Box filter is used, as for thumbnails:
+ * it is cheap and does not alias at large ratios.
+ *
+ * Returns the scaled image or NULL on failure.
+ */
+const uint8_t * ImageConverter::downscaleJpegSource(uint32_t v4l2Format, const uint8_t *src, unsigned srcWidth, unsigned srcHeight,
+                                                    unsigned width, unsigned height) {
+    if(width == 0 || width % 2 != 0 || height == 0 || width > srcWidth || height > srcHeight) {
+        ALOGE("%s: Can not scale %ux%u to %ux%u", __FUNCTION__, srcWidth, srcHeight, width, height);
+        return NULL;
+    }
+
+    const size_t imageSize = ((size_t)width * height * 2 + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    const size_t accSize = (size_t)srcWidth * 2 * sizeof(uint16_t);
+    uint8_t *mem = growBuffer(&mJpegSource, &mJpegSourceSize, imageSize + accSize);
+    if(!mem) {
+        ALOGE("%s: Could not allocate %zu B", __FUNCTION__, imageSize + accSize);
+        return NULL;
+    }
+
+    const unsigned yOffset = v4l2Format == V4L2_PIX_FMT_UYVY ? 1 : 0;
+    downscaleBox(yOffset, src, srcWidth, srcHeight, mem, width, height, reinterpret_cast<uint16_t *>(mem + imageSize));
+    return mem;
+}
+
+/**
+ * Copies JPEG image captured by the camera. Motion JPEG frames often come
+ * without Huffman tables (they are implied by the format) - standard ones are
+ * inserted then, so that the image can be read by any decoder.
+ */
+uint8_t *ImageConverter::MJPEGToJPEG(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen) {
     assert(src != NULL);
     assert(dst != NULL);
-    assert(width > 0);
-    assert(height > 0);
     assert(dstLen > 0);
-    assert(quality <= 100);
 
-    /* TODO: do it parallel with libjpeg */
-
-    int strides[] = { (int)width * 2 };
-    int offsets[] = { 0 };
-    Yuv422UyvyToJpegEncoder encoder(strides);
-    SkDynamicMemoryWStream stream;
+    if(srcLen < 4 || src[0] != 0xFF || src[1] != 0xD8) {
+        ALOGE("%s: Invalid JPEG image", __FUNCTION__);
+        return dst;
+    }
 
-    encoder.encode(&stream, (void *)src, (int)width, (int)height, offsets, quality);
+    /* Look for DHT in headers (everything before SOS) */
+    bool hasDht = false;
+    size_t pos = 2;
+    while(pos + 4 <= srcLen && src[pos] == 0xFF) {
+        const uint8_t marker = src[pos + 1];
+        if(marker == 0xC4) {
+            hasDht = true;
+            break;
+        }
+        if(marker == 0xDA)
+            break;
+        pos += 2 + ((src[pos + 2] << 8) | src[pos + 3]);
+    }
 
-    if(stream.getOffset() > dstLen)
+    const size_t dhtLen = hasDht ? 0 : sizeof(kStandardDht);
+    if(srcLen + dhtLen > dstLen)
         return dst;
 
-    stream.copyTo(dst);
-    return dst + stream.getOffset();
+    /* SOI, DHT, rest of the image */
+    memcpy(dst, src, 2);
+    memcpy(dst + 2, kStandardDht, dhtLen);
+    memcpy(dst + 2 + dhtLen, src + 2, srcLen - 2);
+
+    return dst + srcLen + dhtLen;
+}
+
+/**
+ * Returns whether HAL pixel format is one of supported YUV 4:2:0 formats.
+ */
+bool ImageConverter::isYCbCr420(int halFormat) {
+    return halFormat == HAL_PIXEL_FORMAT_YCbCr_420_888 ||
+           halFormat == HAL_PIXEL_FORMAT_YCrCb_420_SP ||
+           halFormat == HAL_PIXEL_FORMAT_YV12;
+}
+
+/**
+ * Converts packed YUV 4:2:2 image into any number of RGBA and YUV 4:2:0
+ * outputs, reading the source only once. Outputs of different size than the
+ * source are scaled from the source cropped to their aspect ratio.
+ */
+bool ImageConverter::convertStreams(uint32_t v4l2Format, const uint8_t *src, unsigned width, unsigned height, const Output *outputs, size_t count,
+                                    Workers::Priority priority) {
+    assert(src != NULL);
+
+    if(count > IMAGECONVERTER_MAX_OUTPUTS) {
+        ALOGE("Too many outputs (%zu)", count);
+        return false;
+    }
+
+    /* All scalers share scratch memory - allocate it before setting any up */
+    size_t memSize = 0;
+    for(size_t i = 0; i < count; ++i) {
+        if(outputs[i].width != width || outputs[i].height != height)
+            memSize += scalerMemSize(outputs[i].width, outputs[i].height);
+    }
+    uint8_t *mem = NULL;
+    if(memSize > 0 && !(mem = scratch(memSize))) {
+        ALOGE("Could not allocate %zu B of scratch memory", memSize);
+        return false;
+    }
+
+    Plan plans[IMAGECONVERTER_MAX_OUTPUTS];
+    for(size_t i = 0; i < count; ++i) {
+        if(!initPlan(&plans[i], v4l2Format, src, width, height, outputs[i], &mem))
+            return false;
+    }
+
+    /* Memory traffic per source line decides how many lines fit in cache */
+    size_t lineBytes = (size_t)width * 2;
+    for(size_t i = 0; i < count; ++i) {
+        const Output &o = outputs[i];
+        const size_t outLineBytes = o.halFormat == HAL_PIXEL_FORMAT_RGBA_8888 ? (size_t)o.width * 4 : (size_t)o.width * 3 / 2;
+        lineBytes += outLineBytes * o.height / height;
+    }
+    const PartitionTuner::Partition partition = mTuner.partition(width, height, lineBytes);
+
+    /* Times with background work (e.g. JPEG encoding) running meanwhile say
+     * little about the partition - these are not reported to the tuner */
+    const uint64_t background = gWorkers.backgroundEpoch();
+    const nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    if(!splitRunWait(src, width, height, plans, count, partition, priority))
+        return false;
+    const nsecs_t time = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    if(background != 0 && gWorkers.backgroundEpoch() == background)
+        mTuner.report(time);
+    return true;
+}
+
+/**
+ * Picks row kernels and destination layout for the output. Scaler memory is
+ * taken from *mem.
+ */
+bool ImageConverter::initPlan(Plan *plan, uint32_t v4l2Format, const uint8_t *src, unsigned srcWidth, unsigned srcHeight, const Output &output, uint8_t **mem) {
+    unsigned yOffset;
+    if(v4l2Format == V4L2_PIX_FMT_YUYV) {
+        yOffset = 0;
+    } else if(v4l2Format == V4L2_PIX_FMT_UYVY) {
+        yOffset = 1;
+    } else {
+        ALOGE("Conversion from %.4s to 0x%x not supported", (const char *)&v4l2Format, output.halFormat);
+        return false;
+    }
+    if(output.width == 0 || output.width % 2 != 0 || output.height == 0) {
+        ALOGE("Invalid output size %ux%u", output.width, output.height);
+        return false;
+    }
+
+    const ConverterKernels::Kernels &k = ConverterKernels::kernels();
+    plan->width         = output.width;
+    plan->height        = output.height;
+    plan->rgbaRow       = NULL;
+    plan->planar        = NULL;
+    plan->semiPlanar    = NULL;
+
+    if(output.halFormat == HAL_PIXEL_FORMAT_RGBA_8888) {
+        plan->lineStep  = 1;
+        plan->rgbaRow   = yOffset ? k.uyvyToRgbaRow : k.yuyvToRgbaRow;
+        plan->y         = output.rgba;
+        plan->yStride   = (size_t)output.width * 4;
+    } else if(isYCbCr420(output.halFormat)) {
+        /* Kernel depends on chroma layout: planar (YV12, I420) or interleaved (NV12, NV21) */
+        const android_ycbcr &dst = output.ycbcr;
+        plan->lineStep  = 2;
+        plan->y         = (uint8_t *)dst.y;
+        plan->u         = (uint8_t *)dst.cb;
+        plan->v         = (uint8_t *)dst.cr;
+        plan->yStride   = dst.ystride;
+        plan->cStride   = dst.cstride;
+        if(dst.chroma_step == 2 && plan->v == plan->u + 1) {
+            plan->semiPlanar = yOffset ? k.uyvyToNv12Rows : k.yuyvToNv12Rows;
+        } else if(dst.chroma_step == 2 && plan->u == plan->v + 1) {
+            plan->semiPlanar = yOffset ? k.uyvyToNv21Rows : k.yuyvToNv21Rows;
+            plan->u = plan->v;
+        } else if(dst.chroma_step == 1) {
+            plan->planar = yOffset ? k.uyvyToI420Rows : k.yuyvToI420Rows;
+        } else {
+            ALOGE("Unsupported YCbCr layout (chroma step %zu)", dst.chroma_step);
+            return false;
+        }
+    } else {
+        ALOGE("Conversion from %.4s to 0x%x not supported", (const char *)&v4l2Format, output.halFormat);
+        return false;
+    }
+
+    plan->scaled = (output.width != srcWidth || output.height != srcHeight);
+    if(plan->scaled) {
+        if(!initScaler(&plan->scaler, yOffset, src, srcWidth, srcHeight, output.width, output.height, *mem))
+            return false;
+        *mem += scalerMemSize(output.width, output.height);
+    }
+    return true;
+}
+
+/**
+ * Returns source line for output line: read directly, or scaled into out.
+ */
+const uint8_t * ImageConverter::Plan::sourceRow(const uint8_t *src, size_t srcStride, size_t line, uint8_t *out) const {
+    if(!scaled)
+        return src + line * srcStride;
+    scaler.scaleRow(line, out);
+    return out;
+}
+
+/**
+ * Converts output line (RGBA) or pair of lines starting at it (4:2:0).
+ */
+void ImageConverter::Plan::convertLines(const uint8_t *src, size_t srcStride, unsigned taskId, size_t line) const {
+    uint8_t *rows = scaled ? scaler.rows + taskId * scaler.rowStride * 2 : NULL;
+    const uint8_t *src0 = sourceRow(src, srcStride, line, rows);
+    uint8_t *y0 = y + line * yStride;
+
+    if(rgbaRow) {
+        rgbaRow(src0, y0, width);
+        return;
+    }
+
+    /* Odd last line is paired with itself */
+    const bool pair = line + 1 < height;
+    const uint8_t *src1 = pair ? sourceRow(src, srcStride, line + 1, rows + (scaled ? scaler.rowStride : 0)) : src0;
+    uint8_t *y1 = pair ? y0 + yStride : y0;
+    const size_t c = line / 2 * cStride;
+
+    if(semiPlanar)
+        semiPlanar(src0, src1, y0, y1, u + c, width);
+    else
+        planar(src0, src1, y0, y1, u + c, v + c, width);
+}
+
+/**
+ * Maps output sample i to source samples, aligning centers of both grids.
+ * Returned index leaves room for the second sample.
+ */
+static void mapSample(unsigned srcSize, unsigned dstSize, unsigned i, unsigned *index, uint16_t *frac) {
+    /* (i + 0.5) * srcSize / dstSize - 0.5, in 1/256 */
+    int64_t pos = (int64_t)(2 * i + 1) * srcSize * 256 / (2 * dstSize) - 128;
+    if(pos < 0)
+        pos = 0;
+
+    *index = (unsigned)(pos >> 8);
+    *frac = (uint16_t)(pos & 0xff);
+    if(*index >= srcSize - 1) {
+        *index = srcSize - 2;
+        *frac = 256;
+    }
+}
+
+/**
+ * Returns scratch memory needed by scaler: taps and row buffers for all tasks.
+ */
+size_t ImageConverter::scalerMemSize(unsigned width, unsigned height) {
+    const size_t tapsSize = ((size_t)width + width / 2 + height) * sizeof(Tap);
+    const size_t tapsStride = (tapsSize + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    /* Row kernels might process a few pixels past the width */
+    const size_t rowStride = ((size_t)width * 2 + SCRATCH_ALIGN * 2 - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    return tapsStride + rowStride * 2 * IMAGECONVERTER_MAX_TASKS;
 }
 
-uint8_t * ImageConverter::splitRunWait(const uint8_t *src, uint8_t *dst, unsigned width, unsigned height, Workers::Task::Function fn) {
-    ConvertTask tasks[WORKERS_TASKS_NUM];
+/**
+ * Prepares scaler of packed YUV 4:2:2 image in memory of scalerMemSize().
+ */
+bool ImageConverter::initScaler(Scaler *scaler, unsigned yOffset, const uint8_t *src, unsigned srcWidth, unsigned srcHeight, unsigned width, unsigned height, uint8_t *mem) {
+    /* Crop to output aspect ratio; keep macropixels whole */
+    unsigned cropWidth = srcWidth;
+    unsigned cropHeight = srcHeight;
+    if((uint64_t)srcWidth * height > (uint64_t)width * srcHeight)
+        cropWidth = (unsigned)((uint64_t)srcHeight * width / height) & ~1u;
+    else
+        cropHeight = (unsigned)((uint64_t)srcWidth * height / width);
+    if(cropWidth < 4 || cropHeight < 2) {
+        ALOGE("Can not scale %ux%u to %ux%u", srcWidth, srcHeight, width, height);
+        return false;
+    }
+    const unsigned cropX = ((srcWidth - cropWidth) / 2) & ~1u;
+    const unsigned cropY = (srcHeight - cropHeight) / 2;
+
+    const size_t chromaNum = width / 2;
+    const size_t tapsSize = (width + chromaNum + height) * sizeof(Tap);
+    const size_t tapsStride = (tapsSize + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+
+    Tap *lumaTaps = reinterpret_cast<Tap *>(mem);
+    Tap *chromaTaps = lumaTaps + width;
+    Tap *lineTaps = chromaTaps + chromaNum;
+    unsigned index;
+    for(unsigned i = 0; i < width; ++i) {
+        mapSample(cropWidth, width, i, &index, &lumaTaps[i].frac);
+        lumaTaps[i].offset = index * 2 + yOffset;
+    }
+    for(unsigned i = 0; i < chromaNum; ++i) {
+        mapSample(cropWidth / 2, chromaNum, i, &index, &chromaTaps[i].frac);
+        chromaTaps[i].offset = index * 4 + 1 - yOffset;
+    }
+    for(unsigned i = 0; i < height; ++i) {
+        mapSample(cropHeight, height, i, &index, &lineTaps[i].frac);
+        lineTaps[i].offset = index;
+    }
 
-    const uint8_t   *srcPtr = src;
-    uint8_t         *dstPtr = dst;
-    const size_t linesPerTask = (height + WORKERS_TASKS_NUM - 1) / WORKERS_TASKS_NUM;
-    for(size_t i = 0; i < WORKERS_TASKS_NUM; ++i) {
-        tasks[i].data.src       = srcPtr;
-        tasks[i].data.dst       = dstPtr;
-        tasks[i].data.width     = width;
-        tasks[i].data.linesNum  = linesPerTask;
-        if((i + 1) * linesPerTask >= height) {
-            tasks[i].data.linesNum = height - i * linesPerTask;
+    scaler->src         = src + ((size_t)cropY * srcWidth + cropX) * 2;
+    scaler->srcStride   = (size_t)srcWidth * 2;
+    scaler->cropY       = cropY;
+    scaler->yOffset     = yOffset;
+    scaler->width       = width;
+    scaler->lumaTaps    = lumaTaps;
+    scaler->chromaTaps  = chromaTaps;
+    scaler->lineTaps    = lineTaps;
+    scaler->rows        = mem + tapsStride;
+    scaler->rowStride   = ((size_t)width * 2 + SCRATCH_ALIGN * 2 - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    return true;
+}
+
+/**
+ * Writes one output line, interpolating between two source lines and two
+ * neighbouring samples of the same component in each of them.
+ */
+void ImageConverter::Scaler::scaleRow(size_t line, uint8_t *out) const {
+    const Tap &lt = lineTaps[line];
+    const uint8_t *r0 = src + lt.offset * srcStride;
+    const uint8_t *r1 = r0 + srcStride;
+    const unsigned fy = lt.frac;
+
+    for(size_t x = 0; x < width; ++x) {
+        const Tap &t = lumaTaps[x];
+        const unsigned a = r0[t.offset] * (256 - t.frac) + r0[t.offset + 2] * t.frac;
+        const unsigned b = r1[t.offset] * (256 - t.frac) + r1[t.offset + 2] * t.frac;
+        out[x * 2 + yOffset] = (uint8_t)((a * (256 - fy) + b * fy + 32768) >> 16);
+    }
+
+    /* U, then V two bytes further; next macropixel is four bytes away */
+    uint8_t *c = out + 1 - yOffset;
+    for(size_t x = 0; x < width / 2; ++x) {
+        const Tap &t = chromaTaps[x];
+        for(unsigned i = 0; i < 2; ++i) {
+            const unsigned o = t.offset + i * 2;
+            const unsigned a = r0[o] * (256 - t.frac) + r0[o + 4] * t.frac;
+            const unsigned b = r1[o] * (256 - t.frac) + r1[o + 4] * t.frac;
+            c[x * 4 + i * 2] = (uint8_t)((a * (256 - fy) + b * fy + 32768) >> 16);
         }
+    }
+}
+
+/**
+ * Returns scratch memory of at least specified size, aligned for SIMD.
+ * Contents are not preserved between calls.
+ */
+uint8_t * ImageConverter::scratch(size_t size) {
+    return growBuffer(&mScratch, &mScratchSize, size);
+}
 
-        tasks[i].task = Workers::Task(fn, (void *)&tasks[i].data);
-        gWorkers.queueTask(&tasks[i].task);
+/**
+ * Makes *buf at least size bytes long, aligned for SIMD. Contents are lost
+ * when it grows.
+ */
+uint8_t * ImageConverter::growBuffer(uint8_t **buf, size_t *bufSize, size_t size) {
+    if(size <= *bufSize)
+        return *buf;
 
-        srcPtr += linesPerTask * width * 2;
-        dstPtr += linesPerTask * width * 4;
+    free(*buf);
+    *bufSize = 0;
+    if(posix_memalign((void **)buf, SCRATCH_ALIGN, size) != 0) {
+        *buf = NULL;
+        return NULL;
     }
+    *bufSize = size;
+    return *buf;
+}
 
-    for(size_t i = 0; i < WORKERS_TASKS_NUM; ++i) {
-        tasks[i].task.waitForCompletion();
+/**
+ * Runs conversion in worker threads and the calling one. Every task gets
+ * a range of source lines and goes through it in stripes, writing each stripe
+ * into all outputs while it is still in cache. Stripe height and tasks count
+ * come from partition.
+ */
+bool ImageConverter::splitRunWait(const uint8_t *src, unsigned width, unsigned height, Plan *plans, size_t count,
+                                  const PartitionTuner::Partition &partition, Workers::Priority priority) {
+    assert(gWorkers.isRunning());
+
+    Workers::RangeFunction taskFn = [](void *data, size_t begin, size_t end) {
+        const StripeTasks *d = static_cast<const StripeTasks *>(data);
+
+        for(size_t id = begin; id < end; ++id) {
+            const size_t firstLine = id * d->linesPerTask;
+            const size_t endLine = (id + 1) * d->linesPerTask < d->height ? (id + 1) * d->linesPerTask : d->height;
+
+            size_t lines[IMAGECONVERTER_MAX_OUTPUTS];
+            for(size_t i = 0; i < d->plansNum; ++i)
+                lines[i] = d->plans[i].taskLines[id];
+
+            for(size_t stripe = firstLine; stripe < endLine; stripe += d->stripeLines) {
+                for(size_t i = 0; i < d->plansNum; ++i) {
+                    const Plan &p = d->plans[i];
+                    const size_t end = p.taskLines[id + 1];
+                    while(lines[i] < end && p.sourceLine(lines[i]) < stripe + d->stripeLines) {
+                        p.convertLines(d->src, d->srcStride, (unsigned)id, lines[i]);
+                        lines[i] += p.lineStep;
+                    }
+                }
+            }
+        }
+    };
+
+    /* Whole stripes for every task; with rounding up, last tasks might get nothing */
+    const unsigned stripeLines = partition.stripeLines;
+    const unsigned tasksNum = partition.tasksNum;
+    assert(stripeLines > 0 && tasksNum > 0 && tasksNum <= IMAGECONVERTER_MAX_TASKS);
+    const size_t stripesNum = (height + stripeLines - 1) / stripeLines;
+    const size_t linesPerTask = (stripesNum + tasksNum - 1) / tasksNum * stripeLines;
+
+    /* Output lines go to the task which reads their (first) source line */
+    for(size_t i = 0; i < count; ++i) {
+        Plan &p = plans[i];
+        size_t line = 0;
+        for(size_t t = 0; t < tasksNum; ++t) {
+            while(line < p.height && p.sourceLine(line) < t * linesPerTask)
+                line += p.lineStep;
+            p.taskLines[t] = line < p.height ? line : p.height;
+        }
+        p.taskLines[tasksNum] = p.height;
     }
 
-    return dstPtr;
+    StripeTasks d;
+    d.src           = src;
+    d.srcStride     = (size_t)width * 2;
+    d.plans         = plans;
+    d.plansNum      = count;
+    d.stripeLines   = stripeLines;
+    d.linesPerTask  = linesPerTask;
+    d.height        = height;
+
+    gWorkers.parallelFor(tasksNum, 1, taskFn, &d, priority);
+
+    return true;
 }
 
 }; /* namespace android */
@@ -2,35 +2,224 @@
 #define IMAGECONVERTER_H
 
 #include <stdint.h>
+#include <system/graphics.h>
 #include "Workers.h"
+#include "ConverterKernels.h"
+#include "PartitionTuner.h"
+#include "Exif.h"
+#include "JpegCompressorPool.h"
 
 namespace android {
 
+/* Maximum number of outputs of a single convertStreams() call */
+#ifndef IMAGECONVERTER_MAX_OUTPUTS
+# define IMAGECONVERTER_MAX_OUTPUTS 8
+#endif
+
 class ImageConverter
 {
 public:
+    /* Returned by conversionCost() for unsupported format pairs */
+    static const unsigned UNSUPPORTED = ~0u;
+
+    /**
+     * Destination image of convertStreams(). RGBA_8888 data goes to rgba;
+     * planes of YUV 4:2:0 formats are described by ycbcr.
+     */
+    struct Output {
+        int             halFormat;
+        unsigned        width;
+        unsigned        height;
+        uint8_t        *rgba;
+        android_ycbcr   ycbcr;
+    };
+
+    /**
+     * Settings of images written by convertJpeg(). The thumbnail is stored in
+     * EXIF data, so it is written only along with exif; width or height of 0
+     * means no thumbnail.
+     */
+    struct JpegOptions {
+        uint8_t         quality;
+        unsigned        thumbnailWidth;
+        unsigned        thumbnailHeight;
+        uint8_t         thumbnailQuality;
+        const Exif     *exif;
+    };
+
     ImageConverter();
     ~ImageConverter();
 
-    uint8_t * YUY2ToRGBA(const uint8_t *src, uint8_t *dst, unsigned width, unsigned height);
-    uint8_t * YUY2ToJPEG(const uint8_t *src, uint8_t *dst, unsigned width, unsigned height, size_t dstLen, uint8_t quality);
+    static unsigned conversionCost(uint32_t v4l2Format, int halFormat);
+    static bool isYCbCr420(int halFormat);
+    /* Images shown to the user are converted with LATENCY_CRITICAL priority,
+     * still images with BACKGROUND one */
+    bool convertStreams(uint32_t v4l2Format, const uint8_t *src, unsigned width, unsigned height, const Output *outputs, size_t count,
+                        Workers::Priority priority = Workers::LATENCY_CRITICAL);
+    uint8_t * convertJpeg(uint32_t v4l2Format, const uint8_t *src, size_t srcLen, unsigned srcWidth, unsigned srcHeight,
+                          uint8_t *dst, unsigned width, unsigned height, size_t dstLen, const JpegOptions &options,
+                          Workers::Priority priority = Workers::BACKGROUND);
 
-    uint8_t * UYVYToRGBA(const uint8_t *src, uint8_t *dst, unsigned width, unsigned height);
-    uint8_t * UYVYToJPEG(const uint8_t *src, uint8_t *dst, unsigned width, unsigned height, size_t dstLen, uint8_t quality);
+    uint8_t * MJPEGToJPEG(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen);
 
 protected:
-    uint8_t * splitRunWait(const uint8_t *src, uint8_t *dst, unsigned width, unsigned height, Workers::Task::Function fn);
+    /* Source position of an output sample: position of the first of two
+     * neighbouring samples and weight (0..256) of the second one */
+    struct Tap {
+        uint32_t    offset;
+        uint16_t    frac;
+    };
+
+    /**
+     * Bilinear scaler of packed YUV 4:2:2. Produces rows of the same packed
+     * format, in the output size, which are then fed to row kernels.
+     */
+    struct Scaler {
+        /* Top left corner of the source area matching output aspect ratio */
+        const uint8_t  *src;
+        size_t          srcStride;
+        unsigned        cropY;
+        /* Offset of Y in a macropixel: 0 for YUYV, 1 for UYVY */
+        unsigned        yOffset;
+        size_t          width;
+        /* One for each output pixel and pixel pair (byte offsets in a row)
+         * and for each output line (source line numbers) */
+        const Tap      *lumaTaps;
+        const Tap      *chromaTaps;
+        const Tap      *lineTaps;
+        /* Two output rows for every task */
+        uint8_t        *rows;
+        size_t          rowStride;
+
+        void scaleRow(size_t line, uint8_t *out) const;
+    };
+
+    /**
+     * Conversion of the whole source image into one output.
+     */
+    struct Plan {
+        unsigned        width;
+        unsigned        height;
+        /* 4:2:0 lines are converted in pairs */
+        unsigned        lineStep;
+        bool            scaled;
+        Scaler          scaler;
+        ConverterKernels::PackedToRgbaRow           rgbaRow;
+        ConverterKernels::PackedToPlanarRows        planar;
+        ConverterKernels::PackedToSemiPlanarRows    semiPlanar;
+        /* RGBA data goes to y; interleaved chroma of semi-planar formats to u */
+        uint8_t        *y;
+        uint8_t        *u;
+        uint8_t        *v;
+        size_t          yStride;
+        size_t          cStride;
+        /* First line of every task; height at the end */
+        size_t          taskLines[IMAGECONVERTER_MAX_TASKS + 1];
+
+        size_t sourceLine(size_t line) const {
+            return scaled ? scaler.cropY + scaler.lineTaps[line].offset : line;
+        }
+        const uint8_t * sourceRow(const uint8_t *src, size_t srcStride, size_t line, uint8_t *out) const;
+        void convertLines(const uint8_t *src, size_t srcStride, unsigned taskId, size_t line) const;
+    };
+
+    uint8_t * encodeJpeg(uint32_t v4l2Format, const uint8_t *src, uint8_t *dst, unsigned width, unsigned height, size_t dstLen, const JpegOptions &options,
+                         Workers::Priority priority);
+    uint8_t * encodeJpegSlices(uint32_t v4l2Format, const uint8_t *src, uint8_t *dst, unsigned width, unsigned height, size_t dstLen, const JpegOptions &options,
+                               Workers::Priority priority, bool *overflow);
+    static void downscaleBox(unsigned yOffset, const uint8_t *src, unsigned srcWidth, unsigned srcHeight,
+                             uint8_t *dst, unsigned width, unsigned height, uint16_t *acc);
+    const uint8_t * downscaleJpegSource(uint32_t v4l2Format, const uint8_t *src, unsigned srcWidth, unsigned srcHeight,
+                                        unsigned width, unsigned height);
+
+    bool initPlan(Plan *plan, uint32_t v4l2Format, const uint8_t *src, unsigned srcWidth, unsigned srcHeight, const Output &output, uint8_t **mem);
+    bool initScaler(Scaler *scaler, unsigned yOffset, const uint8_t *src, unsigned srcWidth, unsigned srcHeight, unsigned width, unsigned height, uint8_t *mem);
+    static size_t scalerMemSize(unsigned width, unsigned height);
+    bool splitRunWait(const uint8_t *src, unsigned width, unsigned height, Plan *plans, size_t count,
+                      const PartitionTuner::Partition &partition, Workers::Priority priority);
+    uint8_t * scratch(size_t size);
+    static uint8_t * growBuffer(uint8_t **buf, size_t *bufSize, size_t size);
 
 private:
-    struct ConvertTask {
+    struct Conversion {
+        uint32_t    v4l2Format;
+        int         halFormat;
+        /* Relative cost of converting one pixel */
+        unsigned    cost;
+    };
+    static const Conversion sConversions[];
+
+    static const Conversion * findConversion(uint32_t v4l2Format, int halFormat);
+
+    /**
+     * Conversion split into tasks, each converting a range of source lines
+     * into all outputs.
+     */
+    struct StripeTasks {
+        const uint8_t  *src;
+        size_t          srcStride;
+        const Plan     *plans;
+        size_t          plansNum;
+        unsigned        stripeLines;
+        size_t          linesPerTask;
+        size_t          height;
+    };
+
+    /**
+     * Part of the image encoded as a separate JPEG.
+     */
+    struct JpegSlice {
+        uint32_t        v4l2Format;
+        const uint8_t  *src;
+        unsigned        width;
+        unsigned        height;
+        unsigned        restartInterval;
+        JpegCompressorPool::Context *context;
+        /* Part of the destination buffer */
+        uint8_t        *out;
+        size_t          outLen;
+        size_t          written;
+        bool            ok;
+        bool            overflow;
+    };
+
+    static void encodeSlice(JpegSlice *d);
+    static bool compactSlices(JpegSlice *slices, unsigned count, uint8_t *begin, uint8_t *end, bool *overflow);
+
+    /**
+     * Thumbnail downscaled from the source and encoded while slices of the
+     * main image are.
+     */
+    struct ThumbnailTask {
         Workers::Task task;
         struct Data {
+            uint32_t        v4l2Format;
             const uint8_t  *src;
-            uint8_t        *dst;
-            size_t          width;
-            size_t          linesNum;
+            unsigned        srcWidth;
+            unsigned        srcHeight;
+            unsigned        width;
+            unsigned        height;
+            uint8_t         quality;
+            JpegCompressorPool *pool;
+            /* Column sums of one source row of boxes */
+            uint16_t       *acc;
+            uint8_t        *image;
+            uint8_t        *out;
+            size_t          outLen;
+            size_t          written;
+            bool            ok;
         } data;
     };
+
+    /* Grows with the largest set of outputs; not shared between threads */
+    uint8_t    *mScratch;
+    size_t      mScratchSize;
+    /* JPEG source scaled to the image size; the encoder uses mScratch meanwhile */
+    uint8_t    *mJpegSource;
+    size_t      mJpegSourceSize;
+
+    PartitionTuner mTuner;
+    JpegCompressorPool mJpegPool;
 };
 
 }; /* namespace android */
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2015-2016 Antmicro
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <new>
+
+extern "C" {
+#include <jerror.h>
+}
+
+#include "JpegCompressorPool.h"
+#include "DbgUtils.h"
+
+/* Row buffers are aligned for SIMD kernels */
+#define ROWS_ALIGN 64
+
+namespace android {
+
+static void initDestination(j_compress_ptr /*cinfo*/) {
+}
+
+static boolean emptyOutputBuffer(j_compress_ptr cinfo) {
+    reinterpret_cast<JpegCompressorPool::Destination *>(cinfo->dest)->overflow = true;
+    ERREXIT(cinfo, JERR_BUFFER_SIZE);
+    return FALSE;
+}
+
+static void termDestination(j_compress_ptr /*cinfo*/) {
+}
+
+static void errorExit(j_common_ptr cinfo) {
+    longjmp(reinterpret_cast<JpegCompressorPool::ErrorManager *>(cinfo->err)->jump, 1);
+}
+
+JpegCompressorPool::JpegCompressorPool()
+    : mClock(0) {
+}
+
+JpegCompressorPool::~JpegCompressorPool() {
+    for(size_t i = 0; i < mContexts.size(); ++i) {
+        assert(!mContexts[i]->busy);
+        destroyContext(mContexts[i]);
+    }
+}
+
+/**
+ * Returns idle context for given width and quality, creating it if there is
+ * none. When the pool is full, the least recently used idle context makes
+ * room for it.
+ *
+ * Returns NULL when the context could not be created.
+ */
+JpegCompressorPool::Context * JpegCompressorPool::acquire(int width, int quality, size_t rowsSize) {
+    Mutex::Autolock lock(mLock);
+    ssize_t lru = -1;
+    for(size_t i = 0; i < mContexts.size(); ++i) {
+        Context *c = mContexts[i];
+        if(c->busy)
+            continue;
+        if(c->width == width && c->quality == quality) {
+            c->busy = true;
+            c->lastUse = ++mClock;
+            return c;
+        }
+        if(lru < 0 || c->lastUse < mContexts[lru]->lastUse)
+            lru = (ssize_t)i;
+    }
+
+    if(mContexts.size() >= JPEGCOMPRESSORPOOL_MAX_CONTEXTS && lru >= 0) {
+        destroyContext(mContexts[lru]);
+        mContexts.removeAt((size_t)lru);
+    }
+
+    Context *c = createContext(width, quality, rowsSize);
+    if(!c)
+        return NULL;
+    ALOGD("JPEG compressor for width %d, quality %d created (%zu in pool)", width, quality, mContexts.size() + 1);
+    c->busy = true;
+    c->lastUse = ++mClock;
+    mContexts.add(c);
+    return c;
+}
+
+/**
+ * Gives the context back to the pool.
+ */
+void JpegCompressorPool::release(Context *context) {
+    Mutex::Autolock lock(mLock);
+    assert(context->busy);
+    context->busy = false;
+}
+
+/**
+ * Creates compressor with destination and error handling installed, and row
+ * buffers of rowsSize. Tables are left to the encoder (see configured).
+ */
+JpegCompressorPool::Context * JpegCompressorPool::createContext(int width, int quality, size_t rowsSize) {
+    Context *c = new(std::nothrow) Context;
+    if(!c)
+        return NULL;
+    if(posix_memalign((void **)&c->rows, ROWS_ALIGN, rowsSize) != 0) {
+        delete c;
+        return NULL;
+    }
+
+    c->cinfo.err = jpeg_std_error(&c->err.pub);
+    c->err.pub.error_exit = errorExit;
+    if(setjmp(c->err.jump)) {
+        free(c->rows);
+        delete c;
+        return NULL;
+    }
+    jpeg_create_compress(&c->cinfo);
+
+    c->dest.pub.next_output_byte    = NULL;
+    c->dest.pub.free_in_buffer      = 0;
+    c->dest.pub.init_destination    = initDestination;
+    c->dest.pub.empty_output_buffer = emptyOutputBuffer;
+    c->dest.pub.term_destination    = termDestination;
+    c->dest.overflow                = false;
+    c->cinfo.dest = &c->dest.pub;
+
+    c->width        = width;
+    c->quality      = quality;
+    c->configured   = false;
+    c->busy         = false;
+    c->lastUse      = 0;
+    return c;
+}
+
+void JpegCompressorPool::destroyContext(Context *context) {
+    jpeg_destroy_compress(&context->cinfo);
+    free(context->rows);
+    delete context;
+}
+
+}; /* namespace android */
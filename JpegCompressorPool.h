@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2015-2016 Antmicro
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef JPEGCOMPRESSORPOOL_H
+#define JPEGCOMPRESSORPOOL_H
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <utils/Mutex.h>
+#include <utils/Vector.h>
+
+extern "C" {
+#include <jpeglib.h>
+}
+
+/* Upper limit of compressors kept; idle ones are dropped above it */
+#ifndef JPEGCOMPRESSORPOOL_MAX_CONTEXTS
+# define JPEGCOMPRESSORPOOL_MAX_CONTEXTS 40
+#endif
+
+namespace android {
+
+/**
+ * Compressors set up for images of given width and quality, kept between
+ * images. A context has its quantization and Huffman tables computed and its
+ * row buffers allocated once; afterwards an image only needs its height and
+ * restart interval set.
+ *
+ * Contexts can be acquired and released by any thread; one context is used
+ * by one thread at a time.
+ */
+class JpegCompressorPool
+{
+public:
+    /* Fixed size destination; running out of space is an error */
+    struct Destination {
+        jpeg_destination_mgr    pub;
+        bool                    overflow;
+    };
+
+    /* libjpeg errors jump back to the encoder */
+    struct ErrorManager {
+        jpeg_error_mgr          pub;
+        jmp_buf                 jump;
+    };
+
+    struct Context {
+        jpeg_compress_struct    cinfo;
+        ErrorManager            err;
+        Destination             dest;
+        int                     width;
+        int                     quality;
+        /* Set once the encoder has set up cinfo for this width and quality */
+        bool                    configured;
+        uint8_t                *rows;
+        bool                    busy;
+        uint64_t                lastUse;
+    };
+
+    JpegCompressorPool();
+    ~JpegCompressorPool();
+
+    Context * acquire(int width, int quality, size_t rowsSize);
+    void release(Context *context);
+
+private:
+    static Context * createContext(int width, int quality, size_t rowsSize);
+    static void destroyContext(Context *context);
+
+    Mutex               mLock;
+    Vector<Context *>   mContexts;
+    uint64_t            mClock;
+};
+
+}; /* namespace android */
+
+#endif // JPEGCOMPRESSORPOOL_H
@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2015-2016 Antmicro
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <cutils/properties.h>
+#include <utils/misc.h>
+
+#include "PartitionTuner.h"
+#include "Workers.h"
+#include "DbgUtils.h"
+
+/* Used when the kernel does not describe CPU caches */
+#define DEFAULT_L2_SIZE (512 * 1024)
+#define MIN_STRIPE_LINES 2
+#define MAX_STRIPE_LINES 64
+/* Runs of every variant; the fastest one counts */
+#define TUNING_SAMPLES 3
+
+/* Variants tried while tuning: stripe height relative to the guess, tasks per core */
+static const unsigned sStripeScales[] = { 1, 2, 4 };    /* 1/2, 1 and 2 times the guess */
+static const unsigned sTasksPerCore[] = { 1, 2, 4, 8 };
+#define CANDIDATES_NUM (NELEM(sStripeScales) * NELEM(sTasksPerCore))
+
+namespace android {
+
+PartitionTuner::PartitionTuner()
+    : mLoaded(false)
+    , mTuning(property_get_bool("ro.camera.v4l2device.partition_tuning", true))
+    , mCoresNum(Workers::configuredThreadsNum())
+    , mL2Size(l2CacheSize())
+    , mPending(-1) {
+    if(mCoresNum < 1)
+        mCoresNum = 1;
+}
+
+/**
+ * Returns partition to use for conversion of WIDTHxHEIGHT source, where
+ * every source line causes lineBytes of memory traffic (source and outputs).
+ * While it is being tuned, time of the conversion is expected in report();
+ * conversions disturbed by other work should not be reported, the same
+ * variant is returned again then.
+ */
+PartitionTuner::Partition PartitionTuner::partition(unsigned width, unsigned height, size_t lineBytes) {
+    if(!mLoaded) {
+        load();
+        mLoaded = true;
+    }
+    mPending = -1;
+
+    ssize_t id = -1;
+    for(size_t i = 0; i < mEntries.size(); ++i) {
+        if(mEntries[i].width == width && mEntries[i].height == height && mEntries[i].lineBytes == lineBytes) {
+            id = (ssize_t)i;
+            break;
+        }
+    }
+    if(id >= 0 && mEntries[id].tuned)
+        return mEntries[id].best;
+    if(!mTuning)
+        return guess(height, lineBytes);
+
+    if(id < 0) {
+        Entry e;
+        e.width     = width;
+        e.height    = height;
+        e.lineBytes = lineBytes;
+        e.tuned     = false;
+        e.bestTime  = 0;
+        e.candidate = 0;
+        e.samples   = 0;
+        e.time      = 0;
+        id = mEntries.add(e);
+    }
+
+    Entry &e = mEntries.editItemAt(id);
+    e.current = candidate(height, lineBytes, e.candidate);
+    mPending = id;
+    return e.current;
+}
+
+/**
+ * Takes time of the last conversion. Once all variants are timed, the fastest
+ * one is saved and used from now on.
+ */
+void PartitionTuner::report(nsecs_t time) {
+    if(mPending < 0)
+        return;
+
+    Entry &e = mEntries.editItemAt((size_t)mPending);
+    mPending = -1;
+
+    if(e.samples == 0 || time < e.time)
+        e.time = time;
+    if(++e.samples < TUNING_SAMPLES)
+        return;
+
+    if(e.candidate == 0 || e.time < e.bestTime) {
+        e.best      = e.current;
+        e.bestTime  = e.time;
+    }
+    e.samples = 0;
+    if(++e.candidate < CANDIDATES_NUM)
+        return;
+
+    e.tuned = true;
+    ALOGI("Conversion of %ux%u (%zu B per line) tuned: %u line stripes, %u tasks (%.3f ms)",
+          e.width, e.height, e.lineBytes, e.best.stripeLines, e.best.tasksNum, e.bestTime / 1000000.0);
+    save();
+}
+
+/**
+ * Initial partition: stripes being processed by all cores fill half of L2,
+ * with a few tasks per core to even out the load.
+ */
+PartitionTuner::Partition PartitionTuner::guess(unsigned height, size_t lineBytes) const {
+    Partition p;
+    size_t lines = lineBytes > 0 ? mL2Size / 2 / mCoresNum / lineBytes : MAX_STRIPE_LINES;
+    if(lines < MIN_STRIPE_LINES)
+        lines = MIN_STRIPE_LINES;
+    if(lines > MAX_STRIPE_LINES)
+        lines = MAX_STRIPE_LINES;
+    p.stripeLines = (unsigned)lines & ~1u;
+
+    p.tasksNum = mCoresNum * 4;
+    clampTasks(&p, height);
+    return p;
+}
+
+/**
+ * Returns id-th variant tried while tuning.
+ */
+PartitionTuner::Partition PartitionTuner::candidate(unsigned height, size_t lineBytes, unsigned id) const {
+    Partition p = guess(height, lineBytes);
+
+    unsigned lines = p.stripeLines * sStripeScales[id / NELEM(sTasksPerCore)] / 2;
+    if(lines < MIN_STRIPE_LINES)
+        lines = MIN_STRIPE_LINES;
+    if(lines > MAX_STRIPE_LINES)
+        lines = MAX_STRIPE_LINES;
+    p.stripeLines = lines & ~1u;
+
+    p.tasksNum = mCoresNum * sTasksPerCore[id % NELEM(sTasksPerCore)];
+    clampTasks(&p, height);
+    return p;
+}
+
+/**
+ * Limits tasks count to the number of stripes, so that every task gets one.
+ */
+void PartitionTuner::clampTasks(Partition *p, unsigned height) {
+    const unsigned stripesNum = (height + p->stripeLines - 1) / p->stripeLines;
+    if(p->tasksNum > stripesNum)
+        p->tasksNum = stripesNum;
+    if(p->tasksNum > IMAGECONVERTER_MAX_TASKS)
+        p->tasksNum = IMAGECONVERTER_MAX_TASKS;
+    if(p->tasksNum < 1)
+        p->tasksNum = 1;
+}
+
+/**
+ * Reads partitions saved by previous runs (or prepared offline). One line per
+ * resolution and bytes per source line: "WIDTHxHEIGHT:LINE_BYTES STRIPE_LINES
+ * TASKS". Other lines (e.g. written by older versions) are skipped.
+ */
+void PartitionTuner::load() {
+    char path[PROPERTY_VALUE_MAX];
+    property_get("ro.camera.v4l2device.partitions_file", path, PARTITIONTUNER_FILE);
+
+    FILE *f = fopen(path, "r");
+    if(!f)
+        return;
+
+    Entry e;
+    e.tuned     = true;
+    e.bestTime  = 0;
+    e.candidate = CANDIDATES_NUM;
+    e.samples   = 0;
+    e.time      = 0;
+    char line[128];
+    while(fgets(line, sizeof(line), f)) {
+        if(sscanf(line, "%ux%u:%zu %u %u", &e.width, &e.height, &e.lineBytes, &e.best.stripeLines, &e.best.tasksNum) != 5)
+            continue;
+        if(e.best.stripeLines < 1 || e.best.tasksNum < 1 || e.best.tasksNum > IMAGECONVERTER_MAX_TASKS) {
+            ALOGW("%s: invalid partition for %ux%u, ignoring", path, e.width, e.height);
+            continue;
+        }
+        e.current = e.best;
+        mEntries.add(e);
+    }
+    fclose(f);
+    ALOGD("%zu partitions loaded from %s", mEntries.size(), path);
+}
+
+/**
+ * Writes all tuned partitions.
+ */
+void PartitionTuner::save() const {
+    char path[PROPERTY_VALUE_MAX];
+    property_get("ro.camera.v4l2device.partitions_file", path, PARTITIONTUNER_FILE);
+
+    FILE *f = fopen(path, "w");
+    if(!f) {
+        ALOGW("Could not save partitions to %s", path);
+        return;
+    }
+    for(size_t i = 0; i < mEntries.size(); ++i) {
+        const Entry &e = mEntries[i];
+        if(e.tuned)
+            fprintf(f, "%ux%u:%zu %u %u\n", e.width, e.height, e.lineBytes, e.best.stripeLines, e.best.tasksNum);
+    }
+    fclose(f);
+}
+
+/**
+ * Returns size of L2 (or the last level below L3) data cache of the first CPU.
+ */
+size_t PartitionTuner::l2CacheSize() {
+    size_t size = 0;
+    for(unsigned i = 0; i < 8; ++i) {
+        char path[64];
+        unsigned level;
+        char type[16];
+        FILE *f;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/level", i);
+        if(!(f = fopen(path, "r")))
+            break;
+        const bool levelOk = fscanf(f, "%u", &level) == 1;
+        fclose(f);
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/type", i);
+        if(!(f = fopen(path, "r")))
+            continue;
+        const bool typeOk = fscanf(f, "%15s", type) == 1;
+        fclose(f);
+
+        if(!levelOk || !typeOk || level > 2 || !strcmp(type, "Instruction"))
+            continue;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/size", i);
+        if(!(f = fopen(path, "r")))
+            continue;
+        unsigned value;
+        char unit = 0;
+        if(fscanf(f, "%u%c", &value, &unit) >= 1) {
+            size_t bytes = value;
+            if(unit == 'K')
+                bytes *= 1024;
+            else if(unit == 'M')
+                bytes *= 1024 * 1024;
+            if(bytes > size)
+                size = bytes;
+        }
+        fclose(f);
+    }
+
+    if(size == 0)
+        size = DEFAULT_L2_SIZE;
+    ALOGD("L2 cache size: %zu KiB", size / 1024);
+    return size;
+}
+
+}; /* namespace android */
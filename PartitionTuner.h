@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2015-2016 Antmicro
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PARTITIONTUNER_H
+#define PARTITIONTUNER_H
+
+#include <stddef.h>
+#include <utils/Timers.h>
+#include <utils/Vector.h>
+
+/* Upper limit of tasks a conversion is split into */
+#ifndef IMAGECONVERTER_MAX_TASKS
+# define IMAGECONVERTER_MAX_TASKS 64
+#endif
+
+#ifndef PARTITIONTUNER_FILE
+# define PARTITIONTUNER_FILE "/data/misc/camera/v4l2device_partitions"
+#endif
+
+namespace android {
+
+/**
+ * Chooses how image conversion is split between worker threads: height of
+ * the stripes processed at once and number of tasks.
+ *
+ * Initial guess is derived from L2 cache size, bytes touched per source line
+ * and online cores count. Unless disabled, a few variants around it are timed
+ * on the first frames of every resolution and set of outputs (told apart by
+ * bytes per source line) and the fastest one is stored in PARTITIONTUNER_FILE,
+ * so tuning happens only once per device.
+ */
+class PartitionTuner
+{
+public:
+    struct Partition {
+        unsigned    stripeLines;
+        unsigned    tasksNum;
+    };
+
+    PartitionTuner();
+
+    Partition partition(unsigned width, unsigned height, size_t lineBytes);
+    void report(nsecs_t time);
+
+private:
+    struct Entry {
+        unsigned    width;
+        unsigned    height;
+        size_t      lineBytes;
+        bool        tuned;
+        Partition   best;
+        nsecs_t     bestTime;
+        /* Variant being timed and its fastest run so far */
+        unsigned    candidate;
+        Partition   current;
+        unsigned    samples;
+        nsecs_t     time;
+    };
+
+    Partition guess(unsigned height, size_t lineBytes) const;
+    Partition candidate(unsigned height, size_t lineBytes, unsigned id) const;
+    static void clampTasks(Partition *p, unsigned height);
+    void load();
+    void save() const;
+
+    static size_t l2CacheSize();
+
+    bool            mLoaded;
+    bool            mTuning;
+    unsigned        mCoresNum;
+    size_t          mL2Size;
+    Vector<Entry>   mEntries;
+    /* Entry waiting for report() */
+    ssize_t         mPending;
+};
+
+}; /* namespace android */
+
+#endif // PARTITIONTUNER_H
@@ -22,6 +22,7 @@
 #include <sys/ioctl.h>
 #include <linux/videodev2.h>
 #include <sys/mman.h>
+#include <ui/GraphicBuffer.h>
 
 #include <utils/Log.h>
 #include <cstring>
@@ -32,8 +33,22 @@
 #include <utils/Vector.h>
 #include <cassert>
 
+#if defined(__has_include)
+# if __has_include(<linux/dma-buf.h>)
+#  include <linux/dma-buf.h>
+# endif
+#endif
+
 #include "V4l2Device.h"
 
+/* Short, so that the capture thread notices exit request quickly */
+#define V4L2DEVICE_POLL_TIMEOUT_MS 200
+/* How long readLock() waits for a frame */
+#define V4L2DEVICE_READ_TIMEOUT_NS 5000000000LL
+
+/* Sequence number of a slot which does not hold any frame */
+#define RING_SLOT_EMPTY UINT64_MAX
+
 namespace android {
 
 /******************************************************************************\
@@ -58,6 +73,13 @@ static inline void closeFd(int *fd) {
     *fd = -1;
 }
 
+/* Returns 0 for invalid (zero denominator) intervals */
+static inline nsecs_t fractToNs(const struct v4l2_fract &fract) {
+    if(fract.denominator == 0)
+        return 0;
+    return (nsecs_t)fract.numerator * 1000000000LL / fract.denominator;
+}
+
 /******************************************************************************\
                                    V4l2Device
 \******************************************************************************/
@@ -78,15 +100,33 @@ V4l2Device::V4l2Device(const char *devNode)
     , mConnected(false)
     , mStreaming(false)
     , mDevNode(devNode)
+    , mBuf(NULL)
+    , mBufCount(0)
+    , mBufCountRequested(0)
+    , mMaxLocked(1)
+    , mMemBudget(V4L2DEVICE_MEM_BUDGET * 1024 * 1024)
+    , mMemory(V4L2_MEMORY_MMAP)
+    , mMemoryInUse(V4L2_MEMORY_MMAP)
+    , mRing(NULL)
+    , mRingSize(1)
+    , mRingHead(0)
+    , mDefaultCursor(0)
+    , mWaiters(0)
+    , mCapturing(false)
+    , mMinFps(0)
+    , mMaxFps(0)
+    , mFrameDuration(0)
+    , mDropDuration(0)
+    , mNextFrameTime(0)
+    , mLastSequence(-1)
+    , mDroppedFrames(0)
+    , mStaleFrames(0)
+    , mLatestFrame(false)
 {
     memset(&mFormat, 0, sizeof(mFormat));
     mPFd.fd = -1;
     mPFd.events = POLLIN | POLLRDNORM;
 
-#if V4L2DEVICE_FPS_LIMIT > 0
-    mLastTimestamp = 0;
-#endif
-
     /* Ignore multiple possible devices for now */
     char resStr[PROPERTY_VALUE_MAX];
     int ret;
@@ -108,12 +148,32 @@ V4l2Device::V4l2Device(const char *devNode)
         }
     }
 
+    char memStr[PROPERTY_VALUE_MAX];
+    property_get("ro.camera.v4l2device.memory", memStr, "mmap");
+    if(!strcmp(memStr, "userptr")) {
+        mMemory = V4L2_MEMORY_USERPTR;
+    } else if(!strcmp(memStr, "dmabuf")) {
+        mMemory = V4L2_MEMORY_DMABUF;
+    } else if(strcmp(memStr, "mmap")) {
+        ALOGW("Unknown memory type \"%s\", using mmap", memStr);
+    }
+
+    char budgetStr[PROPERTY_VALUE_MAX];
+    if(property_get("ro.camera.v4l2device.mem_budget", budgetStr, "") > 0) {
+        const unsigned long budget = strtoul(budgetStr, NULL, 10);
+        if(budget > 0)
+            mMemBudget = budget * 1024 * 1024;
+    }
+
+    mLatestFrame = property_get_bool("ro.camera.v4l2device.latest_frame", false);
+
 #ifdef V4L2DEVICE_OPEN_ONCE
     connect();
 #endif
 }
 
 V4l2Device::~V4l2Device() {
+    stopCapture();
     if(isStreaming()) {
         iocStreamOff();
     }
@@ -121,63 +181,100 @@ V4l2Device::~V4l2Device() {
 }
 
 /**
- * Returns array of camera's supported resolutions.
+ * Returns array of camera's supported pixel formats together with their
+ * resolutions, in the order reported by the driver.
  *
  * Resolution can be forced by setting property ro.camera.v4l2device.resolution to value WIDTHxHEIGHT (e.g. 1920x1080)
  */
-const Vector<V4l2Device::Resolution> & V4l2Device::availableResolutions() {
-    if(!mAvailableResolutions.isEmpty()) {
-        return mAvailableResolutions;
+const Vector<V4l2Device::Format> & V4l2Device::availableFormats() {
+    if(!mAvailableFormats.isEmpty()) {
+        return mAvailableFormats;
     }
 
-    if(mForcedResolution.width > 0 && mForcedResolution.height > 0) {
-        ALOGI("Using forced resolution: %ux%u", mForcedResolution.width, mForcedResolution.height);
-        mAvailableResolutions.add(mForcedResolution);
+    int fd;
+    bool fdNeedsClose = false;
+
+    if(mFd >= 0) {
+        fd = mFd;
     } else {
-        int fd;
-        bool fdNeedsClose = false;
-        Vector<V4l2Device::Resolution> formats;
+        fd = openFd(mDevNode);
+        fdNeedsClose = true;
+    }
+    if(fd < 0) {
+        ALOGE("Could not open %s: %s (%d)", mDevNode, strerror(errno), errno);
+        return mAvailableFormats;
+    }
 
-        if(mFd >= 0) {
-            fd = mFd;
-        } else {
-            fd = openFd(mDevNode);
-            fdNeedsClose = true;
-        }
-        if(fd < 0) {
-            ALOGE("Could not open %s: %s (%d)", mDevNode, strerror(errno), errno);
-            return mAvailableResolutions;
-        }
+    struct v4l2_fmtdesc fmtDesc;
+    memset(&fmtDesc, 0, sizeof(fmtDesc));
+    fmtDesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmtDesc.index = 0;
+
+    errno = 0;
+    while(ioctl(fd, VIDIOC_ENUM_FMT, &fmtDesc) == 0) {
+        ++fmtDesc.index;
+        ALOGD("%s: Found format: %.4s (%s)", mDevNode, (const char *)&fmtDesc.pixelformat, fmtDesc.description);
 
-        struct v4l2_frmsizeenum frmSize;
-        frmSize.pixel_format = V4L2DEVICE_PIXEL_FORMAT;
-        frmSize.index = 0;
+        V4l2Device::Format format;
+        format.pixFmt = fmtDesc.pixelformat;
+        format.compressed = fmtDesc.flags & V4L2_FMT_FLAG_COMPRESSED;
 
-        errno = 0;
-        while(ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmSize) == 0) {
-            ALOGD("%s: Found resolution: %dx%d", mDevNode, frmSize.discrete.width, frmSize.discrete.height);
-            ++frmSize.index;
-            // FIXME: make it configurable or fix the out of memory problem
-            if(frmSize.discrete.width > 1920 || frmSize.discrete.height > 1080) {
-                ALOGD("    too big, ignoring");
-                continue;
+        if(mForcedResolution.width > 0 && mForcedResolution.height > 0) {
+            format.resolutions.add(mForcedResolution);
+        } else {
+            struct v4l2_frmsizeenum frmSize;
+            memset(&frmSize, 0, sizeof(frmSize));
+            frmSize.pixel_format = fmtDesc.pixelformat;
+            frmSize.index = 0;
+
+            while(ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmSize) == 0) {
+                if(frmSize.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+                    /* Use only the largest size of stepwise/continuous range */
+                    ALOGD("%s:     resolution: up to %dx%d", mDevNode, frmSize.stepwise.max_width, frmSize.stepwise.max_height);
+                    format.resolutions.add();
+                    format.resolutions.editTop().width = frmSize.stepwise.max_width;
+                    format.resolutions.editTop().height = frmSize.stepwise.max_height;
+                    break;
+                }
+                ALOGD("%s:     resolution: %dx%d", mDevNode, frmSize.discrete.width, frmSize.discrete.height);
+                ++frmSize.index;
+                format.resolutions.add();
+                format.resolutions.editTop().width = frmSize.discrete.width;
+                format.resolutions.editTop().height = frmSize.discrete.height;
             }
-            formats.add();
-            formats.editTop().width = frmSize.discrete.width;
-            formats.editTop().height = frmSize.discrete.height;
-        }
-        if(errno && errno != EINVAL) {
-            ALOGW("Get available formats: %s (%d)", strerror(errno), errno);
         }
 
-        if(fdNeedsClose) {
-            closeFd(&fd);
-        }
+        if(!format.resolutions.isEmpty())
+            mAvailableFormats.add(format);
+        errno = 0;
+    }
+    if(errno && errno != EINVAL) {
+        ALOGW("Get available formats: %s (%d)", strerror(errno), errno);
+    }
+    if(mForcedResolution.width > 0 && mForcedResolution.height > 0) {
+        ALOGI("Using forced resolution: %ux%u", mForcedResolution.width, mForcedResolution.height);
+    }
 
-        mAvailableResolutions = formats;
+    if(fdNeedsClose) {
+        closeFd(&fd);
     }
 
-    return mAvailableResolutions;
+    return mAvailableFormats;
+}
+
+/**
+ * Returns array of resolutions supported in specified pixel format. Empty
+ * if the format is not supported.
+ */
+const Vector<V4l2Device::Resolution> & V4l2Device::availableResolutions(uint32_t pixFmt) {
+    static const Vector<V4l2Device::Resolution> noResolutions;
+
+    const Vector<V4l2Device::Format> &formats = availableFormats();
+    for(size_t i = 0; i < formats.size(); ++i) {
+        if(formats[i].pixFmt == pixFmt)
+            return formats[i].resolutions;
+    }
+    return noResolutions;
 }
 
 /**
@@ -185,47 +282,230 @@ const Vector<V4l2Device::Resolution> & V4l2Device::availableResolutions() {
  * possible height. This might not to be valid camera resolution.
  */
 V4l2Device::Resolution V4l2Device::sensorResolution() {
-    const Vector<V4l2Device::Resolution> &formats = availableResolutions();
+    const Vector<V4l2Device::Format> &formats = availableFormats();
     V4l2Device::Resolution max = {0, 0};
     for(size_t i = 0; i < formats.size(); ++i) {
-        if(formats[i].width > max.width)
-            max.width = formats[i].width;
-        if(formats[i].height > max.height)
-            max.height = formats[i].height;
+        const Vector<V4l2Device::Resolution> &resolutions = formats[i].resolutions;
+        for(size_t j = 0; j < resolutions.size(); ++j) {
+            if(resolutions[j].width > max.width)
+                max.width = resolutions[j].width;
+            if(resolutions[j].height > max.height)
+                max.height = resolutions[j].height;
+        }
     }
     return max;
 }
 
 /**
- * Sets new resolution. The resolution must be supported by camera. If it does
- * not, false is returned. Call only with disabled streaming.
+ * Sets new pixel format and resolution. Both must be supported by camera. If
+ * they are not, false is returned. No frame can be locked while calling it.
+ *
+ * Buffers are reallocated in place (without reopening the device) also when
+ * only the required buffer count changed. Streaming is stopped for that even
+ * with V4L2DEVICE_OPEN_ONCE; start it again with setStreaming().
  */
-bool V4l2Device::setResolution(unsigned width, unsigned height) {
-    if(mFormat.fmt.pix.width == width && mFormat.fmt.pix.height == height)
+bool V4l2Device::setFormat(uint32_t pixFmt, unsigned width, unsigned height) {
+    if(mFormat.fmt.pix.pixelformat == pixFmt && mFormat.fmt.pix.width == width && mFormat.fmt.pix.height == height &&
+       (!isConnected() || mBufCountRequested == bufferCountFor(mFormat.fmt.pix.sizeimage)))
         return true;
 
-    ALOGD("New resolution: %dx%d", width, height);
     if(isConnected()) {
-        #ifndef V4L2DEVICE_OPEN_ONCE
-        disconnect();
-        mFormat.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        mFormat.fmt.pix.pixelformat = V4L2DEVICE_PIXEL_FORMAT;
-        mFormat.fmt.pix.width = width;
-        mFormat.fmt.pix.height = height;
-        connect();
-        #else
-        ALOGD("Resolution change not supported");
-        #endif
+        const bool sameFormat = mFormat.fmt.pix.pixelformat == pixFmt && mFormat.fmt.pix.width == width && mFormat.fmt.pix.height == height;
+        if(sameFormat)
+            ALOGD("New buffer count: %u", bufferCountFor(mFormat.fmt.pix.sizeimage));
+        else
+            ALOGD("New format: %.4s %dx%d", (const char *)&pixFmt, width, height);
+
+        if(!stopStreaming() || !(sameFormat ? reallocateBuffers() : setFormatAndAllocateBuffers(pixFmt, width, height))) {
+            ALOGE("Could not reconfigure device");
+            cleanup();
+            return false;
+        }
         return true;
     } else {
+        ALOGD("New format: %.4s %dx%d", (const char *)&pixFmt, width, height);
         mFormat.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        mFormat.fmt.pix.pixelformat = V4L2DEVICE_PIXEL_FORMAT;
+        mFormat.fmt.pix.pixelformat = pixFmt;
         mFormat.fmt.pix.width = width;
         mFormat.fmt.pix.height = height;
         return true;
     }
 }
 
+/**
+ * Returns frame durations supported in specified format and resolution,
+ * shortest first. For stepwise/continuous intervals only the limits are
+ * returned. Empty if the driver does not enumerate frame intervals.
+ */
+Vector<nsecs_t> V4l2Device::frameDurations(uint32_t pixFmt, unsigned width, unsigned height) {
+    Vector<nsecs_t> durations;
+    int fd;
+    bool fdNeedsClose = false;
+
+    if(mFd >= 0) {
+        fd = mFd;
+    } else {
+        fd = openFd(mDevNode);
+        fdNeedsClose = true;
+    }
+    if(fd < 0) {
+        ALOGE("Could not open %s: %s (%d)", mDevNode, strerror(errno), errno);
+        return durations;
+    }
+
+    struct v4l2_frmivalenum frmIval;
+    memset(&frmIval, 0, sizeof(frmIval));
+    frmIval.pixel_format = pixFmt;
+    frmIval.width = width;
+    frmIval.height = height;
+    frmIval.index = 0;
+
+    while(ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmIval) == 0) {
+        struct v4l2_fract fract[2];
+        unsigned fractNum = 0;
+        if(frmIval.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+            fract[fractNum++] = frmIval.discrete;
+        } else {
+            fract[fractNum++] = frmIval.stepwise.min;
+            fract[fractNum++] = frmIval.stepwise.max;
+        }
+
+        for(unsigned i = 0; i < fractNum; ++i) {
+            const nsecs_t duration = fractToNs(fract[i]);
+            if(duration == 0)
+                continue;
+            size_t pos = 0;
+            while(pos < durations.size() && durations[pos] < duration)
+                ++pos;
+            if(pos == durations.size() || durations[pos] != duration)
+                durations.insertAt(duration, pos);
+        }
+
+        if(frmIval.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+            break;
+        ++frmIval.index;
+    }
+
+    if(fdNeedsClose) {
+        closeFd(&fd);
+    }
+
+    return durations;
+}
+
+/**
+ * Sets frame rate range. The sensor is set to the highest supported frame
+ * rate not exceeding maxFps. If the driver does not allow to set it, frames
+ * are dropped in the capture thread instead. Pass 0 to leave the driver's
+ * default rate.
+ *
+ * Most drivers reject S_PARM while streaming, so streaming is restarted,
+ * also with V4L2DEVICE_OPEN_ONCE. No frame can be locked while calling it.
+ */
+bool V4l2Device::setFrameRate(unsigned minFps, unsigned maxFps) {
+    mMinFps = minFps;
+    mMaxFps = maxFps;
+
+    if(!isConnected())
+        return true;
+
+    const bool streaming = mStreaming;
+    if(!stopStreaming())
+        return false;
+
+    bool ok = applyFrameRate();
+
+    if(streaming && !setStreaming(true))
+        return false;
+
+    return ok;
+}
+
+/**
+ * Applies requested frame rate to the device. Call only with capture stopped.
+ */
+bool V4l2Device::applyFrameRate() {
+    assert(mCaptureThread == NULL);
+
+    mDropDuration = 0;
+    mNextFrameTime = 0;
+    mFrameDuration = 0;
+    if(mMaxFps == 0)
+        return true;
+
+    const nsecs_t minDuration = 1000000000LL / mMaxFps;
+    /* Allow some rounding errors, e.g. 1/30 s is 333333 * 100 ns in UVC */
+    const nsecs_t tolerance = minDuration / 100;
+
+    nsecs_t sensorDuration = sensorFrameDuration(minDuration, tolerance);
+
+    bool ok = true;
+    if(sensorDuration && !iocSParm(sensorDuration)) {
+        ALOGW("Could not set frame duration to %lld ns: %s (%d)", (long long)sensorDuration, strerror(errno), errno);
+        sensorDuration = 0;
+        ok = false;
+    }
+
+    if(sensorDuration < minDuration - tolerance) {
+        ALOGD("Frame rate limited to %u fps by dropping frames", mMaxFps);
+        mDropDuration = minDuration;
+    }
+    mFrameDuration = sensorDuration > minDuration ? sensorDuration : minDuration;
+
+    return ok;
+}
+
+/**
+ * Returns the shortest frame duration supported in the current format which
+ * is not shorter than minDuration - tolerance. If every supported duration is
+ * shorter, returns the longest one, so that the least frames have to be
+ * dropped. Stepwise/continuous ranges give minDuration clamped into the range
+ * and rounded to its step. Returns 0 if the driver does not enumerate frame
+ * intervals.
+ */
+nsecs_t V4l2Device::sensorFrameDuration(nsecs_t minDuration, nsecs_t tolerance) {
+    assert(mFd >= 0);
+
+    struct v4l2_frmivalenum frmIval;
+    memset(&frmIval, 0, sizeof(frmIval));
+    frmIval.pixel_format = mFormat.fmt.pix.pixelformat;
+    frmIval.width = mFormat.fmt.pix.width;
+    frmIval.height = mFormat.fmt.pix.height;
+    frmIval.index = 0;
+
+    nsecs_t shortest = 0;
+    nsecs_t longest = 0;
+    while(ioctl(mFd, VIDIOC_ENUM_FRAMEINTERVALS, &frmIval) == 0) {
+        if(frmIval.type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+            const nsecs_t rangeMin = fractToNs(frmIval.stepwise.min);
+            const nsecs_t rangeMax = fractToNs(frmIval.stepwise.max);
+            const nsecs_t step = frmIval.type == V4L2_FRMIVAL_TYPE_STEPWISE ? fractToNs(frmIval.stepwise.step) : 0;
+            if(rangeMax == 0)
+                return 0;
+
+            nsecs_t duration = rangeMin;
+            if(minDuration - tolerance > rangeMin) {
+                duration = minDuration;
+                if(step > 0) {
+                    duration = rangeMin + (minDuration - rangeMin + step / 2) / step * step;
+                    if(duration < minDuration - tolerance)
+                        duration += step;
+                }
+            }
+            return duration < rangeMax ? duration : rangeMax;
+        }
+
+        const nsecs_t duration = fractToNs(frmIval.discrete);
+        if(duration >= minDuration - tolerance && (shortest == 0 || duration < shortest))
+            shortest = duration;
+        if(duration > longest)
+            longest = duration;
+        ++frmIval.index;
+    }
+
+    return shortest ? shortest : longest;
+}
+
 /**
  * Returns current resolution
  */
@@ -249,25 +529,33 @@ bool V4l2Device::connect() {
         return false;
     }
 
+    uint32_t pixFmt;
     unsigned width;
     unsigned height;
     if(mFormat.type) {
+        pixFmt = mFormat.fmt.pix.pixelformat;
         width = mFormat.fmt.pix.width;
         height = mFormat.fmt.pix.height;
     } else {
-        auto resolutions = availableResolutions();
-        if(resolutions.isEmpty()) {
-            ALOGE("No available resolutions found, aborting");
+        auto &formats = availableFormats();
+        if(formats.isEmpty()) {
+            ALOGE("No available formats found, aborting");
             closeFd(&mFd);
             return false;
         }
-        auto defaultRes = resolutions[0];
-        width = resolutions[0].width;
-        height = resolutions[0].height;
-        ALOGD("Using default resolution: %dx%d", defaultRes.width, defaultRes.height);
+        /* Prefer uncompressed format, it can be converted to anything */
+        size_t fmtId = 0;
+        while(fmtId < formats.size() && formats[fmtId].compressed)
+            ++fmtId;
+        if(fmtId == formats.size())
+            fmtId = 0;
+        pixFmt = formats[fmtId].pixFmt;
+        width = formats[fmtId].resolutions[0].width;
+        height = formats[fmtId].resolutions[0].height;
+        ALOGD("Using default format: %.4s %dx%d", (const char *)&pixFmt, width, height);
     }
-    if(!setResolutionAndAllocateBuffers(width, height)) {
-        ALOGE("Could not set resolution");
+    if(!setFormatAndAllocateBuffers(pixFmt, width, height)) {
+        ALOGE("Could not set format");
         closeFd(&mFd);
         return false;
     }
@@ -294,9 +582,15 @@ bool V4l2Device::disconnect() {
     return true;
 }
 
+/**
+ * Starts/stops streaming together with the capture thread.
+ */
 bool V4l2Device::setStreaming(bool enable) {
+    if(!enable)
+        stopCapture();
+
     if(enable == mStreaming)
-        return true;
+        return enable ? startCapture() : true;
 
     if(!isConnected())
         return !enable;
@@ -310,51 +604,284 @@ bool V4l2Device::setStreaming(bool enable) {
 #ifdef V4L2DEVICE_OPEN_ONCE
         return true;
 #else
-        if(!iocStreamOff()) {
-            ALOGE("Could not stop streaming: %s (%d)", strerror(errno), errno);
-            return false;
-        }
+        return stopStreaming();
 #endif
     }
 
     mStreaming = enable;
 
+    return enable ? startCapture() : true;
+}
+
+/**
+ * Stops capture thread and streaming, also with V4L2DEVICE_OPEN_ONCE. Used
+ * before changes which drivers accept only with streaming stopped.
+ */
+bool V4l2Device::stopStreaming() {
+    stopCapture();
+    if(!mStreaming)
+        return true;
+
+    if(!iocStreamOff()) {
+        ALOGE("Could not stop streaming: %s (%d)", strerror(errno), errno);
+        return false;
+    }
+    mStreaming = false;
+
+    /* STREAMOFF takes all buffers from the kernel, give back unused ones */
+    for(unsigned i = 0; i < mBufCount; ++i) {
+        if(mBuf[i].mRefs.load() == 0 && !queueBuffer(i)) {
+            ALOGE("Could not queue buffer %d: %s (%d)", i, strerror(errno), errno);
+        }
+    }
     return true;
 }
 
 /**
  * Lock buffer and return pointer to it. After processing buffer must be
  * unlocked with V4l2Device::unlock().
+ *
+ * Returns the oldest frame newer than the one pointed by \p cursor which is
+ * still available in the ring, waiting for it if needed. Every consumer should
+ * use its own cursor (initialized with 0); the same frame can be locked by
+ * many consumers at once.
+ *
+ * Does not make any system call when the frame is already captured.
  */
-const V4l2Device::VBuffer * V4l2Device::readLock() {
+const V4l2Device::VBuffer * V4l2Device::readLock(uint64_t *cursor) {
     assert(isConnected());
     assert(isStreaming());
-    int id = 0;
-    if((id = dequeueBuffer()) < 0) {
-        ALOGE("Could not dequeue buffer: %s (%d)", strerror(errno), errno);
-        return NULL;
+    assert(cursor);
+
+    uint64_t want = *cursor + 1;
+    for(;;) {
+        if(!mCapturing.load()) {
+            ALOGE("Could not read frame: capture is stopped");
+            return NULL;
+        }
+
+        const uint64_t head = mRingHead.load();
+        if(head >= want + mRingSize) {
+            /* Frames were overwritten before this consumer got to them */
+            want = head - mRingSize + 1;
+        }
+
+        if(want > head) {
+            if(!waitForFrame(want)) {
+                errno = ETIME;
+                ALOGE("Could not read frame: %s (%d)", strerror(errno), errno);
+                return NULL;
+            }
+            continue;
+        }
+
+        RingSlot &slot = mRing[want % mRingSize];
+        const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if(seq == 0) {
+            /* Slot is being rewritten right now */
+            continue;
+        }
+
+        VBuffer *buf = slot.buf.load(std::memory_order_acquire);
+        if(seq == want && buf && buf->tryRef()) {
+            /* The buffer might have been recycled before we got the reference */
+            if(buf->mSeq.load(std::memory_order_relaxed) == want) {
+                buf->mTaken.store(true);
+                *cursor = want;
+                return buf;
+            }
+            release(buf);
+        }
+
+        /* Frame is gone, try the next one */
+        ++want;
     }
-    auto buf = &mBuf[id];
-    return buf;
 }
 
 /**
- * Unlocks previously locked buffer.
+ * Unlocks previously locked buffer. The buffer goes back to the kernel as soon
+ * as nobody uses it.
  */
 bool V4l2Device::unlock(const VBuffer *buf) {
     if(!buf)
         return false;
 
-    for(unsigned i = 0; i < NELEM(mBuf); ++i) {
-        if(mBuf[i].buf == buf->buf) {
-            if(!queueBuffer(i)) {
-                ALOGE("Could not queue buffer %d: %s (%d)", i, strerror(errno), errno);
-                return false;
+    assert(buf >= mBuf && buf < mBuf + mBufCount);
+    VBuffer *b = const_cast<VBuffer *>(buf);
+
+    /* The frame was read and there is a newer one - the ring can let it go */
+    if(b->mSeq.load() < mRingHead.load())
+        dropRingRef(b);
+
+    return release(b);
+}
+
+/**
+ * Starts capture thread. Ring must not be used by any consumer.
+ */
+bool V4l2Device::startCapture() {
+    if(mCaptureThread != NULL)
+        return true;
+
+    if(!mRing)
+        return false;
+
+    /* Sequence numbers restart with streaming */
+    mLastSequence = -1;
+
+    /* Leave one buffer for the kernel when nobody reads frames. In latest
+     * frame mode every new frame replaces the previous one right away. */
+    mRingSize = (mBufCount > 1 && !mLatestFrame) ? mBufCount - 1 : 1;
+    for(unsigned i = 0; i < mBufCount; ++i) {
+        mRing[i].buf.store(NULL);
+        mRing[i].seq.store(RING_SLOT_EMPTY);
+    }
+
+    mCapturing.store(true);
+    mCaptureThread = new CaptureThread(this);
+    if(mCaptureThread->run("Cam-V4l2Capture", PRIORITY_URGENT_DISPLAY) != NO_ERROR) {
+        ALOGE("Could not start capture thread");
+        mCaptureThread.clear();
+        mCapturing.store(false);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Stops capture thread and returns buffers held by the ring to the kernel.
+ * Buffers locked by consumers are returned when unlocked.
+ */
+void V4l2Device::stopCapture() {
+    if(mCaptureThread == NULL)
+        return;
+
+    mCapturing.store(false);
+    mCaptureThread->requestExitAndWait();
+    mCaptureThread.clear();
+
+    for(unsigned i = 0; i < mBufCount; ++i) {
+        const uint64_t seq = mRing[i].seq.exchange(RING_SLOT_EMPTY);
+        VBuffer *buf = mRing[i].buf.exchange(NULL);
+        if(buf && buf->mSeq.load() == seq)
+            dropRingRef(buf);
+    }
+
+    /* Wake up consumers waiting for a frame */
+    Mutex::Autolock lock(mWaitMutex);
+    mWaitCond.broadcast();
+}
+
+bool V4l2Device::captureLoop() {
+    if(!mCapturing.load())
+        return false;
+
+    int id = mLatestFrame ? dequeueLatestBuffer() : dequeueBuffer();
+    if(id < 0) {
+        if(errno != ETIME) {
+            ALOGE("Could not dequeue buffer: %s (%d)", strerror(errno), errno);
+            /* Do not spin on persistent errors */
+            usleep(10000);
+        }
+        return true;
+    }
+
+    if(mDropDuration > 0) {
+        const nsecs_t now = mBuf[id].timestamp;
+        /* Accept frames arriving slightly early due to jitter */
+        if(now < mNextFrameTime - mDropDuration / 8) {
+            if(!queueBuffer(id)) {
+                ALOGE("Could not queue buffer %d: %s (%d)", id, strerror(errno), errno);
             }
             return true;
         }
+        /* Keep the average rate, unless we are far behind */
+        if(now - mNextFrameTime > mDropDuration)
+            mNextFrameTime = now + mDropDuration;
+        else
+            mNextFrameTime += mDropDuration;
     }
-    return false;
+
+    publish(&mBuf[id]);
+    return true;
+}
+
+/**
+ * Puts freshly dequeued buffer in the ring. Called only from capture thread.
+ */
+void V4l2Device::publish(VBuffer *buf) {
+    const uint64_t seq = mRingHead.load(std::memory_order_relaxed) + 1;
+    RingSlot &slot = mRing[seq % mRingSize];
+
+    /* Invalidate the slot before its old frame can go back to the kernel.
+     * Slots may point to buffers which were already recycled - these are
+     * recognized by sequence number. */
+    const uint64_t oldSeq = slot.seq.exchange(0);
+    VBuffer *old = slot.buf.load(std::memory_order_relaxed);
+    if(old && old->mSeq.load(std::memory_order_relaxed) == oldSeq) {
+        if(!old->mTaken.load())
+            ++mStaleFrames;
+        dropRingRef(old);
+    }
+
+    /* Previous frame is no longer the newest one - drop it if it was read */
+    VBuffer *prev = mRing[(seq - 1) % mRingSize].buf.load(std::memory_order_relaxed);
+    if(prev && prev->mSeq.load(std::memory_order_relaxed) == seq - 1 && prev->mTaken.load())
+        dropRingRef(prev);
+
+    buf->mSeq.store(seq, std::memory_order_relaxed);
+    buf->mTaken.store(false, std::memory_order_relaxed);
+    buf->mInRing.store(true, std::memory_order_relaxed);
+    buf->mRefs.store(1, std::memory_order_release);
+
+    slot.buf.store(buf, std::memory_order_release);
+    slot.seq.store(seq, std::memory_order_release);
+    mRingHead.store(seq);
+
+    if(mWaiters.load() > 0) {
+        Mutex::Autolock lock(mWaitMutex);
+        mWaitCond.broadcast();
+    }
+}
+
+/**
+ * Waits until frame with specified sequence number is published.
+ */
+bool V4l2Device::waitForFrame(uint64_t seq) {
+    Mutex::Autolock lock(mWaitMutex);
+    ++mWaiters;
+    status_t e = NO_ERROR;
+    while(mRingHead.load() < seq && mCapturing.load() && e == NO_ERROR) {
+        e = mWaitCond.waitRelative(mWaitMutex, V4L2DEVICE_READ_TIMEOUT_NS);
+    }
+    --mWaiters;
+    return mRingHead.load() >= seq || !mCapturing.load();
+}
+
+/**
+ * Drops reference held by the ring. Safe to call multiple times.
+ */
+void V4l2Device::dropRingRef(VBuffer *buf) {
+    if(buf->mInRing.exchange(false))
+        release(buf);
+}
+
+/**
+ * Drops one reference, returns buffer to the kernel if it was the last one.
+ */
+bool V4l2Device::release(VBuffer *buf) {
+    if(buf->mRefs.fetch_sub(1) != 1)
+        return true;
+
+    if(mFd < 0)
+        return true;
+
+    if(!queueBuffer(buf->mId)) {
+        ALOGE("Could not queue buffer %d: %s (%d)", buf->mId, strerror(errno), errno);
+        return false;
+    }
+    return true;
 }
 
 /**
@@ -366,8 +893,15 @@ bool V4l2Device::queueBuffer(unsigned id) {
     struct v4l2_buffer bufInfo;
     memset(&bufInfo, 0, sizeof(bufInfo));
     bufInfo.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    bufInfo.memory = V4L2_MEMORY_MMAP;
+    bufInfo.memory = mMemoryInUse;
     bufInfo.index = id;
+    if(mMemoryInUse == V4L2_MEMORY_USERPTR) {
+        bufInfo.m.userptr = (unsigned long)mBuf[id].buf;
+        bufInfo.length = mBuf[id].len;
+    } else if(mMemoryInUse == V4L2_MEMORY_DMABUF) {
+        bufInfo.m.fd = mBuf[id].dmabufFd;
+        bufInfo.length = mBuf[id].len;
+    }
 
     if(ioctl(mFd, VIDIOC_QBUF, &bufInfo) < 0)
         return false;
@@ -385,20 +919,12 @@ int V4l2Device::dequeueBuffer() {
 
     memset(&bufInfo, 0, sizeof(bufInfo));
     bufInfo.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    bufInfo.memory = V4L2_MEMORY_MMAP;
+    bufInfo.memory = mMemoryInUse;
     bufInfo.index = 0;
 
-#if V4L2DEVICE_FPS_LIMIT > 0
-    auto timestamp = systemTime();
-    nsecs_t extraTime = 1000000000LL / V4L2DEVICE_FPS_LIMIT - (timestamp - mLastTimestamp);
-    if(extraTime / 1000 > 0)
-        usleep((unsigned)(extraTime / 1000));
-    mLastTimestamp = systemTime();
-#endif
-
     do {
 #ifdef V4L2DEVICE_USE_POLL
-        if((errno = 0, poll(&mPFd, 1, 5000)) <= 0) {
+        if((errno = 0, poll(&mPFd, 1, V4L2DEVICE_POLL_TIMEOUT_MS)) <= 0) {
             errno = ETIME;
             return -1;
         }
@@ -407,9 +933,76 @@ int V4l2Device::dequeueBuffer() {
     if(errno)
         return -1;
 
+    VBuffer &buf = mBuf[bufInfo.index];
+    buf.bytesUsed = bufInfo.bytesused;
+    buf.timestamp = frameTimestamp(bufInfo);
+    buf.sequence = bufInfo.sequence;
+
+    if(mLastSequence >= 0 && bufInfo.sequence > (uint32_t)mLastSequence + 1) {
+        const uint32_t lost = bufInfo.sequence - (uint32_t)mLastSequence - 1;
+        mDroppedFrames += lost;
+        ALOGV("Driver dropped %u frame(s) before #%u", lost, bufInfo.sequence);
+    }
+    mLastSequence = bufInfo.sequence;
+
     return (int)bufInfo.index;
 }
 
+/**
+ * Dequeues all ready buffers, returns ID of the newest one and gives the older
+ * ones back to the kernel right away.
+ */
+int V4l2Device::dequeueLatestBuffer() {
+    int id = dequeueBuffer();
+    if(id < 0)
+        return id;
+
+    for(;;) {
+        struct pollfd pfd = mPFd;
+        if(poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN))
+            break;
+
+        const int newerId = dequeueBuffer();
+        if(newerId < 0)
+            break;
+
+        ++mStaleFrames;
+        if(!queueBuffer(id)) {
+            ALOGE("Could not queue buffer %d: %s (%d)", id, strerror(errno), errno);
+        }
+        id = newerId;
+    }
+
+    return id;
+}
+
+/**
+ * Converts driver's timestamp to systemTime() (CLOCK_MONOTONIC) domain.
+ * Falls back to the dequeue time if the timestamp is not usable.
+ */
+nsecs_t V4l2Device::frameTimestamp(const struct v4l2_buffer &bufInfo) {
+    const nsecs_t now = systemTime();
+    nsecs_t timestamp = (nsecs_t)bufInfo.timestamp.tv_sec * 1000000000LL + (nsecs_t)bufInfo.timestamp.tv_usec * 1000LL;
+
+    switch(bufInfo.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) {
+        case V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC:
+            break;
+        case V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN:
+            /* Old drivers use gettimeofday() */
+            timestamp += now - systemTime(SYSTEM_TIME_REALTIME);
+            break;
+        default:
+            /* Copied from elsewhere, not related to capture */
+            return now;
+    }
+
+    /* Sanity check - frame can not be from the future or from long ago */
+    if(timestamp > now || now - timestamp > 1000000000LL)
+        return now;
+
+    return timestamp;
+}
+
 bool V4l2Device::iocStreamOff() {
     assert(mFd >= 0);
     assert(mFormat.type);
@@ -438,7 +1031,7 @@ bool V4l2Device::iocStreamOn() {
     return !errno;
 }
 
-bool V4l2Device::iocSFmt(unsigned width, unsigned height) {
+bool V4l2Device::iocSFmt(uint32_t pixFmt, unsigned width, unsigned height) {
     assert(mFd >= 0);
     assert(!mStreaming);
 
@@ -446,21 +1039,52 @@ bool V4l2Device::iocSFmt(unsigned width, unsigned height) {
     memset(&format, 0, sizeof(format));
 
     format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    format.fmt.pix.pixelformat = V4L2DEVICE_PIXEL_FORMAT;
+    format.fmt.pix.pixelformat = pixFmt;
     format.fmt.pix.width = width;
     format.fmt.pix.height = height;
 
     errno = 0;
     if(ioctl(mFd, VIDIOC_S_FMT, &format) == 0) {
-        mFormat = format;
+        /* Driver silently replaces unsupported values with supported ones */
+        if(format.fmt.pix.pixelformat != pixFmt) {
+            errno = EINVAL;
+        } else {
+            mFormat = format;
+        }
     } else {
-        ALOGV("%s(w=%u, h=%u): %s (%d)", __FUNCTION__, width, height, strerror(errno), errno);
+        ALOGV("%s(fmt=%.4s, w=%u, h=%u): %s (%d)", __FUNCTION__, (const char *)&pixFmt, width, height, strerror(errno), errno);
     }
 
     return !errno;
 }
 
-bool V4l2Device::iocReqBufs(unsigned *count) {
+bool V4l2Device::iocSParm(nsecs_t frameDuration) {
+    assert(mFd >= 0);
+
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    errno = 0;
+    if(ioctl(mFd, VIDIOC_G_PARM, &parm) == 0 && !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+        errno = ENOTSUP;
+        return false;
+    }
+
+    /* 100 ns units are native for UVC and exact enough for everything else */
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe.numerator = (uint32_t)((frameDuration + 50) / 100);
+    parm.parm.capture.timeperframe.denominator = 10000000;
+
+    errno = 0;
+    if(ioctl(mFd, VIDIOC_S_PARM, &parm) != 0) {
+        ALOGV("%s(duration=%lld): %s (%d)", __FUNCTION__, (long long)frameDuration, strerror(errno), errno);
+    }
+
+    return !errno;
+}
+
+bool V4l2Device::iocReqBufs(unsigned *count, unsigned memory) {
     assert(mFd >= 0);
     assert(count);
 
@@ -468,14 +1092,14 @@ bool V4l2Device::iocReqBufs(unsigned *count) {
     memset(&bufRequest, 0, sizeof(bufRequest));
 
     bufRequest.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    bufRequest.memory = V4L2_MEMORY_MMAP;
+    bufRequest.memory = memory;
     bufRequest.count = *count;
 
     errno = 0;
     if(ioctl(mFd, VIDIOC_REQBUFS, &bufRequest) == 0) {
         *count = bufRequest.count;
     } else {
-        ALOGV("%s(count=%u): %s (%d)", __FUNCTION__, *count, strerror(errno), errno);
+        ALOGV("%s(count=%u, memory=%u): %s (%d)", __FUNCTION__, *count, memory, strerror(errno), errno);
     }
 
     return !errno;
@@ -504,53 +1128,203 @@ bool V4l2Device::iocQueryBuf(unsigned id, unsigned *offset, unsigned *len) {
     return !errno;
 }
 
-bool V4l2Device::setResolutionAndAllocateBuffers(unsigned width, unsigned height) {
+bool V4l2Device::iocExpBuf(unsigned id, int *fd) {
+    assert(mFd >= 0);
+    assert(fd);
+
+    *fd = -1;
+#ifdef VIDIOC_EXPBUF
+    struct v4l2_exportbuffer expBuf;
+    memset(&expBuf, 0, sizeof(expBuf));
+
+    expBuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    expBuf.index = id;
+    expBuf.flags = O_RDONLY | O_CLOEXEC;
+
+    errno = 0;
+    if(ioctl(mFd, VIDIOC_EXPBUF, &expBuf) == 0) {
+        *fd = expBuf.fd;
+    } else {
+        ALOGV("%s(id=%u): %s (%d)", __FUNCTION__, id, strerror(errno), errno);
+    }
+#else
+    errno = ENOTTY;
+#endif
+
+    return !errno;
+}
+
+bool V4l2Device::setFormatAndAllocateBuffers(uint32_t pixFmt, unsigned width, unsigned height) {
     assert(!mStreaming);
 
-    for(int i = 0; i < V4L2DEVICE_BUF_COUNT; ++i) {
-        mBuf[i].unmap();
+    freeBuffers();
+
+    if(!iocSFmt(pixFmt, width, height)) {
+        ALOGE("Could not set pixel format to %.4s %dx%d: %s (%d)", (const char *)&pixFmt, width, height, strerror(errno), errno);
+        return false;
     }
 
-    if(!iocSFmt(width, height)) {
-        ALOGE("Could not set pixel format to %dx%d: %s (%d)", width, height, strerror(errno), errno);
+    /* Frame rate might be reset with format change */
+    applyFrameRate();
+
+    return reallocateBuffers();
+}
+
+/**
+ * Replaces buffers with bufferCountFor() new ones, keeping the format. Call
+ * only with streaming stopped.
+ */
+bool V4l2Device::reallocateBuffers() {
+    assert(!mStreaming);
+
+    freeBuffers();
+
+    if(allocateBuffers(mMemory))
+        return true;
+
+    if(mMemory == V4L2_MEMORY_MMAP)
         return false;
+
+    ALOGW("Could not use memory type %u, falling back to mmap", mMemory);
+    return allocateBuffers(V4L2_MEMORY_MMAP);
+}
+
+/**
+ * Returns number of buffers for frames of frameSize bytes: one for each frame
+ * locked by consumers, one filled by the kernel, one with the latest frame and
+ * a margin for scheduling jitter. When buffers do not fit into the memory
+ * budget (e.g. 4K and larger frames), the queue gets as shallow as three
+ * buffers and consumers must lock fewer frames.
+ */
+unsigned V4l2Device::bufferCountFor(size_t frameSize) const {
+    /* One locked frame, one in the kernel, the latest one */
+    static const unsigned minCount = 3;
+    unsigned count = mMaxLocked + 2 + V4L2DEVICE_BUF_MARGIN;
+
+    if(frameSize > 0 && count * frameSize > mMemBudget) {
+        count = (unsigned)(mMemBudget / frameSize);
+        if(count < minCount)
+            count = minCount;
+    }
+    if(count > V4L2DEVICE_MAX_BUF_COUNT)
+        count = V4L2DEVICE_MAX_BUF_COUNT;
+
+    return count;
+}
+
+/**
+ * Allocates buffers and queues them.
+ *
+ * V4L2_MEMORY_MMAP:    buffers allocated by the driver, mapped and exported
+ *                      as DMABUF if possible
+ * V4L2_MEMORY_USERPTR: buffers allocated by the HAL (hugepages if available)
+ * V4L2_MEMORY_DMABUF:  buffers allocated by gralloc and imported by the driver
+ */
+bool V4l2Device::allocateBuffers(unsigned memory) {
+    const size_t frameSize = mFormat.fmt.pix.sizeimage;
+    const unsigned wantedCount = bufferCountFor(frameSize);
+    if(wantedCount * frameSize > mMemBudget) {
+        ALOGW("Buffers exceed memory budget: %u x %zu B > %zu B", wantedCount, frameSize, mMemBudget);
     }
 
-    unsigned bufCount = V4L2DEVICE_BUF_COUNT;
-    if(!iocReqBufs(&bufCount)) {
+    unsigned bufCount = wantedCount;
+    mBufCountRequested = wantedCount;
+    if(!iocReqBufs(&bufCount, memory)) {
         ALOGE("Could not request buffer: %s (%d)", strerror(errno), errno);
         return false;
     }
+    if(bufCount == 0) {
+        ALOGE("Driver did not allocate any buffers");
+        return false;
+    }
+    if(bufCount < wantedCount) {
+        ALOGW("Got only %u buffers (requested %u)", bufCount, wantedCount);
+    }
+    /* Driver might allocate more buffers than requested; the rest stays unused */
+    if(bufCount > V4L2DEVICE_MAX_BUF_COUNT)
+        bufCount = V4L2DEVICE_MAX_BUF_COUNT;
+    ALOGD("Using %u buffers", bufCount);
 
-    unsigned bufLen[V4L2DEVICE_BUF_COUNT] = {0};
+    mBuf = new VBuffer[bufCount];
+    mRing = new RingSlot[bufCount];
+    mBufCount = 0;
+    mMemoryInUse = memory;
 
     for(unsigned i = 0; i < bufCount; ++i) {
         unsigned offset;
-        if(!iocQueryBuf(i, &offset, &bufLen[i])) {
+        unsigned bufLen;
+        if(!iocQueryBuf(i, &offset, &bufLen)) {
             ALOGE("Could not query buffer %d: %s (%d)", i, strerror(errno), errno);
+            mBufCount = i;
+            freeBuffers();
             return false;
         }
-
-        if(!mBuf[i].map(mFd, offset, bufLen[i])) {
-            ALOGE("Could not allocate buffer %d (len = %d): %s (%d)", i, bufLen[i], strerror(errno), errno);
-            while(i--) mBuf[i].unmap();
+        if(memory != V4L2_MEMORY_MMAP)
+            bufLen = mFormat.fmt.pix.sizeimage;
+
+        bool allocated = false;
+        switch(memory) {
+            case V4L2_MEMORY_MMAP:      allocated = mBuf[i].map(mFd, offset, bufLen);  break;
+            case V4L2_MEMORY_USERPTR:   allocated = mBuf[i].allocate(bufLen);          break;
+            case V4L2_MEMORY_DMABUF:    allocated = mBuf[i].allocateGralloc(bufLen);   break;
+        }
+        if(!allocated) {
+            ALOGE("Could not allocate buffer %d (len = %d): %s (%d)", i, bufLen, strerror(errno), errno);
+            mBufCount = i;
+            freeBuffers();
             return false;
         }
 
+        if(memory == V4L2_MEMORY_MMAP) {
+            /* Not fatal - consumers fall back to the CPU mapping */
+            int dmabufFd;
+            if(!iocExpBuf(i, &dmabufFd) && i == 0) {
+                ALOGI("DMABUF export not supported: %s (%d)", strerror(errno), errno);
+            }
+            mBuf[i].setDmabuf(dmabufFd);
+        }
+
+        mBuf[i].pixFmt = mFormat.fmt.pix.pixelformat;
+        mBuf[i].mId = i;
+        mBuf[i].mRefs.store(0);
+        mBuf[i].mInRing.store(false);
+
         if(!queueBuffer(i)) {
             ALOGE("Could not queue buffer: %s (%d)", strerror(errno), errno);
-            do mBuf[i].unmap(); while(i--);
+            mBufCount = i + 1;
+            freeBuffers();
             return false;
         }
     }
+    mBufCount = bufCount;
 
     return true;
 }
 
-void V4l2Device::cleanup() {
-    for(int i = 0; i < V4L2DEVICE_BUF_COUNT; ++i) {
+/**
+ * Frees all buffers and releases them in the driver.
+ */
+void V4l2Device::freeBuffers() {
+    if(!mBuf)
+        return;
+
+    for(unsigned i = 0; i < mBufCount; ++i) {
         mBuf[i].unmap();
     }
+    delete[] mBuf;
+    delete[] mRing;
+    mBuf = NULL;
+    mRing = NULL;
+    mBufCount = 0;
+
+    if(mFd >= 0) {
+        unsigned count = 0;
+        iocReqBufs(&count, mMemoryInUse);
+    }
+}
+
+void V4l2Device::cleanup() {
+    freeBuffers();
 
     closeFd(&mFd);
     mPFd.fd = -1;
@@ -565,6 +1339,11 @@ void V4l2Device::cleanup() {
  * \class V4l2Device::VBuffer
  *
  * Video buffer abstraction.
+ *
+ * Buffer is accessible through the CPU mapping (buf) and, when the driver
+ * supports VIDIOC_EXPBUF, through DMABUF file descriptor (dmabufFd) which can
+ * be imported by other devices without copying the frame. CPU reads should be
+ * bracketed with beginCpuAccess()/endCpuAccess().
  */
 
 V4l2Device::VBuffer::~VBuffer() {
@@ -578,23 +1357,154 @@ bool V4l2Device::VBuffer::map(int fd, unsigned offset, unsigned len) {
     assert(!this->buf);
 
     errno = 0;
-    this->buf = (uint8_t*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
-    if(this->buf == MAP_FAILED) {
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if(mem == MAP_FAILED) {
         return false;
     }
-    memset(this->buf, 0, len);
+    memset(mem, 0, len);
+    this->buf = (uint8_t *)mem;
     this->len = len;
-    this->pixFmt = V4L2DEVICE_PIXEL_FORMAT;
+    mMemory = V4L2_MEMORY_MMAP;
 
     return true;
 }
 
+/**
+ * Allocates page aligned memory for V4L2_MEMORY_USERPTR. Hugepages are used
+ * when available to reduce TLB pressure of the per-frame memory walks.
+ */
+bool V4l2Device::VBuffer::allocate(unsigned len) {
+    assert(!this->buf);
+
+    void *mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    static const size_t hugePageSize = 2 * 1024 * 1024;
+    const size_t hugeLen = (len + hugePageSize - 1) & ~(hugePageSize - 1);
+    mem = mmap(NULL, hugeLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(mem != MAP_FAILED)
+        len = hugeLen;
+#endif
+    if(mem == MAP_FAILED) {
+        errno = 0;
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mem == MAP_FAILED)
+            return false;
+#ifdef MADV_HUGEPAGE
+        madvise(mem, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    this->buf = (uint8_t *)mem;
+    this->len = len;
+    mMemory = V4L2_MEMORY_USERPTR;
+
+    return true;
+}
+
+/**
+ * Allocates gralloc buffer for V4L2_MEMORY_DMABUF. The buffer stays locked for
+ * CPU reads for its whole lifetime.
+ *
+ * Assumes gralloc keeps DMABUF as the first file descriptor of the handle,
+ * which is the case for ION based implementations.
+ */
+bool V4l2Device::VBuffer::allocateGralloc(unsigned len) {
+    assert(!this->buf);
+
+    mGraphicBuffer = new GraphicBuffer(len, 1, HAL_PIXEL_FORMAT_BLOB,
+                                       GRALLOC_USAGE_HW_CAMERA_WRITE | GRALLOC_USAGE_SW_READ_OFTEN);
+    if(mGraphicBuffer->initCheck() != NO_ERROR || mGraphicBuffer->handle->numFds < 1) {
+        mGraphicBuffer.clear();
+        errno = ENOMEM;
+        return false;
+    }
+
+    const int fd = dup(mGraphicBuffer->handle->data[0]);
+    void *mem = NULL;
+    if(fd < 0 || mGraphicBuffer->lock(GRALLOC_USAGE_SW_READ_OFTEN, &mem) != NO_ERROR) {
+        if(fd >= 0)
+            close(fd);
+        mGraphicBuffer.clear();
+        errno = ENOMEM;
+        return false;
+    }
+
+    setDmabuf(fd);
+    this->buf = (uint8_t *)mem;
+    this->len = len;
+    mMemory = V4L2_MEMORY_DMABUF;
+
+    return true;
+}
+
+/**
+ * Takes new reference, unless the buffer is already back in the kernel.
+ */
+bool V4l2Device::VBuffer::tryRef() {
+    int refs = mRefs.load();
+    while(refs > 0) {
+        if(mRefs.compare_exchange_weak(refs, refs + 1))
+            return true;
+    }
+    return false;
+}
+
 void V4l2Device::VBuffer::unmap() {
     if(buf) {
-        munmap(buf, len);
+        if(mMemory == V4L2_MEMORY_DMABUF) {
+            mGraphicBuffer->unlock();
+            mGraphicBuffer.clear();
+        } else {
+            munmap(buf, len);
+        }
         buf         = NULL;
         len         = 0;
     }
+    setDmabuf(-1);
+}
+
+void V4l2Device::VBuffer::setDmabuf(int fd) {
+    if(dmabufFd >= 0)
+        close(dmabufFd);
+    dmabufFd = fd;
+}
+
+/**
+ * Must be called before reading the buffer through the CPU mapping when other
+ * devices may access it through DMABUF. Makes CPU caches coherent with the
+ * memory written by the capture hardware.
+ */
+bool V4l2Device::VBuffer::beginCpuAccess() const {
+#ifdef DMA_BUF_IOCTL_SYNC
+    if(dmabufFd < 0)
+        return true;
+
+    struct dma_buf_sync sync;
+    sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+    if(ioctl(dmabufFd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+        ALOGV("%s: %s (%d)", __FUNCTION__, strerror(errno), errno);
+        return false;
+    }
+#endif
+    return true;
+}
+
+/**
+ * Ends CPU access started with beginCpuAccess().
+ */
+bool V4l2Device::VBuffer::endCpuAccess() const {
+#ifdef DMA_BUF_IOCTL_SYNC
+    if(dmabufFd < 0)
+        return true;
+
+    struct dma_buf_sync sync;
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+    if(ioctl(dmabufFd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+        ALOGV("%s: %s (%d)", __FUNCTION__, strerror(errno), errno);
+        return false;
+    }
+#endif
+    return true;
 }
 
 }; /* namespace android */
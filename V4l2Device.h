@@ -4,18 +4,27 @@
 #include <linux/videodev2.h>
 #include <sys/poll.h>
 #include <stdint.h>
+#include <atomic>
 #include <utils/Vector.h>
 #include <utils/Log.h>
 #include <utils/Mutex.h>
+#include <utils/Condition.h>
+#include <utils/Thread.h>
 #include <utils/Timers.h>
+#include <ui/GraphicBuffer.h>
 
-#ifndef V4L2DEVICE_BUF_COUNT
-# define V4L2DEVICE_BUF_COUNT 4
+#ifndef V4L2DEVICE_MAX_BUF_COUNT
+# define V4L2DEVICE_MAX_BUF_COUNT 8
 #endif
 
-#ifndef V4L2DEVICE_PIXEL_FORMAT
-# warning V4L2DEVICE_PIXEL_FORMAT not defined, using default value (V4L2_PIX_FMT_UYVY)
-# define V4L2DEVICE_PIXEL_FORMAT V4L2_PIX_FMT_UYVY
+/* Extra buffers absorbing scheduling jitter, if memory budget allows */
+#ifndef V4L2DEVICE_BUF_MARGIN
+# define V4L2DEVICE_BUF_MARGIN 2
+#endif
+
+/* Default memory budget for all buffers (in MiB) */
+#ifndef V4L2DEVICE_MEM_BUDGET
+# define V4L2DEVICE_MEM_BUDGET 64
 #endif
 
 namespace android {
@@ -28,18 +37,54 @@ public:
         unsigned height;
     };
 
+    struct Format {
+        uint32_t                        pixFmt;
+        bool                            compressed;
+        Vector<V4l2Device::Resolution>  resolutions;
+    };
+
     class VBuffer {
     public:
         uint8_t *buf;
         uint32_t len;
+        /* Size of the frame data, smaller than len for compressed formats */
+        uint32_t bytesUsed;
         uint32_t pixFmt;
+        /* Capture time reported by the driver, in systemTime() domain */
+        nsecs_t timestamp;
+        /* Driver's frame sequence number */
+        uint32_t sequence;
+        /* DMABUF exported from the buffer or -1. Owned by VBuffer, valid only
+         * while the buffer is locked - dup() it to keep the import alive. */
+        int dmabufFd;
+
+        bool beginCpuAccess() const;
+        bool endCpuAccess() const;
 
     private:
-        VBuffer(): buf(NULL), len(0) {}
+        VBuffer(): buf(NULL), len(0), bytesUsed(0), pixFmt(0), timestamp(0), sequence(0), dmabufFd(-1), mId(0), mMemory(V4L2_MEMORY_MMAP), mSeq(0), mRefs(0), mInRing(false), mTaken(false) {}
         ~VBuffer();
 
         bool map(int fd, unsigned offset, unsigned len);
+        bool allocate(unsigned len);
+        bool allocateGralloc(unsigned len);
         void unmap();
+        void setDmabuf(int fd);
+
+        bool tryRef();
+
+        unsigned                mId;
+        /* V4L2_MEMORY_* the buffer was allocated for */
+        unsigned                mMemory;
+        sp<GraphicBuffer>       mGraphicBuffer;
+        /* Ring sequence number of the frame currently held in the buffer */
+        std::atomic<uint64_t>   mSeq;
+        /* Buffer is returned to the kernel when the last reference is dropped */
+        std::atomic<int>        mRefs;
+        /* Ring holds one reference as long as this is set */
+        std::atomic<bool>       mInRing;
+        /* Frame was read by at least one consumer */
+        std::atomic<bool>       mTaken;
 
         friend class V4l2Device;
     };
@@ -47,12 +92,26 @@ public:
     V4l2Device(const char *devNode = "/dev/video0");
     ~V4l2Device();
 
-    const Vector<V4l2Device::Resolution> & availableResolutions();
+    const Vector<V4l2Device::Format> & availableFormats();
+    const Vector<V4l2Device::Resolution> & availableResolutions(uint32_t pixFmt);
     V4l2Device::Resolution sensorResolution();
 
-    bool setResolution(unsigned width, unsigned height);
+    bool setFormat(uint32_t pixFmt, unsigned width, unsigned height);
+    uint32_t pixelFormat() const { return mFormat.fmt.pix.pixelformat; }
     V4l2Device::Resolution resolution();
 
+    Vector<nsecs_t> frameDurations(uint32_t pixFmt, unsigned width, unsigned height);
+    bool setFrameRate(unsigned minFps, unsigned maxFps);
+    nsecs_t frameDuration() const { return mFrameDuration; }
+
+    /* Frames lost by the driver (gaps in sequence numbers) */
+    uint64_t droppedFrames() const { return mDroppedFrames.load(); }
+    /* Frames returned to the driver without being read by anyone */
+    uint64_t staleFrames() const { return mStaleFrames.load(); }
+
+    void setLatestFrameMode(bool enable) { mLatestFrame = enable; }
+    bool latestFrameMode() const { return mLatestFrame; }
+
     bool connect();
     bool disconnect();
     bool isConnected() const { return mFd >= 0; }
@@ -60,35 +119,117 @@ public:
     bool setStreaming(bool enable);
     bool isStreaming() const { return mStreaming; }
 
-    const VBuffer * readLock();
+    void setMemoryType(unsigned memory) { mMemory = memory; }
+    unsigned memoryType() const { return mMemoryInUse; }
+
+    void setMaxLockedBuffers(unsigned count) { mMaxLocked = count; }
+    unsigned bufferCount() const { return mBufCount; }
+
+    const VBuffer * readLock() { return readLock(&mDefaultCursor); }
+    const VBuffer * readLock(uint64_t *cursor);
     bool unlock(const VBuffer *buf);
 
 private:
+    class CaptureThread: public Thread {
+    public:
+        CaptureThread(V4l2Device *parent): Thread(false), mParent(parent) {}
+
+    private:
+        virtual bool threadLoop() { return mParent->captureLoop(); }
+
+        V4l2Device *mParent;
+    };
+    friend class CaptureThread;
+
+    struct RingSlot {
+        RingSlot(): seq(0), buf(NULL) {}
+
+        /* 0 while the slot is being rewritten */
+        std::atomic<uint64_t>   seq;
+        std::atomic<VBuffer *>  buf;
+    };
+
+    bool stopStreaming();
+    bool startCapture();
+    void stopCapture();
+    bool captureLoop();
+    void publish(VBuffer *buf);
+    bool waitForFrame(uint64_t seq);
+    void dropRingRef(VBuffer *buf);
+    bool release(VBuffer *buf);
+
     bool queueBuffer(unsigned id);
     int dequeueBuffer();
+    int dequeueLatestBuffer();
+    nsecs_t frameTimestamp(const struct v4l2_buffer &bufInfo);
 
     bool iocStreamOff();
     bool iocStreamOn();
-    bool iocSFmt(unsigned width, unsigned height);
-    bool iocReqBufs(unsigned *count);
+    bool iocSFmt(uint32_t pixFmt, unsigned width, unsigned height);
+    bool iocReqBufs(unsigned *count, unsigned memory);
     bool iocQueryBuf(unsigned id, unsigned *offset, unsigned *len);
+    bool iocExpBuf(unsigned id, int *fd);
+    bool iocSParm(nsecs_t frameDuration);
 
-    bool setResolutionAndAllocateBuffers(unsigned width, unsigned height);
+    bool applyFrameRate();
+    nsecs_t sensorFrameDuration(nsecs_t minDuration, nsecs_t tolerance);
+
+    bool setFormatAndAllocateBuffers(uint32_t pixFmt, unsigned width, unsigned height);
+    bool reallocateBuffers();
+    unsigned bufferCountFor(size_t frameSize) const;
+    bool allocateBuffers(unsigned memory);
+    void freeBuffers();
     void cleanup();
 
     int mFd;
     bool mConnected;
     bool mStreaming;
     const char *mDevNode;
-    Vector<V4l2Device::Resolution> mAvailableResolutions;
+    Vector<V4l2Device::Format> mAvailableFormats;
     V4l2Device::Resolution mForcedResolution;
     struct v4l2_format mFormat;
-    VBuffer mBuf[V4L2DEVICE_BUF_COUNT];
+    VBuffer *mBuf;
+    unsigned mBufCount;
+    /* Count requested from the driver, which might have allocated other one */
+    unsigned mBufCountRequested;
+    /* Frames kept locked by consumers at once */
+    unsigned mMaxLocked;
+    size_t mMemBudget;
+    /* Requested and actually used V4L2_MEMORY_* */
+    unsigned mMemory;
+    unsigned mMemoryInUse;
     struct pollfd mPFd;
 
-#if V4L2DEVICE_FPS_LIMIT > 0
-    nsecs_t mLastTimestamp;
-#endif
+    /* Frames ring: written by the capture thread only, read without locking */
+    RingSlot *mRing;
+    unsigned mRingSize;
+    std::atomic<uint64_t> mRingHead;
+    uint64_t mDefaultCursor;
+
+    /* Used only by consumers waiting for a new frame */
+    Mutex mWaitMutex;
+    Condition mWaitCond;
+    std::atomic<int> mWaiters;
+
+    std::atomic<bool> mCapturing;
+    sp<CaptureThread> mCaptureThread;
+
+    /* Requested frame rate range, 0 if not set */
+    unsigned mMinFps;
+    unsigned mMaxFps;
+    nsecs_t mFrameDuration;
+    /* Used by capture thread to drop frames when the sensor runs faster than
+     * requested and its frame rate can not be set */
+    nsecs_t mDropDuration;
+    nsecs_t mNextFrameTime;
+
+    /* Used by capture thread only; -1 until the first frame after STREAMON */
+    int64_t mLastSequence;
+    std::atomic<uint64_t> mDroppedFrames;
+    std::atomic<uint64_t> mStaleFrames;
+
+    /* Keep only the newest frame, see setLatestFrameMode() */
+    bool mLatestFrame;
 };
 
 }; /* namespace android */
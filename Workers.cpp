@@ -14,10 +14,43 @@
  * limitations under the License.
  */
 
+#define LOG_TAG "Cam-Workers"
+#define LOG_NDEBUG NDEBUG
+
 #include <unistd.h>
 #include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <cutils/properties.h>
 
 #include "Workers.h"
+#include "DbgUtils.h"
+
+/* Tasks taken from the injection queue at once; all but one go to the
+ * thread's deque, where others can steal them */
+#define WORKERS_INJECT_BATCH 4
+
+/* Upper limit of "ro.camera.v4l2device.workers" */
+#define MAX_THREADS 64
+/* Cores of at least this part of the highest capacity are fast ones */
+#define FAST_CAPACITY_PERCENT 75
+
+/* Submissions closer than this belong to the same burst (frame) */
+#define BURST_GAP           ms2ns(1)
+/* Intervals longer than this mean the stream was paused */
+#define MAX_BURST_INTERVAL  ms2ns(1000)
+/* Spin after every burst, for tasks queued as results of the last ones */
+#define SPIN_TAIL           us2ns(20)
+
+/* Set in a latch by a thread sleeping until it is counted down to 0 */
+#define LATCH_WAITING 0x40000000
+
+static_assert((WORKERS_DEQUE_SIZE & (WORKERS_DEQUE_SIZE - 1)) == 0, "WORKERS_DEQUE_SIZE must be a power of 2");
+static_assert((WORKERS_INJECTION_SIZE & (WORKERS_INJECTION_SIZE - 1)) == 0, "WORKERS_INJECTION_SIZE must be a power of 2");
 
 namespace android {
 
@@ -35,6 +68,13 @@ Workers gWorkers;
  * When started, waits for one or more generic tasks to be queued and executes
  * them in multiple threads.
  *
+ * Tasks queued by worker threads go to their own deques; others go to the
+ * shared injection queue. A thread runs tasks from its deque first, then
+ * from the injection queue, then steals from other threads. None of these
+ * takes a lock. Threads without work sleep on an event count.
+ *
+ * Every priority has its own deques and injection queue; see Priority.
+ *
  * Implementation note:
  * There is no support for OpenMP nor C++11 Threads. libutil's Thread class
  * is more suitable for implementing specific threads than thread pools.
@@ -43,64 +83,658 @@ Workers gWorkers;
 
 Workers::Workers()
     : mRunning(false)
-    , mExitRequest(false) {
+    , mExitRequest(false)
+    , mLastBurst(0)
+    , mBurstInterval(0)
+    , mMaxSpin(us2ns(WORKERS_MAX_SPIN_US))
+    , mOversleep(0)
+    , mBackgroundPending(0)
+    , mBackgroundQueued(1)
+    , mSpinTime(0)
+    , mSpins(0)
+    , mSpinHits(0)
+    , mParkTime(0)
+    , mParks(0) {
+    pthread_key_create(&mCurrentThread, NULL);
 }
 
 /**
- * Starts threads.
+ * Starts threads, configuredThreadsNum() of them. Unless disabled with
+ * "ro.camera.v4l2device.workers_affinity", thread N is pinned to the N-th
+ * fastest CPU (see probeCpus()), so that pixel processing stays on big cores
+ * of heterogeneous CPUs.
  */
 bool Workers::start() {
-    if(mRunning)
+    Mutex::Autolock lock(mMutex);
+    if(mRunning.load())
         return false;
 
-    const unsigned cpuThreadsCount = (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
-    mThreads.resize(cpuThreadsCount);
+    int cpus[CPU_SETSIZE];
+    size_t fastNum;
+    const size_t cpusNum = probeCpus(cpus, &fastNum);
+    const unsigned threadsCount = configuredThreadsNum();
+    const bool pin = property_get_bool("ro.camera.v4l2device.workers_affinity", true) && cpusNum > 1;
+    const int maxSpin = property_get_int32("ro.camera.v4l2device.workers_spin", WORKERS_MAX_SPIN_US);
+    /* With one CPU, a spinning thread only delays the one queueing work */
+    mMaxSpin = maxSpin > 0 && cpusNum > 1 ? us2ns(maxSpin) : 0;
+    mSpinTime.store(0);
+    mSpins.store(0);
+    mSpinHits.store(0);
+    mParkTime.store(0);
+    mParks.store(0);
 
-    int id = 0;
-    for(auto it = mThreads.begin(); it != mThreads.end(); ++it) {
-        *it = Thread(id++, this);
-        it->run();
-    }
+    for(unsigned id = 0; id < threadsCount; ++id)
+        mThreads.add(new Thread((int)id, pin ? cpus[id % cpusNum] : -1, this));
+    /* All threads have to be known before any of them starts stealing */
+    for(size_t i = 0; i < mThreads.size(); ++i)
+        mThreads[i]->run();
 
-    mRunning = true;
+    ALOGD("Started %u worker threads (%zu of %zu CPUs fast)%s", threadsCount, fastNum, cpusNum, pin ? ", pinned" : "");
+    mRunning.store(true);
 
     return true;
 }
 
+/**
+ * Returns count of threads start() creates: "ro.camera.v4l2device.workers"
+ * when set, otherwise one per fast CPU.
+ */
+unsigned Workers::configuredThreadsNum() {
+    int count = property_get_int32("ro.camera.v4l2device.workers", 0);
+    if(count > 0)
+        return count < MAX_THREADS ? (unsigned)count : MAX_THREADS;
+
+    int cpus[CPU_SETSIZE];
+    size_t fastNum;
+    probeCpus(cpus, &fastNum);
+    return fastNum < MAX_THREADS ? (unsigned)fastNum : MAX_THREADS;
+}
+
+/**
+ * Fills cpus with CPUs the process may run on, fastest first, and returns
+ * their count. CPUs with at least FAST_CAPACITY_PERCENT of the highest
+ * capacity (/sys/devices/system/cpu/cpuN/cpu_capacity) are counted in
+ * *fastNum. Without capacities (not a heterogeneous CPU, or an old kernel),
+ * all CPUs are fast.
+ */
+size_t Workers::probeCpus(int *cpus, size_t *fastNum) {
+    unsigned capacities[CPU_SETSIZE];
+    size_t count = 0;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if(CPU_ISSET(cpu, &set))
+                cpus[count++] = cpu;
+        }
+    }
+    if(count == 0) {
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        for(long cpu = 0; cpu < online && cpu < CPU_SETSIZE; ++cpu)
+            cpus[count++] = (int)cpu;
+    }
+    if(count == 0)
+        cpus[count++] = 0;
+
+    unsigned maxCapacity = 0;
+    for(size_t i = 0; i < count; ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpu_capacity", cpus[i]);
+        unsigned capacity = 0;
+        FILE *f = fopen(path, "r");
+        if(f) {
+            if(fscanf(f, "%u", &capacity) != 1)
+                capacity = 0;
+            fclose(f);
+        }
+        capacities[cpus[i]] = capacity;
+        if(capacity > maxCapacity)
+            maxCapacity = capacity;
+    }
+
+    /* Few CPUs, insertion sort will do; keeps ids ascending within a cluster */
+    for(size_t i = 1; i < count; ++i) {
+        const int cpu = cpus[i];
+        size_t j = i;
+        for(; j > 0 && capacities[cpus[j - 1]] < capacities[cpu]; --j)
+            cpus[j] = cpus[j - 1];
+        cpus[j] = cpu;
+    }
+
+    *fastNum = 0;
+    while(*fastNum < count && capacities[cpus[*fastNum]] * 100 >= maxCapacity * FAST_CAPACITY_PERCENT)
+        ++*fastNum;
+    return count;
+}
+
 /**
  * Stops all threads.
  *
  * No new task is picked, but the ones already in processing will finish.
+ * Tasks still waiting are kept for the next start.
  */
 void Workers::stop() {
-    if(!mRunning)
+    Mutex::Autolock lock(mMutex);
+    if(!mRunning.load())
         return;
 
-    {
-        Mutex::Autolock lock(mMutex);
+    mExitRequest.store(true);
+    mEvents.notify(true);
+    for(size_t i = 0; i < mThreads.size(); ++i)
+        mThreads[i]->join();
 
-        mExitRequest = true;
-        mCond.broadcast();
-    }
-    for(auto it = mThreads.begin(); it != mThreads.end(); ++it) {
-        it->join();
+    IdleStats stats;
+    idleStats(&stats);
+    ALOGD("Worker threads idle time: %lld us spinning (%llu of %llu spins found work), %lld us parked (%llu times)",
+          (long long)ns2us(stats.spinTime), (unsigned long long)stats.spinHits, (unsigned long long)stats.spins,
+          (long long)ns2us(stats.parkTime), (unsigned long long)stats.parks);
+
+    for(size_t i = 0; i < mThreads.size(); ++i) {
+        for(int priority = 0; priority < PRIORITIES_NUM; ++priority) {
+            Task *task;
+            while((task = mThreads[i]->mDeques[priority].steal()) != NULL) {
+                while(!mInjection[priority].push(task))
+                    sched_yield();
+            }
+        }
+        delete mThreads[i];
     }
 
     mThreads.clear();
-    mRunning = false;
-    mExitRequest = false;
+    mRunning.store(false);
+    mExitRequest.store(false);
 }
 
 /**
  * Queues task and returns without waiting for it to be processed.
  */
-void Workers::queueTask(Workers::Task *task) {
-    Mutex::Autolock lock(mMutex);
-    if(!mRunning)
+void Workers::queueTask(Workers::Task *task, Priority priority) {
+    if(!mRunning.load())
+        start();
+
+    push(task, priority);
+    mEvents.notify(false);
+    if(!currentThread() && priority == LATENCY_CRITICAL)
+        noteSubmission();
+}
+
+/**
+ * Returns worker thread of this object making the call, or NULL.
+ */
+Workers::Thread * Workers::currentThread() {
+    Thread *current = static_cast<Thread *>(pthread_getspecific(mCurrentThread));
+    return current && current->mParent == this ? current : NULL;
+}
+
+/**
+ * Puts task in the calling worker thread's deque or in the injection queue.
+ */
+void Workers::push(Task *task, Priority priority) {
+    task->mWorkers = this;
+    task->mPriority = priority;
+    if(priority == BACKGROUND) {
+        /* In this order, see backgroundEpoch() */
+        mBackgroundPending.fetch_add(1);
+        mBackgroundQueued.fetch_add(1);
+    }
+    Thread *current = currentThread();
+    if(!current || !current->mDeques[priority].push(task)) {
+        while(!mInjection[priority].push(task))
+            sched_yield();
+    }
+}
+
+/**
+ * Returns a value which changes whenever BACKGROUND work is queued, or 0
+ * while any of it is not finished. Equal non-zero values before and after
+ * a piece of work mean that no background work ran meanwhile, e.g. to tell
+ * whether time it took is representative.
+ */
+uint64_t Workers::backgroundEpoch() const {
+    const uint64_t queued = mBackgroundQueued.load();
+    return mBackgroundPending.load() == 0 ? queued : 0;
+}
+
+/**
+ * Runs fn on [0, range) split into subranges of grain items, in the calling
+ * thread and in up to one helper task per worker thread. Subranges are handed
+ * out by an atomic counter and counted down once done, so every thread keeps
+ * taking them until there are none left, and the call returns when the last
+ * one is done: helpers which have not started by then find nothing to do
+ * when they do. When all of mLoops are in use, the calling thread runs the
+ * whole range.
+ *
+ * Returns when fn has returned for all items.
+ */
+void Workers::parallelFor(size_t range, size_t grain, RangeFunction fn, void *data, Priority priority) {
+    if(range == 0)
+        return;
+    if(grain < 1)
+        grain = 1;
+    if(!mRunning.load())
         start();
 
-    mTasks.push_back(task);
-    mCond.signal();
+    /* The caller takes one of the subranges */
+    const size_t chunks = (range + grain - 1) / grain;
+    size_t helpersNum = chunks - 1;
+    if(helpersNum > mThreads.size())
+        helpersNum = mThreads.size();
+    if(helpersNum > WORKERS_MAX_HELPERS)
+        helpersNum = WORKERS_MAX_HELPERS;
+
+    Loop *loop = helpersNum > 0 ? acquireLoop((int)helpersNum + 1) : NULL;
+    if(!loop) {
+        for(size_t begin = 0; begin < range; begin += grain)
+            fn(data, begin, range - begin > grain ? begin + grain : range);
+        return;
+    }
+
+    loop->workers   = this;
+    loop->priority  = priority;
+    loop->fn        = fn;
+    loop->data      = data;
+    loop->range     = range;
+    loop->grain     = grain;
+    loop->next.store(0, std::memory_order_relaxed);
+    loop->pending.store((int)chunks, std::memory_order_relaxed);
+
+    Thread *current = currentThread();
+    for(size_t i = 0; i < helpersNum; ++i) {
+        Task &helper = loop->helpers[i];
+        helper = Task(runLoop, loop);
+        /* Executing the helper releases its reference */
+        helper.mLatch = &loop->refs;
+        push(&helper, priority);
+    }
+    mEvents.notify(helpersNum > 1);
+    if(!current && priority == LATENCY_CRITICAL)
+        noteSubmission();
+
+    runLoop(loop);
+
+    helpUntilDone(&loop->pending, priority);
+    waitLatch(&loop->pending);
+    loop->refs.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+/**
+ * Returns a loop of mLoops nobody uses, with refs set, or NULL when there is
+ * none.
+ */
+Workers::Loop * Workers::acquireLoop(int refs) {
+    for(size_t i = 0; i < WORKERS_MAX_LOOPS; ++i) {
+        int unused = 0;
+        if(mLoops[i].refs.compare_exchange_strong(unused, refs, std::memory_order_acquire, std::memory_order_relaxed))
+            return &mLoops[i];
+    }
+    return NULL;
+}
+
+/**
+ * Records LATENCY_CRITICAL work queued from outside of worker threads; other
+ * work does not follow frames. The first submission after a pause starts
+ * a burst; average interval between bursts (frame
+ * interval when streaming) tells idle threads when to expect more work.
+ */
+void Workers::noteSubmission() {
+    const nsecs_t now = systemTime();
+    nsecs_t last = mLastBurst.load(std::memory_order_relaxed);
+    if(now - last < BURST_GAP)
+        return;
+    if(!mLastBurst.compare_exchange_strong(last, now, std::memory_order_relaxed))
+        return;
+
+    const nsecs_t interval = now - last;
+    if(last == 0 || interval > MAX_BURST_INTERVAL)
+        return;
+    const nsecs_t average = mBurstInterval.load(std::memory_order_relaxed);
+    mBurstInterval.store(average > 0 ? average + (interval - average) / 8 : interval, std::memory_order_relaxed);
+}
+
+/**
+ * Returns how long a thread which ran out of work at now should spin before
+ * it sleeps: SPIN_TAIL, or across the expected start of the next burst, until
+ * mMaxSpin / 2 after it, if that is within mMaxSpin (plus mOversleep, as
+ * threads wake up that much early, see parkTimeout()). Waking up a sleeping
+ * thread takes tens of microseconds, on every core, at the start of every
+ * frame.
+ */
+nsecs_t Workers::spinBudget(nsecs_t now) const {
+    if(mMaxSpin <= 0)
+        return 0;
+
+    nsecs_t budget = SPIN_TAIL;
+    const nsecs_t maxSpin = mMaxSpin + mOversleep.load(std::memory_order_relaxed);
+    const nsecs_t interval = mBurstInterval.load(std::memory_order_relaxed);
+    if(interval > 0) {
+        const nsecs_t untilEnd = mLastBurst.load(std::memory_order_relaxed) + interval + mMaxSpin / 2 - now;
+        if(untilEnd > budget && untilEnd <= maxSpin)
+            budget = untilEnd;
+    }
+    return budget < maxSpin ? budget : maxSpin;
+}
+
+/**
+ * Returns how long a thread which runs out of work at now may sleep: until
+ * mMaxSpin / 2 before the next burst is expected, less mOversleep, so that it
+ * spins across the start (see spinBudget()) instead of waiting to be woken
+ * up. Returns -1 (sleep until notified) when there are no regular bursts, or
+ * when the next one is late.
+ */
+nsecs_t Workers::parkTimeout(nsecs_t now) const {
+    const nsecs_t interval = mBurstInterval.load(std::memory_order_relaxed);
+    if(mMaxSpin <= 0 || interval <= 0)
+        return -1;
+
+    const nsecs_t wakeup = mLastBurst.load(std::memory_order_relaxed) + interval - mMaxSpin / 2
+                           - mOversleep.load(std::memory_order_relaxed);
+    return wakeup > now ? wakeup - now : -1;
+}
+
+/**
+ * Returns idle time counters, summed over threads, since start().
+ */
+void Workers::idleStats(IdleStats *stats) const {
+    stats->spinTime = mSpinTime.load(std::memory_order_relaxed);
+    stats->spins    = mSpins.load(std::memory_order_relaxed);
+    stats->spinHits = mSpinHits.load(std::memory_order_relaxed);
+    stats->parkTime = mParkTime.load(std::memory_order_relaxed);
+    stats->parks    = mParks.load(std::memory_order_relaxed);
+}
+
+/**
+ * Takes subranges of the loop until there are none left. The loop stays in
+ * use after the last one is counted down, until the reference is released.
+ * A worker thread in a BACKGROUND loop runs critical tasks queued meanwhile
+ * between subranges, so they do not wait for the whole loop.
+ */
+void Workers::runLoop(void *l) {
+    Loop *loop = static_cast<Loop *>(l);
+    for(;;) {
+        const size_t begin = loop->next.fetch_add(loop->grain, std::memory_order_relaxed);
+        if(begin >= loop->range)
+            break;
+        const size_t end = loop->range - begin > loop->grain ? begin + loop->grain : loop->range;
+        loop->fn(loop->data, begin, end);
+        countDown(&loop->pending);
+        if(loop->priority == BACKGROUND)
+            loop->workers->runCritical();
+    }
+}
+
+/**
+ * Runs LATENCY_CRITICAL tasks there are, if called by a worker thread.
+ */
+void Workers::runCritical() {
+    Thread *current = currentThread();
+    if(!current)
+        return;
+    Task *task;
+    while((task = current->findTask(LATENCY_CRITICAL)) != NULL)
+        task->execute();
+}
+
+/**
+ * Called by a thread waiting for latch. If it is a worker thread, runs tasks
+ * from its own deques, most likely the ones it is waiting for, so that they
+ * do not wait for it. Tasks of lower priority than the awaited ones are left
+ * to other threads.
+ */
+void Workers::helpUntilDone(std::atomic<int> *latch, Priority priority) {
+    Thread *current = currentThread();
+    if(!current)
+        return;
+    while((latch->load(std::memory_order_acquire) & ~LATCH_WAITING) != 0) {
+        Task *task = NULL;
+        for(int p = 0; p <= priority && !task; ++p)
+            task = current->mDeques[p].pop();
+        if(!task)
+            break;
+        task->execute();
+    }
+}
+
+/**
+ * Decrements latch and wakes the thread waiting for it when it reaches 0. The
+ * latch might not exist anymore after that, the futex call only uses its
+ * address.
+ */
+void Workers::countDown(std::atomic<int> *latch) {
+    const int old = latch->fetch_sub(1, std::memory_order_acq_rel);
+    if(old == (LATCH_WAITING | 1))
+        syscall(__NR_futex, reinterpret_cast<int *>(latch), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Returns when latch is 0. Sleeps only after marking the latch, so that the
+ * last countDown() knows whether to wake anyone.
+ */
+void Workers::waitLatch(std::atomic<int> *latch) {
+    static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex needs plain int");
+    int value = latch->load(std::memory_order_acquire);
+    while((value & ~LATCH_WAITING) != 0) {
+        if(!(value & LATCH_WAITING)) {
+            if(!latch->compare_exchange_weak(value, value | LATCH_WAITING, std::memory_order_acq_rel))
+                continue;
+            value |= LATCH_WAITING;
+        }
+        syscall(__NR_futex, reinterpret_cast<int *>(latch), FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+        value = latch->load(std::memory_order_acquire);
+    }
+}
+
+/******************************************************************************\
+                                  Workers::Task
+\******************************************************************************/
+
+/**
+ * Returns once the task is executed. Spurious wakeups are handled, and the
+ * task can be reused afterwards.
+ */
+void Workers::Task::waitForCompletion() {
+    std::atomic<int> *latch = mLatch ? mLatch : &mPending;
+    if(mWorkers)
+        mWorkers->helpUntilDone(latch, mPriority);
+    waitLatch(latch);
+}
+
+void Workers::Task::execute() {
+    std::atomic<int> *latch = mLatch ? mLatch : &mPending;
+    Workers *workers = mWorkers;
+    const bool background = mPriority == BACKGROUND;
+    mFn(mData);
+    /* The task may be gone after this */
+    countDown(latch);
+    if(workers && background)
+        workers->mBackgroundPending.fetch_sub(1);
+}
+
+/******************************************************************************\
+                                 Workers::Deque
+\******************************************************************************/
+
+/**
+ * \class Workers::Deque
+ *
+ * Chase-Lev work stealing deque, with memory orders after Le et al., "Correct
+ * and Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013). It does
+ * not grow: push() fails when it is full.
+ */
+
+/**
+ * Adds task at the bottom. Called by the owner only.
+ */
+bool Workers::Deque::push(Task *task) {
+    const int64_t b = mBottom.load(std::memory_order_relaxed);
+    const int64_t t = mTop.load(std::memory_order_acquire);
+    if(b - t >= WORKERS_DEQUE_SIZE)
+        return false;
+
+    mTasks[b & (WORKERS_DEQUE_SIZE - 1)].store(task, std::memory_order_relaxed);
+    mBottom.store(b + 1, std::memory_order_release);
+    return true;
+}
+
+/**
+ * Takes the most recently pushed task. Called by the owner only.
+ */
+Workers::Task * Workers::Deque::pop() {
+    const int64_t b = mBottom.load(std::memory_order_relaxed) - 1;
+    mBottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = mTop.load(std::memory_order_relaxed);
+
+    if(t > b) {
+        /* Empty */
+        mBottom.store(b + 1, std::memory_order_relaxed);
+        return NULL;
+    }
+
+    Task *task = mTasks[b & (WORKERS_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+    if(t == b) {
+        /* Last task; thieves might be after it too */
+        if(!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            task = NULL;
+        mBottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+}
+
+/**
+ * Takes the oldest task. Returns NULL when the deque is empty or another
+ * thread took the task first.
+ */
+Workers::Task * Workers::Deque::steal() {
+    int64_t t = mTop.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t b = mBottom.load(std::memory_order_acquire);
+    if(t >= b)
+        return NULL;
+
+    Task *task = mTasks[t & (WORKERS_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+    if(!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return NULL;
+    return task;
+}
+
+/******************************************************************************\
+                             Workers::InjectionQueue
+\******************************************************************************/
+
+/**
+ * \class Workers::InjectionQueue
+ *
+ * Bounded MPMC queue by Dmitry Vyukov. A cell can be written when its
+ * sequence number equals the tail position, and read when it equals the
+ * head position + 1.
+ */
+
+Workers::InjectionQueue::InjectionQueue()
+    : mHead(0)
+    , mTail(0) {
+    for(size_t i = 0; i < WORKERS_INJECTION_SIZE; ++i)
+        mCells[i].seq.store(i, std::memory_order_relaxed);
+}
+
+/**
+ * Returns false when the queue is full.
+ */
+bool Workers::InjectionQueue::push(Task *task) {
+    size_t pos = mTail.load(std::memory_order_relaxed);
+    Cell *cell;
+    for(;;) {
+        cell = &mCells[pos & (WORKERS_INJECTION_SIZE - 1)];
+        const intptr_t diff = (intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)pos;
+        if(diff == 0) {
+            if(mTail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if(diff < 0) {
+            return false;
+        } else {
+            pos = mTail.load(std::memory_order_relaxed);
+        }
+    }
+    cell->task = task;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+/**
+ * Returns NULL when the queue is empty.
+ */
+Workers::Task * Workers::InjectionQueue::pop() {
+    size_t pos = mHead.load(std::memory_order_relaxed);
+    Cell *cell;
+    for(;;) {
+        cell = &mCells[pos & (WORKERS_INJECTION_SIZE - 1)];
+        const intptr_t diff = (intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+        if(diff == 0) {
+            if(mHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if(diff < 0) {
+            return NULL;
+        } else {
+            pos = mHead.load(std::memory_order_relaxed);
+        }
+    }
+    Task *task = cell->task;
+    cell->seq.store(pos + WORKERS_INJECTION_SIZE, std::memory_order_release);
+    return task;
+}
+
+/******************************************************************************\
+                               Workers::EventCount
+\******************************************************************************/
+
+/**
+ * Announces a waiter. Returns key for wait().
+ */
+int Workers::EventCount::prepareWait() {
+    mWaiters.fetch_add(1, std::memory_order_seq_cst);
+    return mEpoch.load(std::memory_order_seq_cst);
+}
+
+void Workers::EventCount::cancelWait() {
+    mWaiters.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+/**
+ * Sleeps unless notify() was called after prepareWait() returned key, for at
+ * most timeout (no limit if negative). Returns false if the time ran out.
+ */
+bool Workers::EventCount::wait(int key, nsecs_t timeout) {
+    static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex needs plain int");
+    const nsecs_t deadline = systemTime() + timeout;
+    bool notified = true;
+    while(mEpoch.load(std::memory_order_seq_cst) == key) {
+        struct timespec ts;
+        struct timespec *tsp = NULL;
+        if(timeout >= 0) {
+            const nsecs_t left = deadline - systemTime();
+            if(left <= 0) {
+                notified = false;
+                break;
+            }
+            ts.tv_sec = (time_t)(left / 1000000000);
+            ts.tv_nsec = (long)(left % 1000000000);
+            tsp = &ts;
+        }
+        syscall(__NR_futex, reinterpret_cast<int *>(&mEpoch), FUTEX_WAIT_PRIVATE, key, tsp, NULL, 0);
+    }
+    mWaiters.fetch_sub(1, std::memory_order_seq_cst);
+    return notified;
+}
+
+/**
+ * Wakes one or all waiters. Costs only a fence and a load when nobody waits.
+ */
+void Workers::EventCount::notify(bool all) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(mWaiters.load(std::memory_order_seq_cst) == 0)
+        return;
+    mEpoch.fetch_add(1, std::memory_order_seq_cst);
+    syscall(__NR_futex, reinterpret_cast<int *>(&mEpoch), FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, NULL, NULL, 0);
 }
 
 /******************************************************************************\
@@ -113,6 +747,112 @@ void Workers::queueTask(Workers::Task *task) {
  * Interal thread representation.
  */
 
+/**
+ * Returns task of the highest priority there is, or NULL if there is none.
+ * After WORKERS_STARVATION_LIMIT critical tasks in a row, a background task
+ * goes first.
+ */
+Workers::Task * Workers::Thread::findTask() {
+    Task *task;
+    if(mCriticalRun >= WORKERS_STARVATION_LIMIT) {
+        mCriticalRun = 0;
+        task = findTask(BACKGROUND);
+        if(task)
+            return task;
+    }
+
+    task = findTask(LATENCY_CRITICAL);
+    if(task) {
+        ++mCriticalRun;
+        return task;
+    }
+
+    mCriticalRun = 0;
+    return findTask(BACKGROUND);
+}
+
+/**
+ * Returns task of given priority from own deque, injection queue or other
+ * thread's deque, or NULL if there is none.
+ */
+Workers::Task * Workers::Thread::findTask(Priority priority) {
+    Deque &deque = mDeques[priority];
+    Task *task = deque.pop();
+    if(task)
+        return task;
+
+    Workers *workers = mParent;
+    InjectionQueue &injection = workers->mInjection[priority];
+    task = injection.pop();
+    if(task) {
+        unsigned moved = 0;
+        while(moved + 1 < WORKERS_INJECT_BATCH) {
+            Task *next = injection.pop();
+            if(!next)
+                break;
+            if(!deque.push(next)) {
+                while(!injection.push(next))
+                    sched_yield();
+                break;
+            }
+            ++moved;
+        }
+        if(moved > 0)
+            workers->mEvents.notify(false);
+        return task;
+    }
+
+    const size_t threadsNum = workers->mThreads.size();
+    for(size_t i = 1; i < threadsNum; ++i) {
+        task = workers->mThreads[(mId + i) % threadsNum]->mDeques[priority].steal();
+        if(task)
+            return task;
+    }
+    return NULL;
+}
+
+/**
+ * Lets other hyperthreads and the core's power management know that the
+ * thread is busy-waiting.
+ */
+static inline void cpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#elif defined(__arm__) || defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * Looks for a task for Workers::spinBudget() time. Gives the CPU away now and
+ * then, in case other threads wait for it.
+ */
+Workers::Task * Workers::Thread::spin() {
+    Workers *workers = mParent;
+    const nsecs_t start = systemTime();
+    const nsecs_t budget = workers->spinBudget(start);
+    if(budget <= 0)
+        return NULL;
+
+    Task *task = NULL;
+    nsecs_t now = start;
+    for(unsigned i = 1; now - start < budget && !workers->mExitRequest.load(std::memory_order_relaxed); ++i) {
+        cpuRelax();
+        if(i % 64 == 0)
+            sched_yield();
+        task = findTask();
+        if(task)
+            break;
+        now = systemTime();
+    }
+
+    workers->mSpinTime.fetch_add(systemTime() - start, std::memory_order_relaxed);
+    workers->mSpins.fetch_add(1, std::memory_order_relaxed);
+    if(task)
+        workers->mSpinHits.fetch_add(1, std::memory_order_relaxed);
+    return task;
+}
+
 /**
  * Thread main loop
  */
@@ -122,21 +862,47 @@ void *Workers::Thread::threadLoop(void *t) {
     Workers *workers = thread->mParent;
     assert(workers != NULL);
 
-    for(;;) {
-        Workers::Task *task = NULL;
+    pthread_setspecific(workers->mCurrentThread, thread);
 
-        {
-            Mutex::Autolock lock(workers->mMutex);
+    if(thread->mCpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(thread->mCpu, &set);
+        if(sched_setaffinity(0, sizeof(set), &set) != 0)
+            ALOGW("Could not pin worker thread %d to CPU %d", thread->mId, thread->mCpu);
+    }
 
-            while(workers->mTasks.empty() && !workers->mExitRequest)
-                workers->mCond.wait(workers->mMutex);
+    while(!workers->mExitRequest.load()) {
+        Workers::Task *task = thread->findTask();
+        if(!task)
+            task = thread->spin();
 
-            if(workers->mExitRequest)
+        if(!task) {
+            /* Check once more after announcing the wait, so that a task
+             * queued in between is not missed */
+            const int key = workers->mEvents.prepareWait();
+            if(workers->mExitRequest.load()) {
+                workers->mEvents.cancelWait();
                 break;
-
-            /* pop task from queue */
-            task = *workers->mTasks.begin();
-            workers->mTasks.erase(workers->mTasks.begin());
+            }
+            task = thread->findTask();
+            if(!task) {
+                /* Wakes up by itself shortly before the next frame, and
+                 * spins then */
+                const nsecs_t parkStart = systemTime();
+                const nsecs_t timeout = workers->parkTimeout(parkStart);
+                const bool notified = workers->mEvents.wait(key, timeout);
+                const nsecs_t parkEnd = systemTime();
+                if(!notified) {
+                    const nsecs_t late = parkEnd - parkStart - timeout;
+                    const nsecs_t average = workers->mOversleep.load(std::memory_order_relaxed);
+                    workers->mOversleep.store(average + (late - average) / 8, std::memory_order_relaxed);
+                }
+                workers->mParkTime.fetch_add(parkEnd - parkStart, std::memory_order_relaxed);
+                workers->mParks.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            workers->mEvents.cancelWait();
         }
 
         /* process task */
@@ -2,50 +2,106 @@
 #define WORKERS_H
 
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
 #include <utils/Mutex.h>
-#include <utils/Condition.h>
+#include <utils/Timers.h>
 #include <utils/Vector.h>
-#include <utils/List.h>
+
+/* Tasks held by one thread's deque; more go to the injection queue */
+#ifndef WORKERS_DEQUE_SIZE
+# define WORKERS_DEQUE_SIZE 256
+#endif
+
+/* Threads joining the caller in one parallelFor() */
+#ifndef WORKERS_MAX_HELPERS
+# define WORKERS_MAX_HELPERS 32
+#endif
+
+/* parallelFor() calls in progress at once, counting ones whose helpers have
+ * not all run yet; more run in the calling thread only */
+#ifndef WORKERS_MAX_LOOPS
+# define WORKERS_MAX_LOOPS 16
+#endif
+
+/* Tasks queued from outside of worker threads; queueTask() waits when full */
+#ifndef WORKERS_INJECTION_SIZE
+# define WORKERS_INJECTION_SIZE 1024
+#endif
+
+/* LATENCY_CRITICAL tasks run in a row before one BACKGROUND task gets its turn */
+#ifndef WORKERS_STARVATION_LIMIT
+# define WORKERS_STARVATION_LIMIT 16
+#endif
+
+/* Longest time (us) an idle thread spins waiting for the next frame before
+ * it sleeps, and wakes up before the frame is expected to spin across its
+ * start; "ro.camera.v4l2device.workers_spin" overrides it */
+#ifndef WORKERS_MAX_SPIN_US
+# define WORKERS_MAX_SPIN_US 200
+#endif
 
 namespace android {
 
 class Workers {
 public:
+    /**
+     * Classes of tasks. Threads take LATENCY_CRITICAL tasks first; BACKGROUND
+     * ones run when there are no others, or after WORKERS_STARVATION_LIMIT
+     * critical tasks in a row.
+     */
+    enum Priority {
+        LATENCY_CRITICAL = 0,
+        BACKGROUND,
+        PRIORITIES_NUM
+    };
+
     class Task {
 
     public:
         typedef void (*Function)(void *);
 
-        Task(Function fn, void *data): mFn(fn), mData(data), mCompleted(false) {}
+        Task(Function fn, void *data): mFn(fn), mData(data), mPending(1), mLatch(NULL), mWorkers(NULL), mPriority(LATENCY_CRITICAL) {}
         Task(): Task(NULL, NULL) {}
         Task& operator=(Task &&other) {
             mFn         = other.mFn;
             mData       = other.mData;
-            mCompleted  = other.mCompleted;
+            mPending.store(other.mPending.load());
+            mLatch      = other.mLatch;
+            mWorkers    = other.mWorkers;
+            mPriority   = other.mPriority;
             return *this;
         }
 
-        void waitForCompletion() {
-            mMutex.lock();
-            if(!mCompleted) {
-                mCond.wait(mMutex);
-            }
-            mMutex.unlock();
-        }
-
-        void execute() {
-            Mutex::Autolock lock(mMutex);
-            mFn(mData);
-            mCompleted = true;
-            mCond.signal();
-        }
+        void waitForCompletion();
+        void execute();
 
     private:
-        Mutex       mMutex;
-        Condition   mCond;
         Function    mFn;
         void       *mData;
-        bool        mCompleted;
+        /* 1 until executed, see countDown() */
+        std::atomic<int>    mPending;
+        /* Counter to decrement instead of mPending; parallelFor() helpers */
+        std::atomic<int>   *mLatch;
+        /* Set when queued; its threads help while waiting for the task */
+        Workers            *mWorkers;
+        Priority            mPriority;
+
+        friend class Workers;
+    };
+
+    /* Called with [begin, end) subranges of parallelFor() range */
+    typedef void (*RangeFunction)(void *data, size_t begin, size_t end);
+
+    /* Time idle threads spent since start(), summed over threads */
+    struct IdleStats {
+        nsecs_t     spinTime;
+        uint64_t    spins;
+        /* Spins which ended with a task found */
+        uint64_t    spinHits;
+        nsecs_t     parkTime;
+        uint64_t    parks;
     };
 
     Workers();
@@ -53,37 +109,172 @@ public:
 
     bool start();
     void stop();
-    bool isRunning() const { return mRunning; }
+    bool isRunning() const { return mRunning.load(); }
 
     unsigned threadsNum() { return (unsigned)mThreads.size(); }
+    static unsigned configuredThreadsNum();
 
-    void queueTask(Task *task);
+    void queueTask(Task *task, Priority priority = LATENCY_CRITICAL);
+    void parallelFor(size_t range, size_t grain, RangeFunction fn, void *data,
+                     Priority priority = LATENCY_CRITICAL);
+
+    void idleStats(IdleStats *stats) const;
+    uint64_t backgroundEpoch() const;
 
 private:
+    /**
+     * Chase-Lev deque of fixed size. The owner pushes and pops at the bottom,
+     * other threads steal from the top.
+     */
+    class Deque {
+    public:
+        Deque(): mTop(0), mBottom(0) {}
+
+        bool push(Task *task);
+        Task * pop();
+        Task * steal();
+
+    private:
+        std::atomic<int64_t>    mTop;
+        std::atomic<int64_t>    mBottom;
+        std::atomic<Task *>     mTasks[WORKERS_DEQUE_SIZE];
+    };
+
+    /**
+     * Bounded multi-producer, multi-consumer queue. Every cell carries
+     * a sequence number telling whether it is ready to be written or read.
+     */
+    class InjectionQueue {
+    public:
+        InjectionQueue();
+
+        bool push(Task *task);
+        Task * pop();
+
+    private:
+        struct Cell {
+            std::atomic<size_t> seq;
+            Task               *task;
+        };
+
+        Cell                    mCells[WORKERS_INJECTION_SIZE];
+        std::atomic<size_t>     mHead;
+        std::atomic<size_t>     mTail;
+    };
+
+    /**
+     * Lets threads sleep until there is new work, without a lock on the
+     * notifying side when nobody sleeps. A waiter announces itself with
+     * prepareWait(), checks for work once more and either cancels or sleeps
+     * on the futex, which wakes immediately if anything was notified since.
+     */
+    class EventCount {
+    public:
+        EventCount(): mEpoch(0), mWaiters(0) {}
+
+        int prepareWait();
+        void cancelWait();
+        bool wait(int key, nsecs_t timeout);
+        void notify(bool all);
+
+    private:
+        std::atomic<int>    mEpoch;
+        std::atomic<int>    mWaiters;
+    };
+
+    /**
+     * Range shared by parallelFor() caller and helpers. Subranges are taken
+     * by incrementing next, pending counts the ones not done yet. Helpers may
+     * run after the caller returned, so loops are kept in mLoops and reused
+     * once refs drops to 0.
+     */
+    struct Loop {
+        Loop(): refs(0) {}
+
+        Workers            *workers;
+        Priority            priority;
+        RangeFunction       fn;
+        void               *data;
+        size_t              range;
+        size_t              grain;
+        std::atomic<size_t> next;
+        std::atomic<int>    pending;
+        /* Caller and helpers which have not finished */
+        std::atomic<int>    refs;
+        Task                helpers[WORKERS_MAX_HELPERS];
+    };
+
+    Loop * acquireLoop(int refs);
+    static void runLoop(void *loop);
+    void runCritical();
+    static void countDown(std::atomic<int> *latch);
+    static void waitLatch(std::atomic<int> *latch);
+    void helpUntilDone(std::atomic<int> *latch, Priority priority);
+
+    class Thread;
+    Thread * currentThread();
+    void push(Task *task, Priority priority);
+    void noteSubmission();
+    nsecs_t spinBudget(nsecs_t now) const;
+    nsecs_t parkTimeout(nsecs_t now) const;
+
+    static size_t probeCpus(int *cpus, size_t *fastNum);
+
     class Thread {
     public:
-        Thread(int id, Workers *parent): mId(id), mParent(parent) {}
-        Thread(): mId(-1), mParent(NULL) {}
+        Thread(int id, int cpu, Workers *parent): mId(id), mCpu(cpu), mParent(parent), mCriticalRun(0) {}
 
         void run() { pthread_create(&mThread, NULL, threadLoop, this); }
         void join() { pthread_join(mThread, NULL); }
 
     private:
         int         mId;
+        /* CPU the thread is pinned to, or -1 */
+        int         mCpu;
         pthread_t   mThread;
         Workers    *mParent;
+        Deque       mDeques[PRIORITIES_NUM];
+        /* LATENCY_CRITICAL tasks taken since the last BACKGROUND one */
+        unsigned    mCriticalRun;
 
+        Task * findTask();
+        Task * findTask(Priority priority);
+        Task * spin();
         static void * threadLoop(void *t);
+
+        friend class Workers;
     };
     friend class Thread;
 
-    bool            mRunning;
-    bool            mExitRequest;
+    std::atomic<bool>   mRunning;
+    std::atomic<bool>   mExitRequest;
+
+    /* Serializes start() and stop() */
+    Mutex               mMutex;
+    InjectionQueue      mInjection[PRIORITIES_NUM];
+    EventCount          mEvents;
+    Vector<Thread *>    mThreads;
+    Loop                mLoops[WORKERS_MAX_LOOPS];
+    /* Thread * of the calling worker thread, NULL in other threads */
+    pthread_key_t       mCurrentThread;
+
+    /* Work comes in bursts, one per frame: start of the last one and
+     * average interval between them */
+    std::atomic<nsecs_t>    mLastBurst;
+    std::atomic<nsecs_t>    mBurstInterval;
+    nsecs_t                 mMaxSpin;
+    /* How late sleeps until the next burst end, on average */
+    std::atomic<nsecs_t>    mOversleep;
+
+    /* BACKGROUND tasks queued and not finished yet; all queued so far */
+    std::atomic<int>        mBackgroundPending;
+    std::atomic<uint64_t>   mBackgroundQueued;
 
-    Mutex           mMutex;
-    Condition       mCond;
-    List<Task *>    mTasks;
-    Vector<Thread>  mThreads;
+    std::atomic<nsecs_t>    mSpinTime;
+    std::atomic<uint64_t>   mSpins;
+    std::atomic<uint64_t>   mSpinHits;
+    std::atomic<nsecs_t>    mParkTime;
+    std::atomic<uint64_t>   mParks;
 };
 
 extern Workers gWorkers;
@@ -14,79 +14,148 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "Yuv422UyvyToJpegEncoder.h"
 
+using namespace android;
+
+/* Rows are aligned for SIMD kernels; padding also covers partial blocks at
+ * the right edge, which libjpeg reads in raw data mode */
+#define ROW_ALIGN 64
+#define MCU_LINES 16
+
+static size_t alignRow(size_t len) {
+    return (len + ROW_ALIGN - 1) & ~(size_t)(ROW_ALIGN - 1);
+}
+
 /**
  * \class Yuv422UyvyToJpegEncoder
  *
  * Converts YUV(UYVY) image to JPEG.
  *
  * This is slightly modified Yuv422IToJpegEncoder from Android (frameworks/base/core/jni/android/graphics/YuvToJpegEncoder.cpp).
+ * Rows are split into planes by ConverterKernels. Images encoded with a
+ * JpegCompressorPool context reuse its compressor, tables and row buffers.
  */
 
 Yuv422UyvyToJpegEncoder::Yuv422UyvyToJpegEncoder(int* strides) :
-        YuvToJpegEncoder(strides) {
+        Yuv422UyvyToJpegEncoder(strides, ConverterKernels::kernels().uyvyToI422Row) {
+}
+
+Yuv422UyvyToJpegEncoder::Yuv422UyvyToJpegEncoder(int* strides,
+        ConverterKernels::PackedToPlanar422Row deinterleaveRow) :
+        YuvToJpegEncoder(strides), fDeinterleaveRow(deinterleaveRow), fRows(NULL) {
     fNumPlanes = 1;
 }
 
+Yuv422UyvyToJpegEncoder::~Yuv422UyvyToJpegEncoder() {
+}
+
+/**
+ * Returns size of row buffers of a context: MCU_LINES rows of every plane.
+ */
+size_t Yuv422UyvyToJpegEncoder::rowsSize(int width) {
+    return MCU_LINES * (alignRow(width) + 2 * alignRow(width >> 1));
+}
+
+/**
+ * Encodes image of context's width and quality straight into dst, using the
+ * context's compressor. Tables are set up on its first image only. Restart
+ * interval (in MCUs) is written in headers when not 0. On success stores
+ * length of the image in *written; *overflow tells whether failure was
+ * caused by dst being too small.
+ */
+bool Yuv422UyvyToJpegEncoder::encode(JpegCompressorPool::Context* context, uint8_t* dst, size_t dstLen,
+        const uint8_t* yuv, int height, unsigned restartInterval, size_t* written, bool* overflow) {
+    jpeg_compress_struct* cinfo = &context->cinfo;
+    int offsets[] = { 0 };
+
+    context->dest.pub.next_output_byte = dst;
+    context->dest.pub.free_in_buffer = dstLen;
+    context->dest.overflow = false;
+    *overflow = false;
+    fRows = context->rows;
+
+    if (setjmp(context->err.jump)) {
+        *overflow = context->dest.overflow;
+        /* Drops the image, keeps tables for the next one */
+        jpeg_abort_compress(cinfo);
+        fRows = NULL;
+        return false;
+    }
+
+    if (!context->configured) {
+        setJpegCompressStruct(cinfo, context->width, height, context->quality);
+        context->configured = true;
+    }
+    cinfo->image_height = height;
+    cinfo->restart_interval = restartInterval;
+
+    jpeg_start_compress(cinfo, TRUE);
+    compress(cinfo, (uint8_t*)yuv, offsets);
+    jpeg_finish_compress(cinfo);
+
+    *written = dstLen - context->dest.pub.free_in_buffer;
+    fRows = NULL;
+    return true;
+}
+
 void Yuv422UyvyToJpegEncoder::compress(jpeg_compress_struct* cinfo,
         uint8_t* yuv, int* offsets) {
-    SkDebugf("onFlyCompress_422");
-    JSAMPROW y[16];
-    JSAMPROW cb[16];
-    JSAMPROW cr[16];
+    JSAMPROW y[MCU_LINES];
+    JSAMPROW cb[MCU_LINES];
+    JSAMPROW cr[MCU_LINES];
     JSAMPARRAY planes[3];
     planes[0] = y;
     planes[1] = cb;
     planes[2] = cr;
 
-    int width = cinfo->image_width;
-    int height = cinfo->image_height;
-    uint8_t* yRows = new uint8_t [16 * width];
-    uint8_t* uRows = new uint8_t [16 * (width >> 1)];
-    uint8_t* vRows = new uint8_t [16 * (width >> 1)];
+    const int width = cinfo->image_width;
+    const int height = cinfo->image_height;
+    const size_t yStride = alignRow(width);
+    const size_t cStride = alignRow(width >> 1);
+    /* Width of planes in whole blocks */
+    const int yPadded = (width + 15) & ~15;
+    const int cPadded = yPadded >> 1;
+
+    uint8_t* rows = fRows;
+    if (!rows && posix_memalign((void**)&rows, ROW_ALIGN, rowsSize(width)) != 0)
+        return;
+    uint8_t* yRows = rows;
+    uint8_t* uRows = yRows + MCU_LINES * yStride;
+    uint8_t* vRows = uRows + MCU_LINES * cStride;
 
     uint8_t* yuvOffset = yuv + offsets[0];
 
     // process 16 lines of Y and 16 lines of U/V each time.
     while (cinfo->next_scanline < cinfo->image_height) {
-        deinterleave(yuvOffset, yRows, uRows, vRows, cinfo->next_scanline, width, height);
-
-        // Jpeg library ignores the rows whose indices are greater than height.
-        for (int i = 0; i < 16; i++) {
-            // y row
-            y[i] = yRows + i * width;
-
-            // construct u row and v row
-            // width is halved because of downsampling
-            int offset = i * (width >> 1);
-            cb[i] = uRows + offset;
-            cr[i] = vRows + offset;
-        }
+        const int rowIndex = cinfo->next_scanline;
+        int numRows = height - rowIndex;
+        if (numRows > MCU_LINES) numRows = MCU_LINES;
 
-        jpeg_write_raw_data(cinfo, planes, 16);
-    }
-    delete [] yRows;
-    delete [] uRows;
-    delete [] vRows;
-}
+        for (int i = 0; i < MCU_LINES; i++) {
+            // rows past the bottom repeat the last one
+            const int row = i < numRows ? i : numRows - 1;
+            y[i] = yRows + row * yStride;
+            cb[i] = uRows + row * cStride;
+            cr[i] = vRows + row * cStride;
+            if (i != row)
+                continue;
 
-void Yuv422UyvyToJpegEncoder::deinterleave(uint8_t* yuv, uint8_t* yRows, uint8_t* uRows,
-        uint8_t* vRows, int rowIndex, int width, int height) {
-    int numRows = height - rowIndex;
-    if (numRows > 16) numRows = 16;
-    for (int row = 0; row < numRows; ++row) {
-        uint8_t* yuvSeg = yuv + (rowIndex + row) * fStrides[0];
-        for (int i = 0; i < (width >> 1); ++i) {
-            int indexY = row * width + (i << 1);
-            int indexU = row * (width >> 1) + i;
-            yRows[indexY] = yuvSeg[1];
-            yRows[indexY + 1] = yuvSeg[3];
-            uRows[indexU] = yuvSeg[0];
-            vRows[indexU] = yuvSeg[2];
-            yuvSeg += 4;
+            fDeinterleaveRow(yuvOffset + (rowIndex + i) * fStrides[0], y[i], cb[i], cr[i], width);
+            // repeat the right edge up to the block boundary
+            memset(y[i] + width, y[i][width - 1], yPadded - width);
+            memset(cb[i] + (width >> 1), cb[i][(width >> 1) - 1], cPadded - (width >> 1));
+            memset(cr[i] + (width >> 1), cr[i][(width >> 1) - 1], cPadded - (width >> 1));
         }
+
+        jpeg_write_raw_data(cinfo, planes, MCU_LINES);
     }
+
+    if (rows != fRows)
+        free(rows);
 }
 
 void Yuv422UyvyToJpegEncoder::configSamplingFactors(jpeg_compress_struct* cinfo) {
@@ -98,3 +167,14 @@ void Yuv422UyvyToJpegEncoder::configSamplingFactors(jpeg_compress_struct* cinfo)
     cinfo->comp_info[2].h_samp_factor = 1;
     cinfo->comp_info[2].v_samp_factor = 2;
 }
+
+/**
+ * \class Yuv422YuyvToJpegEncoder
+ *
+ * Converts YUV(YUYV) image to JPEG. Replaces Yuv422IToJpegEncoder from
+ * Android, which deinterleaves rows byte by byte.
+ */
+
+Yuv422YuyvToJpegEncoder::Yuv422YuyvToJpegEncoder(int* strides) :
+        Yuv422UyvyToJpegEncoder(strides, ConverterKernels::kernels().yuyvToI422Row) {
+}
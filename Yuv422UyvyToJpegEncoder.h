@@ -2,17 +2,36 @@
 #define YUV422UYVYTOJPEGENCODER_H
 
 #include <YuvToJpegEncoder.h>
+#include "ConverterKernels.h"
+#include "JpegCompressorPool.h"
 
 class Yuv422UyvyToJpegEncoder: public YuvToJpegEncoder {
 public:
     Yuv422UyvyToJpegEncoder(int* strides);
-    virtual ~Yuv422UyvyToJpegEncoder() {}
+    virtual ~Yuv422UyvyToJpegEncoder();
+
+    static size_t rowsSize(int width);
+
+    bool encode(android::JpegCompressorPool::Context* context, uint8_t* dst, size_t dstLen, const uint8_t* yuv,
+            int height, unsigned restartInterval, size_t* written, bool* overflow);
+    using YuvToJpegEncoder::encode;
+
+protected:
+    Yuv422UyvyToJpegEncoder(int* strides, android::ConverterKernels::PackedToPlanar422Row deinterleaveRow);
 
 private:
     void configSamplingFactors(jpeg_compress_struct* cinfo);
     void compress(jpeg_compress_struct* cinfo, uint8_t* yuv, int* offsets);
-    void deinterleave(uint8_t* yuv, uint8_t* yRows, uint8_t* uRows,
-            uint8_t* vRows, int rowIndex, int width, int height);
+
+    android::ConverterKernels::PackedToPlanar422Row fDeinterleaveRow;
+    /* Deinterleaved rows of one MCU row, from the context; allocated per
+     * image when not set */
+    uint8_t* fRows;
+};
+
+class Yuv422YuyvToJpegEncoder: public Yuv422UyvyToJpegEncoder {
+public:
+    Yuv422YuyvToJpegEncoder(int* strides);
 };
 
 #endif // YUV422UYVYTOJPEGENCODER_H